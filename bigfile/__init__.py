@@ -4,6 +4,12 @@ from .pyxbigfile import Error, FileClosedError, ColumnClosedError
 from .pyxbigfile import ColumnLowLevelAPI
 from .pyxbigfile import FileLowLevelAPI
 from .pyxbigfile import set_buffer_size
+from .pyxbigfile import set_fd_cache_size
+from .pyxbigfile import set_num_threads
+from .pyxbigfile import set_pipeline_depth
+from .pyxbigfile import set_checksum_chunk_size
+from .pyxbigfile import set_binary_header
+from .pyxbigfile import set_attr_version
 from . import pyxbigfile
 
 import os
@@ -142,6 +148,14 @@ class File(FileBase):
         block.open(self, blockname)
         return block
 
+    def open_blocks(self, blocknames):
+        """ Open many blocks at once; faster than opening them one by one.
+            Either all of them are opened, or Error is raised.
+        """
+        blocks = [Column() for blockname in blocknames]
+        pyxbigfile.open_blocks(self, blocks, blocknames)
+        return blocks
+
     def create(self, blockname, dtype=None, size=None, Nfile=1):
         block = Column()
         block.create(self, blockname, dtype, size, Nfile)
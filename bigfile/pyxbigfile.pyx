@@ -1,8 +1,8 @@
 #cython: embedsignature=True
 cimport numpy
 from libc.stddef cimport ptrdiff_t
-from libc.string cimport strcpy, memcpy
-from libc.stdlib cimport free
+from libc.string cimport strcpy, memcpy, memset
+from libc.stdlib cimport free, malloc
 import numpy
 
 numpy.import_array()
@@ -24,13 +24,19 @@ cdef extern from "bigfile.h":
         int nmemb
         char * basename
         size_t size
+        size_t * fsize
         int Nfile
         unsigned int * fchecksum;
         int dirty
         CBigAttrSet * attrset;
+        int directio
+        size_t crcsize
+        size_t * fcrcoffset
+        unsigned int * fcrc
 
     struct CBigBlockPtr "BigBlockPtr":
-        pass
+        int fileid
+        ptrdiff_t roffset
 
     struct CBigArray "BigArray":
         int ndim
@@ -63,6 +69,12 @@ cdef extern from "bigfile.h":
 
     char * big_file_get_error_message() nogil
     void big_file_set_buffer_size(size_t bytes) nogil
+    int big_file_set_fd_cache_size(int nfiles) nogil
+    int big_file_set_num_threads(int nthreads) nogil
+    int big_file_set_pipeline_depth(int depth) nogil
+    int big_file_set_checksum_chunk_size(size_t bytes) nogil
+    int big_file_set_binary_header(int enable) nogil
+    int big_file_set_attr_version(int version) nogil
     int big_block_grow(CBigBlock * bb, int Nfilegrow, size_t fsize[]) nogil
     int big_block_close(CBigBlock * block) nogil
     void _big_block_close_internal(CBigBlock * block) nogil
@@ -71,11 +83,16 @@ cdef extern from "bigfile.h":
 
     int big_block_flush(CBigBlock * block) nogil
     int big_block_set_dirty(CBigBlock * block, int dirty) nogil
+    void big_block_set_direct_io(CBigBlock * block, int value) nogil
+    int big_block_get_chunk_checksum(CBigBlock * block, int fileid, ptrdiff_t chunk, unsigned int * crc32c, size_t * bytes) nogil
     int big_block_seek(CBigBlock * bb, CBigBlockPtr * ptr, ptrdiff_t offset) nogil
     int big_block_seek_rel(CBigBlock * bb, CBigBlockPtr * ptr, ptrdiff_t rel) nogil
     int big_block_read(CBigBlock * bb, CBigBlockPtr * ptr, CBigArray * array) nogil
+    int big_block_map(CBigBlock * bb, CBigBlockPtr * ptr, size_t size, CBigArray * array) nogil
+    int big_block_unmap(CBigArray * array) nogil
     int big_block_write(CBigBlock * bb, CBigBlockPtr * ptr, CBigArray * array) nogil
     int big_block_set_attr(CBigBlock * block, char * attrname, void * data, char * dtype, int nmemb) nogil
+    int big_block_set_attrs(CBigBlock * block, CBigAttr * attrs, size_t nattrs) nogil
     int big_block_remove_attr(CBigBlock * block, char * attrname) nogil
     int big_block_get_attr(CBigBlock * block, char * attrname, void * data, char * dtype, int nmemb) nogil
     CBigAttr * big_block_lookup_attr(CBigBlock * block, char * attrname) nogil
@@ -83,6 +100,7 @@ cdef extern from "bigfile.h":
     int big_array_init(CBigArray * array, void * buf, char * dtype, int ndim, size_t dims[], ptrdiff_t strides[]) nogil
 
     int big_file_open_block(CBigFile * bf, CBigBlock * block, char * blockname) nogil
+    int big_file_open_blocks(CBigFile * bf, CBigBlock * blocks, const char * const * blocknames, int nblocks) nogil
     int big_file_create_block(CBigFile * bf, CBigBlock * block, char * blockname, char * dtype, int nmemb, int Nfile, size_t fsize[]) nogil
     int big_file_open(CBigFile * bf, char * basename) nogil
     int big_file_list(CBigFile * bf, char *** list, int * N) nogil
@@ -110,6 +128,43 @@ cdef extern from "bigfile-internal.h":
 def set_buffer_size(bytes):
     big_file_set_buffer_size(bytes)
 
+def set_fd_cache_size(nfiles):
+    """ Set the number of physical files a column keeps open between reads and writes.
+        0 disables the cache. Affects columns opened afterwards.
+    """
+    big_file_set_fd_cache_size(nfiles)
+
+def set_num_threads(nthreads):
+    """ Set the number of threads used to read or write a column;
+        the physical files of a column are shared among the threads. 1 is serial.
+    """
+    big_file_set_num_threads(nthreads)
+
+def set_pipeline_depth(depth):
+    """ Set the number of chunk buffers in flight when reading or writing a column.
+        With 2 or more, IO overlaps with the conversion of dtypes. 1 disables the pipeline.
+    """
+    big_file_set_pipeline_depth(depth)
+
+def set_checksum_chunk_size(nbytes):
+    """ Keep a CRC32C checksum of every nbytes of the physical files of columns
+        created afterwards, in a `checksum` file next to the header. 0 disables.
+    """
+    big_file_set_checksum_chunk_size(nbytes)
+
+def set_binary_header(enable):
+    """ Also write a binary copy of the header of columns, which opens faster
+        with many physical files. The text header is always written.
+    """
+    big_file_set_binary_header(1 if enable else 0)
+
+def set_attr_version(version):
+    """ Set the format of the attribute files written: 2 (the default) for the
+        text file attr-v2, 3 for the binary file attr-v3. Both are read.
+    """
+    if 0 != big_file_set_attr_version(version):
+        raise Error()
+
 class Error(Exception):
     def __init__(self, msg=None):
         cdef char * errmsg = big_file_get_error_message()
@@ -199,6 +254,22 @@ cdef class FileLowLevelAPI:
         #never really need to close, since we are just freeing a few memory blocks
         pass
 
+def _attr_value(value):
+    if isstr(value):
+        dtype = b'a1'
+        value = numpy.array(str(value).encode()).ravel().view(dtype='S1').ravel()
+    else:
+        value = numpy.array(value).ravel()
+
+        if value.dtype.char == 'U':
+            value = numpy.array([i.encode() for i in value])
+
+        if value.dtype.hasobject:
+            raise ValueError("Attribute value of object type is not supported; serialize it first")
+
+        dtype = value.dtype.base.str.encode()
+    return dtype, value
+
 cdef class AttrSet:
     cdef readonly ColumnLowLevelAPI bb
 
@@ -247,22 +318,7 @@ cdef class AttrSet:
 
     def __setitem__(self, name, value):
         name = name.encode()
-
-
-
-        if isstr(value):
-            dtype = b'a1'
-            value = numpy.array(str(value).encode()).ravel().view(dtype='S1').ravel()
-        else:
-            value = numpy.array(value).ravel()
-
-            if value.dtype.char == 'U':
-                value = numpy.array([i.encode() for i in value])
-
-            if value.dtype.hasobject:
-                raise ValueError("Attribute value of object type is not supported; serialize it first")
-
-            dtype = value.dtype.base.str.encode()
+        dtype, value = _attr_value(value)
 
         cdef numpy.ndarray buf = value
 
@@ -271,6 +327,29 @@ cdef class AttrSet:
                 buf.shape[0])):
             raise Error();
 
+    def update(self, *args, **kwargs):
+        """ Set many attributes at once; faster than setting them one by one. """
+        items = list(dict(*args, **kwargs).items())
+        names = [name.encode() for name, value in items]
+        values = [_attr_value(value) for name, value in items]
+
+        cdef numpy.ndarray buf
+        cdef CBigAttr * attrs = <CBigAttr *> malloc(sizeof(CBigAttr) * max(len(items), 1))
+        if attrs == NULL:
+            raise MemoryError()
+        try:
+            for i in range(len(items)):
+                dtype, buf = values[i]
+                attrs[i].name = names[i]
+                attrs[i].data = buf.data
+                attrs[i].nmemb = buf.shape[0]
+                memset(attrs[i].dtype, 0, 8)
+                strcpy(attrs[i].dtype, dtype)
+            if(0 != big_block_set_attrs(&self.bb.bb, attrs, len(items))):
+                raise Error();
+        finally:
+            free(attrs)
+
     def __repr__(self):
         t = ("<BigAttr (%s)>" %
             ','.join([ "%s=%s" %
@@ -278,6 +357,19 @@ cdef class AttrSet:
                 for key in self]))
         return t
 
+cdef class _MappedView:
+    """ Owns a mapping made by big_block_map; numpy arrays made from
+        the view keep it alive via their base. """
+    cdef CBigArray array
+    cdef readonly dict __array_interface__
+
+    def __cinit__(self):
+        self.array.data = NULL
+        self.array.size = 0
+
+    def __dealloc__(self):
+        big_block_unmap(&self.array)
+
 # An unpickle function via __reduce__ is needed for Python 2;
 # c.f. https://github.com/cython/cython/issues/2757
 def _unpickle_column(kls, state):
@@ -305,6 +397,28 @@ cdef class ColumnLowLevelAPI:
     property attrs:
         def __get__(self):
             return AttrSet(self)
+    property direct_io:
+        """ Whether reads and writes bypass the page cache (O_DIRECT). """
+        def __get__(self):
+            return self.bb.directio != 0
+        def __set__(self, value):
+            big_block_set_direct_io(&self.bb, 1 if value else 0)
+
+    def chunk_checksum(self, int fileid, ptrdiff_t chunk):
+        """ The CRC32C of a chunk of a physical file and the number of bytes it covers,
+            from offset chunk * crcsize of the file.
+        """
+        cdef unsigned int crc
+        cdef size_t nbytes
+        if 0 != big_block_get_chunk_checksum(&self.bb, fileid, chunk, &crc, &nbytes):
+            raise Error()
+        return crc, nbytes
+
+    property crcsize:
+        """ Bytes per chunk checksum, 0 if the column has none. """
+        def __get__(self):
+            return self.bb.crcsize
+
     property Nfile:
         def __get__(self):
             return self.bb.Nfile
@@ -504,6 +618,42 @@ cdef class ColumnLowLevelAPI:
             raise Error()
         return result
 
+    def map(self, numpy.intp_t start, numpy.intp_t length):
+        """ returns a read-only array of `length' items from offset `start',
+            mapped from the physical file without copying.
+
+            If the items span several physical files, falls back to read.
+        """
+        cdef CBigBlockPtr ptr
+        cdef _MappedView view
+        if length == -1:
+            length = self.size - start
+        if length + start > self.size:
+            length = self.size - start
+
+        with nogil:
+            rt = big_block_seek(&self.bb, &ptr, start)
+        if rt != 0:
+            raise Error()
+
+        if length == 0 or ptr.roffset + length > self.bb.fsize[ptr.fileid]:
+            return self.read(start, length)
+
+        view = _MappedView()
+        with nogil:
+            rt = big_block_map(&self.bb, &ptr, length, &view.array)
+        if rt != 0:
+            raise Error()
+
+        dtype = self.dtype
+        view.__array_interface__ = dict(
+            version=3,
+            shape=(length, ) + dtype.shape,
+            typestr=dtype.base.str,
+            data=(<size_t> view.array.data, True),
+        )
+        return numpy.asarray(view)
+
     def _flush(self):
         with nogil:
             rt = big_block_flush(&self.bb)
@@ -528,6 +678,9 @@ cdef class ColumnLowLevelAPI:
         if comm.rank != root:
             _big_block_close_internal(&self.bb)
             _big_block_unpack(&self.bb, container.data)
+            # chunk checksums are reduced with XOR at flush
+            if self.bb.crcsize > 0:
+                memset(self.bb.fcrc, 0, self.bb.fcrcoffset[self.bb.Nfile] * sizeof(unsigned int))
 
         if comm.rank == root:
             free(buf)
@@ -547,6 +700,16 @@ cdef class ColumnLowLevelAPI:
             for i in range(Nfile):
                 fchecksum[i] = fchecksum2[i]
 
+        cdef unsigned int[:] fcrc
+        cdef unsigned int[:] fcrc2
+        cdef size_t ncrc = self.bb.fcrcoffset[Nfile] if self.bb.crcsize > 0 else 0
+        if ncrc > 0:
+            from mpi4py import MPI
+            fcrc = <unsigned int[:ncrc]>self.bb.fcrc
+            fcrc2 = fcrc.copy()
+            comm.Allreduce(fcrc, fcrc2, op=MPI.BXOR)
+            fcrc[:] = fcrc2
+
         cdef int rt
 
         if comm.rank == 0:
@@ -586,6 +749,37 @@ cdef class ColumnLowLevelAPI:
         return "<CBigBlock: %s dtype=%s, size=%d>" % (self.bb.basename,
                 self.dtype, self.size)
 
+def open_blocks(FileLowLevelAPI f, columns, blocknames):
+    """ Open the blocks of blocknames into columns, unopened ColumnLowLevelAPI objects,
+        at once; faster than opening them one by one. Either all of them are opened,
+        or none is and Error is raised.
+    """
+    cdef int n = len(blocknames)
+    cdef ColumnLowLevelAPI column
+    if len(columns) != n:
+        raise ValueError("Expecting one column per block")
+
+    # need to hold the reference
+    names = [blockname.encode() for blockname in blocknames]
+    cdef const char ** nameptrs = <const char **> malloc(sizeof(char *) * max(n, 1))
+    cdef CBigBlock * blocks = <CBigBlock *> malloc(sizeof(CBigBlock) * max(n, 1))
+    try:
+        if nameptrs == NULL or blocks == NULL:
+            raise MemoryError()
+        for i in range(n):
+            nameptrs[i] = names[i]
+        with nogil:
+            rt = big_file_open_blocks(&f.bf, blocks, nameptrs, n)
+        if rt != 0:
+            raise Error()
+        for i in range(n):
+            column = columns[i]
+            column.bb = blocks[i]
+            column._deallocated = False
+    finally:
+        free(nameptrs)
+        free(blocks)
+
 cdef class Dataset:
     cdef CBigRecordType rtype
     cdef readonly FileLowLevelAPI file
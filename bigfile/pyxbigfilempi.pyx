@@ -0,0 +1,484 @@
+#cython: embedsignature=True
+# The binding of the collective C API in bigfile-mpi.h.
+#
+# This module carries its own copy of the C library, thus the error message
+# and the settings of pyxbigfile do not apply here.
+# The communicators are mpi4py communicators, passed in with comm.py2f().
+
+cimport numpy
+from libc.stddef cimport ptrdiff_t
+from libc.stdlib cimport free, malloc
+import numpy
+
+from .pyxbigfile import Error as _Error
+
+numpy.import_array()
+
+cdef extern from "mpi.h":
+    ctypedef struct _mpi_comm_t
+    ctypedef _mpi_comm_t * MPI_Comm
+    ctypedef int MPI_Fint
+    MPI_Comm MPI_Comm_f2c(MPI_Fint comm) nogil
+    ctypedef struct _mpi_info_t
+    ctypedef _mpi_info_t * MPI_Info
+    MPI_Info MPI_INFO_NULL
+    int MPI_Info_create(MPI_Info * info) nogil
+    int MPI_Info_set(MPI_Info info, char * key, char * value) nogil
+    int MPI_Info_free(MPI_Info * info) nogil
+
+cdef extern from "bigfile.h":
+    struct CBigFile "BigFile":
+        char * basename
+
+    struct CBigBlock "BigBlock":
+        char * dtype
+        int nmemb
+        char * basename
+        size_t size
+        int Nfile
+
+    struct CBigBlockPtr "BigBlockPtr":
+        int fileid
+        ptrdiff_t roffset
+
+    struct CBigArray "BigArray":
+        pass
+
+    char * big_file_get_error_message() nogil
+    int big_file_close(CBigFile * bf) nogil
+    int big_block_seek(CBigBlock * bb, CBigBlockPtr * ptr, ptrdiff_t offset) nogil
+    int big_array_init(CBigArray * array, void * buf, char * dtype, int ndim, size_t dims[], ptrdiff_t strides[]) nogil
+
+cdef extern from "bigfile-internal.h":
+    void _big_block_close_internal(CBigBlock * block) nogil
+
+cdef extern from "bigfile-mpi.h":
+    int big_file_mpi_open(CBigFile * bf, char * basename, MPI_Comm comm) nogil
+    int big_file_mpi_create(CBigFile * bf, char * basename, MPI_Comm comm) nogil
+    int big_file_mpi_close(CBigFile * bf, MPI_Comm comm) nogil
+    int big_file_mpi_open_block(CBigFile * bf, CBigBlock * block, char * blockname, MPI_Comm comm) nogil
+    int big_file_mpi_open_blocks(CBigFile * bf, CBigBlock * blocks, const char * const * blocknames, int nblocks, MPI_Comm comm) nogil
+    int big_file_mpi_create_block(CBigFile * bf, CBigBlock * block, char * blockname, char * dtype, int nmemb, int Nfile, size_t size, MPI_Comm comm) nogil
+    int big_block_mpi_close(CBigBlock * block, MPI_Comm comm) nogil
+    int big_block_mpi_flush(CBigBlock * block, MPI_Comm comm) nogil
+    int big_block_mpi_write(CBigBlock * bb, CBigBlockPtr * ptr, CBigArray * array, int concurrency, MPI_Comm comm) nogil
+    int big_block_mpi_read(CBigBlock * bb, CBigBlockPtr * ptr, CBigArray * array, int concurrency, MPI_Comm comm) nogil
+    struct CBigBlockMPIWrite "BigBlockMPIWrite":
+        pass
+
+    struct CBigFileMPIPlan "BigFileMPIPlan":
+        pass
+
+    int big_file_mpi_plan_create(CBigFileMPIPlan ** plan, size_t localsize, int concurrency, MPI_Comm comm) nogil
+    void big_file_mpi_plan_free(CBigFileMPIPlan * plan) nogil
+    int big_block_mpi_write_planned(CBigBlock * bb, CBigBlockPtr * ptr, CBigArray * array, CBigFileMPIPlan * plan) nogil
+    int big_block_mpi_read_planned(CBigBlock * bb, CBigBlockPtr * ptr, CBigArray * array, CBigFileMPIPlan * plan) nogil
+
+    int big_block_mpi_write_begin(CBigBlock * bb, CBigBlockPtr * ptr, CBigArray * array, int concurrency, int copy, MPI_Comm comm, CBigBlockMPIWrite ** request) nogil
+    int big_block_mpi_write_end(CBigBlockMPIWrite * request) nogil
+    void big_file_mpi_set_progress_thread(int enable) nogil
+    int big_file_mpi_get_progress_thread() nogil
+    void big_file_mpi_set_aggregated_threshold(size_t bytes) nogil
+    size_t big_file_mpi_get_aggregated_threshold() nogil
+    void big_file_mpi_set_aggregated_slab_size(size_t bytes) nogil
+    size_t big_file_mpi_get_aggregated_slab_size() nogil
+    void big_file_mpi_set_collective_buffer_size(size_t bytes) nogil
+    size_t big_file_mpi_get_collective_buffer_size() nogil
+    void big_file_mpi_set_mpiio(int enable, MPI_Info info) nogil
+    int big_file_mpi_get_mpiio() nogil
+
+class Error(_Error):
+    def __init__(self, msg=None):
+        cdef char * errmsg = big_file_get_error_message()
+        if msg is None:
+            if errmsg == NULL:
+                msg = "Unknown error (could have been swallowed due to poor threading support)"
+            else:
+                msg = errmsg
+        _Error.__init__(self, msg)
+
+def set_aggregated_threshold(size_t bytes):
+    """ Aggregate the data of a writer group to its leader rank if it is less than bytes;
+        0 disables. """
+    big_file_mpi_set_aggregated_threshold(bytes)
+
+def get_aggregated_threshold():
+    return big_file_mpi_get_aggregated_threshold()
+
+def set_aggregated_slab_size(size_t bytes):
+    """ The leader rank of an aggregated IO moves the data of its group in slabs of bytes. """
+    big_file_mpi_set_aggregated_slab_size(bytes)
+
+def get_aggregated_slab_size():
+    return big_file_mpi_get_aggregated_slab_size()
+
+def set_collective_buffer_size(size_t bytes):
+    """ Enable the two-phase collective IO, with a buffer of bytes per aggregator;
+        0 disables. """
+    big_file_mpi_set_collective_buffer_size(bytes)
+
+def get_collective_buffer_size():
+    return big_file_mpi_get_collective_buffer_size()
+
+def set_progress_thread(enable):
+    """ Whether ColumnMPILowLevelAPI.write_begin writes in a progress thread,
+        where MPI provides MPI_THREAD_MULTIPLE. """
+    big_file_mpi_set_progress_thread(1 if enable else 0)
+
+def get_progress_thread():
+    return big_file_mpi_get_progress_thread() != 0
+
+def set_mpiio(enable, hints=None):
+    """ Use the MPI-IO backend for the collective reads and writes;
+        hints is a dict of the hints to MPI_File_open, e.g. {'cb_nodes' : '4'}. """
+    cdef MPI_Info info = MPI_INFO_NULL
+    if hints is not None:
+        MPI_Info_create(&info)
+        for key, value in hints.items():
+            key = str(key).encode()
+            value = str(value).encode()
+            MPI_Info_set(info, key, value)
+    # the info is copied
+    big_file_mpi_set_mpiio(1 if enable else 0, info)
+    if hints is not None:
+        MPI_Info_free(&info)
+
+def get_mpiio():
+    return big_file_mpi_get_mpiio() != 0
+
+cdef MPI_Comm _mpicomm(comm):
+    return MPI_Comm_f2c(comm.py2f())
+
+cdef int _array_init(CBigArray * array, numpy.ndarray buf) except -1:
+    dtype = buf.dtype.str.encode()
+    big_array_init(array, buf.data, dtype,
+            buf.ndim,
+            <size_t *> buf.shape,
+            <ptrdiff_t *> buf.strides)
+    return 0
+
+cdef class FileMPILowLevelAPI:
+    """ A BigFile opened collectively on comm. """
+    cdef CBigFile bf
+    cdef MPI_Comm mpicomm
+    cdef readonly comm
+    cdef int _deallocated
+
+    def __cinit__(self):
+        self._deallocated = True
+
+    def __init__(self, comm, filename, create=False):
+        """ if create is True, create the file if it is nonexisting"""
+        filename = filename.encode()
+        cdef char * filenameptr = filename
+        self.comm = comm
+        self.mpicomm = _mpicomm(comm)
+        if create:
+            with nogil:
+                rt = big_file_mpi_create(&self.bf, filenameptr, self.mpicomm)
+        else:
+            with nogil:
+                rt = big_file_mpi_open(&self.bf, filenameptr, self.mpicomm)
+        if rt != 0:
+            raise Error()
+        self._deallocated = False
+
+    def __dealloc__(self):
+        # not collective; only frees the memory.
+        if not self._deallocated:
+            big_file_close(&self.bf)
+            self._deallocated = True
+
+    property basename:
+        def __get__(self):
+            return '%s' % self.bf.basename.decode()
+
+    def open_blocks(self, blocknames):
+        """ Open the blocks of blocknames at once, with one broadcast;
+            faster than opening them one by one.
+            Either all of them are opened, or Error is raised.
+        """
+        cdef int n = len(blocknames)
+        cdef ColumnMPILowLevelAPI column
+
+        # need to hold the reference
+        names = [blockname.encode() for blockname in blocknames]
+        cdef const char ** nameptrs = <const char **> malloc(sizeof(char *) * max(n, 1))
+        cdef CBigBlock * blocks = <CBigBlock *> malloc(sizeof(CBigBlock) * max(n, 1))
+        try:
+            if nameptrs == NULL or blocks == NULL:
+                raise MemoryError()
+            for i in range(n):
+                nameptrs[i] = names[i]
+            with nogil:
+                rt = big_file_mpi_open_blocks(&self.bf, blocks, nameptrs, n, self.mpicomm)
+            if rt != 0:
+                raise Error()
+            columns = []
+            for i in range(n):
+                column = ColumnMPILowLevelAPI(self.comm)
+                column.bb = blocks[i]
+                column._deallocated = False
+                columns.append(column)
+            return columns
+        finally:
+            free(nameptrs)
+            free(blocks)
+
+    def close(self):
+        if not self._deallocated:
+            with nogil:
+                rt = big_file_mpi_close(&self.bf, self.mpicomm)
+            self._deallocated = True
+            if rt != 0:
+                raise Error()
+
+cdef class ColumnMPILowLevelAPI:
+    """ A BigBlock opened collectively on comm. """
+    cdef CBigBlock bb
+    cdef MPI_Comm mpicomm
+    cdef readonly comm
+    cdef int _deallocated
+
+    property size:
+        def __get__(self):
+            return self.bb.size
+
+    property dtype:
+        def __get__(self):
+            if self.bb.nmemb != 1:
+                return numpy.dtype((self.bb.dtype, (self.bb.nmemb, )))
+            else:
+                return numpy.dtype(self.bb.dtype)
+
+    property Nfile:
+        def __get__(self):
+            return self.bb.Nfile
+
+    def __cinit__(self):
+        self._deallocated = True
+
+    def __init__(self, comm):
+        self.comm = comm
+        self.mpicomm = _mpicomm(comm)
+
+    def __dealloc__(self):
+        # not collective; only frees the memory.
+        if not self._deallocated:
+            _big_block_close_internal(&self.bb)
+            self._deallocated = True
+
+    def open(self, FileMPILowLevelAPI f, blockname):
+        blockname = blockname.encode()
+        cdef char * blocknameptr = blockname
+        with nogil:
+            rt = big_file_mpi_open_block(&f.bf, &self.bb, blocknameptr, self.mpicomm)
+        if rt != 0:
+            raise Error()
+        self._deallocated = False
+
+    def create(self, FileMPILowLevelAPI f, blockname, dtype=None, size=0, int Nfile=1):
+        # need to hold the reference
+        blockname = blockname.encode()
+        cdef char * blocknameptr = blockname
+        cdef char * dtypeptr = NULL
+        cdef int items = 0
+        cdef size_t csize = size
+
+        if dtype is None:
+            Nfile = 0
+            csize = 0
+        else:
+            dtype = numpy.dtype(dtype)
+            assert len(dtype.shape) <= 1
+            if len(dtype.shape) == 0:
+                items = 1
+            else:
+                items = dtype.shape[0]
+            dtype2 = dtype.base.str.encode()
+            dtypeptr = dtype2
+        with nogil:
+            rt = big_file_mpi_create_block(&f.bf, &self.bb, blocknameptr, dtypeptr,
+                    items, Nfile, csize, self.mpicomm)
+        if rt != 0:
+            raise Error()
+        self._deallocated = False
+
+    def write(self, numpy.intp_t start, numpy.ndarray buf, int concurrency=1):
+        """ collectively write at offset `start' the local chunks of data in buf,
+            one after another in the order of the ranks.
+        """
+        cdef CBigArray array
+        cdef CBigBlockPtr ptr
+
+        _array_init(&array, buf)
+        with nogil:
+            rt = big_block_seek(&self.bb, &ptr, start)
+        if rt != 0:
+            raise Error()
+
+        with nogil:
+            rt = big_block_mpi_write(&self.bb, &ptr, &array, concurrency, self.mpicomm)
+        if rt != 0:
+            raise Error()
+
+    def read(self, numpy.intp_t start, numpy.intp_t length, int concurrency=1):
+        """ collectively read from offset `start' length items on each rank,
+            one after another in the order of the ranks.
+        """
+        cdef CBigArray array
+        cdef CBigBlockPtr ptr
+        cdef numpy.ndarray result = numpy.empty(length, self.dtype)
+
+        _array_init(&array, result)
+        with nogil:
+            rt = big_block_seek(&self.bb, &ptr, start)
+        if rt != 0:
+            raise Error()
+
+        with nogil:
+            rt = big_block_mpi_read(&self.bb, &ptr, &array, concurrency, self.mpicomm)
+        if rt != 0:
+            raise Error()
+        return result
+
+    def write_begin(self, numpy.intp_t start, numpy.ndarray buf, int concurrency=1, copy=True):
+        """ start a collective write like write, and return a WriteMPIRequest
+            before the write is done; WriteMPIRequest.end waits for it.
+
+            With copy, the write is from a snapshot of buf, and buf can be reused at once;
+            otherwise buf must not be modified until the write ends.
+            The column must not be used until the write ends.
+        """
+        cdef WriteMPIRequest request = WriteMPIRequest()
+        cdef CBigArray array
+        cdef int ccopy = 1 if copy else 0
+
+        _array_init(&array, buf)
+        with nogil:
+            rt = big_block_seek(&self.bb, &request.ptr, start)
+        if rt != 0:
+            raise Error()
+
+        with nogil:
+            rt = big_block_mpi_write_begin(&self.bb, &request.ptr, &array, concurrency, ccopy,
+                    self.mpicomm, &request.req)
+        if rt != 0:
+            raise Error()
+        request.column = self
+        if not copy:
+            request.buf = buf
+        return request
+
+    def write_planned(self, numpy.intp_t start, numpy.ndarray buf, PlanMPI plan):
+        """ write like write, with the concurrency and the comm of plan;
+            buf must have the rows of the plan on each rank.
+        """
+        cdef CBigArray array
+        cdef CBigBlockPtr ptr
+        cdef CBigFileMPIPlan * cplan = plan._get()
+
+        _array_init(&array, buf)
+        with nogil:
+            rt = big_block_seek(&self.bb, &ptr, start)
+        if rt != 0:
+            raise Error()
+
+        with nogil:
+            rt = big_block_mpi_write_planned(&self.bb, &ptr, &array, cplan)
+        if rt != 0:
+            raise Error()
+
+    def read_planned(self, numpy.intp_t start, PlanMPI plan):
+        """ read like read, the rows of the plan on each rank,
+            with the concurrency and the comm of plan.
+        """
+        cdef CBigArray array
+        cdef CBigBlockPtr ptr
+        cdef CBigFileMPIPlan * cplan = plan._get()
+        cdef numpy.ndarray result = numpy.empty(plan.localsize, self.dtype)
+
+        _array_init(&array, result)
+        with nogil:
+            rt = big_block_seek(&self.bb, &ptr, start)
+        if rt != 0:
+            raise Error()
+
+        with nogil:
+            rt = big_block_mpi_read_planned(&self.bb, &ptr, &array, cplan)
+        if rt != 0:
+            raise Error()
+        return result
+
+    def flush(self):
+        if not self._deallocated:
+            with nogil:
+                rt = big_block_mpi_flush(&self.bb, self.mpicomm)
+            if rt != 0:
+                raise Error()
+
+    def close(self):
+        if not self._deallocated:
+            with nogil:
+                rt = big_block_mpi_close(&self.bb, self.mpicomm)
+            self._deallocated = True
+            if rt != 0:
+                raise Error()
+
+    def __repr__(self):
+        if self._deallocated:
+            return "<CBigBlockMPI: Closed>"
+
+        return "<CBigBlockMPI: %s dtype=%s, size=%d>" % (self.bb.basename,
+                self.dtype, self.bb.size)
+
+cdef class WriteMPIRequest:
+    """ A write started by ColumnMPILowLevelAPI.write_begin.
+        end shall be called collectively, or the write never finishes.
+    """
+    cdef CBigBlockMPIWrite * req
+    cdef CBigBlockPtr ptr
+    # hold the references until the write ends
+    cdef column
+    cdef buf
+
+    def end(self):
+        """ wait for the write; raises Error if it failed. """
+        if self.req == NULL:
+            raise ValueError("The write has ended")
+        with nogil:
+            rt = big_block_mpi_write_end(self.req)
+        self.req = NULL
+        self.column = None
+        self.buf = None
+        if rt != 0:
+            raise Error()
+
+cdef class PlanMPI:
+    """ The offsets and the writer groups of collective writes and reads of
+        localsize rows per rank, set up once for many columns.
+        free shall be called collectively; the plan is not freed otherwise.
+    """
+    cdef CBigFileMPIPlan * plan
+    cdef readonly comm
+    cdef readonly size_t localsize
+
+    def __init__(self, comm, size_t localsize, int concurrency=1):
+        cdef MPI_Comm mpicomm = _mpicomm(comm)
+        with nogil:
+            rt = big_file_mpi_plan_create(&self.plan, localsize, concurrency, mpicomm)
+        if rt != 0:
+            raise Error()
+        self.comm = comm
+        self.localsize = localsize
+
+    cdef CBigFileMPIPlan * _get(self) except NULL:
+        if self.plan == NULL:
+            raise ValueError("The plan is freed")
+        return self.plan
+
+    def free(self):
+        if self.plan != NULL:
+            with nogil:
+                big_file_mpi_plan_free(self.plan)
+            self.plan = NULL
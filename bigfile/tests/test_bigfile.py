@@ -305,6 +305,7 @@ def test_attr(comm):
         b.attrs['bool'] = True
         b.attrs['arrayustring'] = numpy.array(u'unicode')
         b.attrs['arraysstring'] = numpy.array('str')
+        b.attrs['longstrings'] = ['x' * 20, 'y' * 17]
 
     with x.open('.') as b:
         assert_equal(b.attrs['int'], 128)
@@ -312,6 +313,7 @@ def test_attr(comm):
         assert_equal(b.attrs['string'],  'abcdefg')
         assert_equal(b.attrs['complex'],  128 + 128J)
         assert_equal(b.attrs['bool'],  True)
+        assert_equal(b.attrs['longstrings'], ['x' * 20, 'y' * 17])
         b.attrs['int'] = 30
         b.attrs['float'] = [3, 4]
         b.attrs['string'] = 'defg'
@@ -327,6 +329,33 @@ def test_attr(comm):
 
     shutil.rmtree(fname)
 
+def test_attr_update():
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+    with x.create('block', dtype=None) as b:
+        b.attrs['int'] = 1
+        b.attrs.update(('attr%d' % i, i) for i in range(500))
+        b.attrs.update(int=[2, 3], string='abc')
+        # strings longer than any numerical dtype, as with a single attribute
+        longnames = ['x' * 20, 'y' * 17]
+        b.attrs['longname'] = longnames
+        b.attrs.update(longnames=longnames)
+        def set_blank():
+            b.attrs.update({'a b' : 1, 'attr0' : -1})
+        assert_raises(BigFileError, set_blank)
+
+    with x.open('block') as b:
+        assert_equal(b.attrs['int'], [2, 3])
+        assert_equal(b.attrs['string'], 'abc')
+        assert_equal(b.attrs['longname'], longnames)
+        assert_equal(b.attrs['longnames'], longnames)
+        assert_equal(b.attrs['attr0'], 0)
+        assert_equal(b.attrs['attr499'], 499)
+        assert 'a b' not in b.attrs
+        assert_equal(len(b.attrs.keys()), 504)
+
+    shutil.rmtree(fname)
+
 @pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
 @pytest.mark.mpi
 def test_mpi_create(comm):
@@ -612,3 +641,766 @@ def test_slicing(comm):
             assert_equal(b[3], data[3])
 
     shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_map(comm):
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+
+    numpy.random.seed(1234)
+
+    with x.create("data", Nfile=2, dtype=('f8', 3), size=128) as b:
+        data = numpy.random.uniform(100000, size=(128, 3))
+        b.write(0, data)
+
+    with x['data'] as b:
+        # within the first physical file; a view without copying
+        m = b.map(3, 40)
+        assert not m.flags.writeable
+        assert_equal(m, data[3:43])
+        # spanning both files falls back to read
+        assert_equal(b.map(0, 128), data)
+        assert_equal(b.map(0, 0), data[:0])
+        del m
+
+    shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_num_threads(comm):
+    from bigfile import set_num_threads
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+
+    numpy.random.seed(1234)
+    data = numpy.random.uniform(100000, size=(1000, 3))
+
+    set_num_threads(4)
+    try:
+        with x.create("data", Nfile=7, dtype=('f8', 3), size=1000) as b:
+            b.write(0, data)
+            # a partial, non contiguous write across several files
+            b.write(100, data[100:900, ::-1].copy()[:, ::-1])
+
+        with x['data'] as b:
+            assert_equal(b[:], data)
+            assert_equal(b[150:850], data[150:850])
+
+        # with a cast
+        with x.create("data4", Nfile=7, dtype=('f4', 3), size=1000) as b:
+            b.write(0, data)
+
+        with x['data4'] as b:
+            assert_equal(b.read(10, 600), data[10:610].astype('f4'))
+    finally:
+        set_num_threads(1)
+
+    shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_pipeline(comm):
+    from bigfile import set_pipeline_depth
+    from bigfile import set_buffer_size
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+
+    numpy.random.seed(1234)
+    data = numpy.random.uniform(100000, size=(1000, 3))
+
+    # small buffers such that a request takes many chunks
+    set_buffer_size(4096)
+    try:
+        for depth in [1, 2, 3]:
+            set_pipeline_depth(depth)
+            with x.create("data", Nfile=3, dtype=('>f8', 3), size=1000) as b:
+                b.write(0, data)
+
+            with x['data'] as b:
+                assert_equal(b[:], data)
+                assert_equal(b.read(10, 900), data[10:910].astype('>f8'))
+
+            # with a cast in every chunk
+            with x.create("data4", Nfile=3, dtype=('f4', 3), size=1000) as b:
+                b.write(0, data)
+
+            with x['data4'] as b:
+                assert_equal(b[:], data.astype('f4'))
+    finally:
+        set_pipeline_depth(2)
+        set_buffer_size(64 * 1024 * 1024)
+
+    shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_direct_io(comm):
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+
+    numpy.random.seed(1234)
+    data = numpy.random.uniform(100000, size=(1001, 3))
+
+    with x.create("data", Nfile=3, dtype=('f8', 3), size=1001) as b:
+        b.direct_io = True
+        assert b.direct_io
+        b.write(0, data[:17])
+        b.write(17, data[17:])
+
+    with x['data'] as b:
+        b.direct_io = True
+        # unaligned head and tail
+        assert_equal(b[13:999], data[13:999])
+        assert_equal(b[:], data)
+
+    shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_byteswap(comm):
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+
+    numpy.random.seed(1234)
+    data = numpy.random.uniform(100000, size=(1001, 3))
+    copy = data.copy()
+
+    for dtype in ['>f8', '>f4', '>i8']:
+        with x.create(dtype, Nfile=2, dtype=(dtype, 3), size=1001) as b:
+            # a non-contiguous source as well
+            b.write(0, data[:500])
+            b.write(500, numpy.asfortranarray(data[500:]))
+        # the source is not swapped in place
+        assert_equal(data, copy)
+
+        with x[dtype] as b:
+            assert_equal(b[:], data.astype(dtype))
+            assert_equal(b.read(10, 900), data[10:910].astype(dtype))
+            out = numpy.zeros((1001, 6), dtype='>f8')
+            out[:, ::2] = b[:]
+            assert_equal(out[:, ::2], data.astype(dtype))
+
+    shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_strided_records(comm):
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+
+    numpy.random.seed(1234)
+    records = numpy.zeros(1001, dtype=[('id', 'i8'), ('pos', ('f8', 3)), ('mass', 'f4'), ('pad', 'S60')])
+    records['id'] = numpy.arange(1001)
+    records['pos'] = numpy.random.uniform(100000, size=(1001, 3))
+    records['mass'] = numpy.random.uniform(size=1001)
+
+    with x.create("pos", Nfile=3, dtype=('f4', 3), size=1001) as b:
+        b.write(0, records['pos'][:333])
+        b.write(333, records['pos'][333:])
+    with x.create("mass", Nfile=3, dtype='f8', size=1001) as b:
+        b.write(0, records['mass'])
+
+    out = numpy.zeros_like(records)
+    with x['pos'] as b:
+        out['pos'][...] = b[:]
+        assert_equal(b.read(10, 900), records['pos'][10:910].astype('f4'))
+    with x['mass'] as b:
+        out['mass'][...] = b[:]
+    assert_equal(out['pos'], records['pos'].astype('f4'))
+    assert_equal(out['mass'], records['mass'])
+
+    shutil.rmtree(fname)
+
+def _crc32c(data):
+    crc = 0xffffffff
+    for b in bytearray(data):
+        crc ^= b
+        for k in range(8):
+            crc = (crc >> 1) ^ (0x82f63b78 if crc & 1 else 0)
+    return crc ^ 0xffffffff
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_chunk_checksum(comm):
+    from bigfile import set_checksum_chunk_size
+    import os
+    if comm.rank == 0:
+        fname = tempfile.mkdtemp()
+        fname = comm.bcast(fname)
+    else:
+        fname = comm.bcast(None)
+    x = BigFileMPI(comm, fname, create=True)
+
+    data = numpy.arange(1001 * 3, dtype='i8').reshape(1001, 3)
+
+    set_checksum_chunk_size(1000)
+    try:
+        with x.create("data", Nfile=3, dtype=('i8', 3), size=1001) as b:
+            # pieces of the chunks from every rank, in any order
+            start = 1001 * comm.rank // comm.size
+            end = 1001 * (comm.rank + 1) // comm.size
+            b.write(start, data[start:end])
+    finally:
+        set_checksum_chunk_size(0)
+
+    comm.barrier()
+    if comm.rank == 0:
+        y = BigFile(fname)
+        with y['data'] as b:
+            assert b.crcsize == 1000
+            assert_equal(b[:], data)
+            for i in range(b.Nfile):
+                with open(os.path.join(fname, 'data', '%06X' % i), 'rb') as ff:
+                    raw = ff.read()
+                for chunk in range((len(raw) + 999) // 1000):
+                    crc, nbytes = b.chunk_checksum(i, chunk)
+                    assert nbytes == len(raw[chunk * 1000:chunk * 1000 + 1000])
+                    assert crc == _crc32c(raw[chunk * 1000:chunk * 1000 + nbytes])
+        shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_binary_header(comm):
+    from bigfile import set_binary_header
+    import os
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+
+    data = numpy.arange(1000 * 3, dtype='f8').reshape(1000, 3)
+
+    set_binary_header(True)
+    try:
+        with x.create("data", Nfile=17, dtype=('f8', 3), size=1000) as b:
+            b.write(0, data)
+    finally:
+        set_binary_header(False)
+
+    assert os.path.exists(os.path.join(fname, 'data', 'header-v2'))
+    with x['data'] as b:
+        assert b.Nfile == 17
+        assert_equal(b[:], data)
+
+    # an older library rewrites only the text header; the binary one is then ignored.
+    with open(os.path.join(fname, 'data', 'header')) as ff:
+        text = ff.read()
+    with open(os.path.join(fname, 'data', 'header'), 'w') as ff:
+        ff.write(text.replace('NFILE: 17', 'NFILE: 17 '))
+    with x['data'] as b:
+        assert b.Nfile == 17
+        assert_equal(b[:], data)
+
+    # flushing without the binary header removes the stale copy.
+    with x['data'] as b:
+        b.write(0, data)
+    assert not os.path.exists(os.path.join(fname, 'data', 'header-v2'))
+    with x['data'] as b:
+        assert_equal(b[:], data)
+
+    shutil.rmtree(fname)
+
+def test_attr_v3():
+    from bigfile import set_attr_version
+    import os
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+    data = numpy.arange(100000, dtype='f8')
+
+    assert_raises(BigFileError, set_attr_version, 4)
+    set_attr_version(3)
+    try:
+        with x.create('block', dtype=None) as b:
+            b.attrs['data'] = data
+            b.attrs['string'] = 'abcdefg'
+            b.attrs['int'] = [1, 2]
+    finally:
+        set_attr_version(2)
+
+    assert os.path.exists(os.path.join(fname, 'block', 'attr-v3'))
+    assert not os.path.exists(os.path.join(fname, 'block', 'attr-v2'))
+    with x['block'] as b:
+        assert_equal(b.attrs['data'], data)
+        assert_equal(b.attrs['string'], 'abcdefg')
+        assert_equal(b.attrs['int'], [1, 2])
+        b.attrs['int'] = 3
+
+    # writing attr-v2 removes attr-v3
+    assert not os.path.exists(os.path.join(fname, 'block', 'attr-v3'))
+    with x['block'] as b:
+        assert_equal(b.attrs['data'], data)
+        assert_equal(b.attrs['int'], 3)
+
+    shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_block_index(comm):
+    import os
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+
+    for name in ['a', 'g/b', 'g/c']:
+        x.create(name, Nfile=1, dtype='i8', size=10).close()
+
+    # the first listing scans the tree and writes the index
+    assert x.list_blocks() == ['a', 'g/b', 'g/c']
+    assert os.path.exists(os.path.join(fname, '.bigfile', 'index'))
+
+    # blocks created afterwards are appended to the index, which is not rewritten
+    index = os.path.join(fname, '.bigfile', 'index')
+    def read_index():
+        with open(index) as ff:
+            return ff.read()
+    inode = os.stat(index).st_ino
+    before = read_index()
+    x.create('g/h/d', Nfile=1, dtype='f4', size=10).close()
+    after = read_index()
+    assert after.startswith(before)
+    added = after[len(before):].splitlines()
+    assert [l for l in added if l.startswith('BLOCK: ')] == ['BLOCK: g/h/d <f4 1 10']
+    assert sorted(l.split()[1] for l in added if l.startswith('DIR: ')) == ['g', 'g/h']
+    assert x.list_blocks() == ['a', 'g/b', 'g/c', 'g/h/d']
+    assert os.stat(index).st_ino == inode
+    assert read_index() == after
+
+    before = after
+    x.create('f', Nfile=1, dtype='f4', size=10).close()
+    after = read_index()
+    assert after.startswith(before)
+    assert [l.split()[:2] for l in after[len(before):].splitlines()] == [['DIR:', '.'], ['BLOCK:', 'f']]
+    assert x.list_blocks() == ['a', 'f', 'g/b', 'g/c', 'g/h/d']
+    assert os.stat(index).st_ino == inode
+    shutil.rmtree(os.path.join(fname, 'f'))
+
+    # changes made without the library make the index stale
+    shutil.rmtree(os.path.join(fname, 'g', 'b'))
+    assert x.list_blocks() == ['a', 'g/c', 'g/h/d']
+    os.mkdir(os.path.join(fname, 'e'))
+    shutil.copy(os.path.join(fname, 'a', 'header'), os.path.join(fname, 'e'))
+    assert x.list_blocks() == ['a', 'e', 'g/c', 'g/h/d']
+
+    shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_block_index_recreate(comm):
+    import os
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+    index = os.path.join(fname, '.bigfile', 'index')
+
+    x.create('b', Nfile=1, dtype='i8', size=10).close()
+    x.create('a', Nfile=1, dtype='i8', size=10).close()
+    assert x.list_blocks() == ['a', 'b']
+
+    # a block made again with a new shape replaces its entry
+    for size in [20, 30, 40]:
+        x.create('a', Nfile=1, dtype='i8', size=size).close()
+        assert x.list_blocks() == ['a', 'b']
+        with open(index) as ff:
+            records = [l for l in ff if l.startswith('BLOCK: a ')]
+        assert records[-1].split()[-1] == str(size)
+
+    # and with the same shape it is already in the index
+    size = os.path.getsize(index)
+    for i in range(3):
+        x.create('a', Nfile=1, dtype='i8', size=40).close()
+        assert x.list_blocks() == ['a', 'b']
+        assert os.path.getsize(index) == size
+
+    # later records of a name replace earlier ones, however many there are
+    with open(index, 'a') as ff:
+        ff.write('BLOCK: a i8 1 50\nBLOCK: a i8 1 60\n')
+    assert x.list_blocks() == ['a', 'b']
+
+    shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_open_blocks(comm):
+    from bigfile import pyxbigfile
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+    for i, name in enumerate(['a', 'b', 'c']):
+        with x.create(name, Nfile=2, dtype='i4', size=10) as b:
+            b.write(0, numpy.arange(10, dtype='i4') + i)
+
+    a, c = x.open_blocks(['a', 'c'])
+    assert_array_equal(a[:], numpy.arange(10))
+    assert_array_equal(c[:], numpy.arange(10) + 2)
+    assert_equal(x.open_blocks([]), [])
+
+    # either all blocks are opened or none
+    blocks = [BigBlock() for i in range(3)]
+    assert_raises(BigFileError, pyxbigfile.open_blocks, x, blocks, ['a', 'missing', 'c'])
+    for b in blocks:
+        assert_equal(b.size, 0)
+        assert_equal(b.Nfile, 0)
+
+    shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_mpi_open_blocks(comm):
+    pyxbigfilempi = pytest.importorskip('bigfile.pyxbigfilempi')
+    if comm.rank == 0:
+        fname = tempfile.mkdtemp()
+        fname = comm.bcast(fname)
+    else:
+        fname = comm.bcast(None)
+    x = pyxbigfilempi.FileMPILowLevelAPI(comm, fname, create=True)
+    for i, name in enumerate(['a', 'b', 'c']):
+        b = pyxbigfilempi.ColumnMPILowLevelAPI(comm)
+        b.create(x, name, dtype='i4', size=10 * comm.size, Nfile=2)
+        b.write(0, numpy.arange(10, dtype='i4') + 10 * comm.rank + i)
+        b.close()
+
+    a, c = x.open_blocks(['a', 'c'])
+    for i, b in [(0, a), (2, c)]:
+        assert_equal(b.size, 10 * comm.size)
+        assert_equal(b.Nfile, 2)
+        assert_array_equal(b.read(0, 10), numpy.arange(10) + 10 * comm.rank + i)
+        b.close()
+    assert_equal(x.open_blocks([]), [])
+
+    # the error is raised on all ranks
+    assert_raises(BigFileError, x.open_blocks, ['a', 'missing', 'c'])
+
+    x.close()
+    comm.barrier()
+    if comm.rank == 0:
+        shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_mpi_two_phase(comm):
+    pyxbigfilempi = pytest.importorskip('bigfile.pyxbigfilempi')
+    if comm.rank == 0:
+        fname = tempfile.mkdtemp()
+        fname = comm.bcast(fname)
+    else:
+        fname = comm.bcast(None)
+
+    # uneven sizes, and the last rank has no rows
+    localsize = 0 if comm.rank == comm.size - 1 and comm.size > 1 else 7 + 5 * comm.rank
+    sizes = comm.allgather(localsize)
+    offset = sum(sizes[:comm.rank])
+    total = sum(sizes)
+
+    x = pyxbigfilempi.FileMPILowLevelAPI(comm, fname, create=True)
+    # a few rows per round, such that there are many rounds
+    pyxbigfilempi.set_collective_buffer_size(48)
+    try:
+        for concurrency in [1, 2, comm.size]:
+            for name, d in [('f4', 'f4'), ('f4_2', ('f4', (2,)))]:
+                name = '%s-%d' % (name, concurrency)
+                d = numpy.dtype(d)
+                data = numpy.arange(total * d.itemsize // 4, dtype='f8').reshape((total,) + d.shape)
+                local = data[offset:offset + localsize]
+
+                b = pyxbigfilempi.ColumnMPILowLevelAPI(comm)
+                b.create(x, name, dtype=d, size=total, Nfile=3)
+                # strided, and cast from f8
+                buf = numpy.zeros((2 * localsize,) + d.shape, dtype='f8')
+                buf[::2] = local
+                b.write(0, buf[::2], concurrency=concurrency)
+                assert_array_equal(b.read(0, localsize, concurrency=concurrency), local)
+                b.close()
+
+                comm.barrier()
+                with BigFile(fname)[name] as bb:
+                    assert_array_equal(bb[:], data)
+    finally:
+        pyxbigfilempi.set_collective_buffer_size(0)
+
+    x.close()
+    comm.barrier()
+    if comm.rank == 0:
+        shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_mpi_two_phase_empty(comm):
+    pyxbigfilempi = pytest.importorskip('bigfile.pyxbigfilempi')
+    if comm.rank == 0:
+        fname = tempfile.mkdtemp()
+        fname = comm.bcast(fname)
+    else:
+        fname = comm.bcast(None)
+
+    x = pyxbigfilempi.FileMPILowLevelAPI(comm, fname, create=True)
+    pyxbigfilempi.set_collective_buffer_size(48)
+    try:
+        for Nfile in [0, 1]:
+            b = pyxbigfilempi.ColumnMPILowLevelAPI(comm)
+            b.create(x, 'empty%d' % Nfile, dtype='f4', size=0, Nfile=Nfile)
+            b.write(0, numpy.zeros(0, dtype='f4'), concurrency=2)
+            assert_equal(len(b.read(0, 0, concurrency=2)), 0)
+            b.close()
+    finally:
+        pyxbigfilempi.set_collective_buffer_size(0)
+
+    x.close()
+    comm.barrier()
+    if comm.rank == 0:
+        shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_mpi_aggregated_by_node(comm):
+    pyxbigfilempi = pytest.importorskip('bigfile.pyxbigfilempi')
+    if comm.rank == 0:
+        fname = tempfile.mkdtemp()
+        fname = comm.bcast(fname)
+    else:
+        fname = comm.bcast(None)
+
+    # uneven sizes, and the last rank has no rows
+    localsize = 0 if comm.rank == comm.size - 1 and comm.size > 1 else 7 + 5 * comm.rank
+    sizes = comm.allgather(localsize)
+    offset = sum(sizes[:comm.rank])
+    total = sum(sizes)
+    data = numpy.arange(total * 2, dtype='f8').reshape(total, 2)
+    local = data[offset:offset + localsize]
+
+    x = pyxbigfilempi.FileMPILowLevelAPI(comm, fname, create=True)
+    # all ranks are on this node, and aggregate through its shared window
+    pyxbigfilempi.set_aggregated_threshold(1024 * 1024)
+    try:
+        for concurrency in [1, 2]:
+            name = 'f4_2-%d' % concurrency
+            b = pyxbigfilempi.ColumnMPILowLevelAPI(comm)
+            b.create(x, name, dtype=('f4', (2,)), size=total, Nfile=2)
+            for i in range(3):
+                b.write(0, local * (i + 1), concurrency=concurrency)
+                assert_array_equal(b.read(0, localsize, concurrency=concurrency), local * (i + 1))
+            b.close()
+
+            comm.barrier()
+            with BigFile(fname)[name] as bb:
+                assert_array_equal(bb[:], data * 3)
+    finally:
+        pyxbigfilempi.set_aggregated_threshold(0)
+
+    x.close()
+    comm.barrier()
+    if comm.rank == 0:
+        shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_mpi_write_begin(comm):
+    pyxbigfilempi = pytest.importorskip('bigfile.pyxbigfilempi')
+    if comm.rank == 0:
+        fname = tempfile.mkdtemp()
+        fname = comm.bcast(fname)
+    else:
+        fname = comm.bcast(None)
+
+    localsize = 0 if comm.rank == comm.size - 1 and comm.size > 1 else 1000 + 5 * comm.rank
+    sizes = comm.allgather(localsize)
+    offset = sum(sizes[:comm.rank])
+    total = sum(sizes)
+    data = numpy.arange(total, dtype='f8')
+
+    x = pyxbigfilempi.FileMPILowLevelAPI(comm, fname, create=True)
+    try:
+        # in a progress thread where MPI allows, and before write_begin returns
+        for thread in [True, False]:
+            pyxbigfilempi.set_progress_thread(thread)
+            name = 'thread%d' % thread
+            b = pyxbigfilempi.ColumnMPILowLevelAPI(comm)
+            b.create(x, name, dtype='f4', size=total, Nfile=2)
+
+            # the snapshot is written, not the changes after write_begin
+            buf = data[offset:offset + localsize].copy()
+            request = b.write_begin(0, buf, concurrency=2)
+            buf[...] = -1
+            request.end()
+            assert_raises(ValueError, request.end)
+            assert_array_equal(b.read(0, localsize), data[offset:offset + localsize])
+
+            # without a copy, from buf itself
+            buf = data[offset:offset + localsize] * 2
+            b.write_begin(0, buf, concurrency=2, copy=False).end()
+            assert_array_equal(b.read(0, localsize), buf)
+            b.close()
+
+            comm.barrier()
+            with BigFile(fname)[name] as bb:
+                assert_array_equal(bb[:], data * 2)
+    finally:
+        pyxbigfilempi.set_progress_thread(True)
+
+    x.close()
+    comm.barrier()
+    if comm.rank == 0:
+        shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_mpi_aggregated_slabs(comm):
+    pyxbigfilempi = pytest.importorskip('bigfile.pyxbigfilempi')
+    if comm.rank == 0:
+        fname = tempfile.mkdtemp()
+        fname = comm.bcast(fname)
+    else:
+        fname = comm.bcast(None)
+
+    localsize = 0 if comm.rank == comm.size - 1 and comm.size > 1 else 7 + 5 * comm.rank
+    sizes = comm.allgather(localsize)
+    offset = sum(sizes[:comm.rank])
+    total = sum(sizes)
+    data = numpy.arange(total * 2, dtype='f8').reshape(total, 2)
+    local = data[offset:offset + localsize]
+
+    x = pyxbigfilempi.FileMPILowLevelAPI(comm, fname, create=True)
+    slabsize = pyxbigfilempi.get_aggregated_slab_size()
+    pyxbigfilempi.set_aggregated_threshold(1024 * 1024)
+    try:
+        # rows are 8 bytes: slabs of 5 rows, of 1 row, and of 1 row for a slab smaller than a row.
+        for slab in [40, 8, 3]:
+            pyxbigfilempi.set_aggregated_slab_size(slab)
+            name = 'slab%d' % slab
+            b = pyxbigfilempi.ColumnMPILowLevelAPI(comm)
+            b.create(x, name, dtype=('f4', (2,)), size=total, Nfile=2)
+            b.write(0, local)
+            assert_array_equal(b.read(0, localsize), local)
+            b.close()
+
+            comm.barrier()
+            with BigFile(fname)[name] as bb:
+                assert_array_equal(bb[:], data)
+    finally:
+        pyxbigfilempi.set_aggregated_threshold(0)
+        pyxbigfilempi.set_aggregated_slab_size(slabsize)
+
+    x.close()
+    comm.barrier()
+    if comm.rank == 0:
+        shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_mpi_mpiio(comm):
+    pyxbigfilempi = pytest.importorskip('bigfile.pyxbigfilempi')
+    if comm.rank == 0:
+        fname = tempfile.mkdtemp()
+        fname = comm.bcast(fname)
+    else:
+        fname = comm.bcast(None)
+
+    localsize = 0 if comm.rank == comm.size - 1 and comm.size > 1 else 7 + 5 * comm.rank
+    sizes = comm.allgather(localsize)
+    offset = sum(sizes[:comm.rank])
+    total = sum(sizes)
+    data = numpy.arange(total * 2, dtype='f8').reshape(total, 2)
+    local = data[offset:offset + localsize]
+
+    x = pyxbigfilempi.FileMPILowLevelAPI(comm, fname, create=True)
+    try:
+        for concurrency, hints in [(1, None), (2, {'cb_nodes' : 1})]:
+            pyxbigfilempi.set_mpiio(True, hints)
+            assert pyxbigfilempi.get_mpiio()
+            name = 'mpiio%d' % concurrency
+            b = pyxbigfilempi.ColumnMPILowLevelAPI(comm)
+            b.create(x, name, dtype=('f4', (2,)), size=total, Nfile=3)
+            # strided, and cast from f8
+            buf = numpy.zeros((2 * localsize, 2), dtype='f8')
+            buf[::2] = local
+            b.write(0, buf[::2], concurrency=concurrency)
+            assert_array_equal(b.read(0, localsize, concurrency=concurrency), local)
+
+            # beyond the end of the block, on all ranks
+            assert_raises(BigFileError, b.write, 1, local, concurrency)
+            assert_raises(BigFileError, b.read, 1, localsize, concurrency)
+            b.close()
+
+            comm.barrier()
+            with BigFile(fname)[name] as bb:
+                assert_array_equal(bb[:], data)
+    finally:
+        pyxbigfilempi.set_mpiio(False)
+
+    x.close()
+    comm.barrier()
+    if comm.rank == 0:
+        shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_mpi_plan(comm):
+    pyxbigfilempi = pytest.importorskip('bigfile.pyxbigfilempi')
+    if comm.rank == 0:
+        fname = tempfile.mkdtemp()
+        fname = comm.bcast(fname)
+    else:
+        fname = comm.bcast(None)
+
+    localsize = 0 if comm.rank == comm.size - 1 and comm.size > 1 else 7 + 5 * comm.rank
+    sizes = comm.allgather(localsize)
+    offset = sum(sizes[:comm.rank])
+    total = sum(sizes)
+
+    x = pyxbigfilempi.FileMPILowLevelAPI(comm, fname, create=True)
+    try:
+        # the threshold is that at the time of the plan;
+        # with it the segments aggregate through the windows kept by the plan.
+        for threshold in [0, 1024 * 1024]:
+            pyxbigfilempi.set_aggregated_threshold(threshold)
+            plan = pyxbigfilempi.PlanMPI(comm, localsize, 2)
+            # the rows grow, and so do the windows
+            for name, d in [('i4', 'i4'), ('f8_2', ('f8', (2,))), ('f4', 'f4')]:
+                name = '%s-%d' % (name, threshold)
+                d = numpy.dtype(d)
+                data = numpy.arange(total * d.itemsize // d.base.itemsize).reshape((total,) + d.shape).astype(d.base)
+                local = data[offset:offset + localsize]
+
+                b = pyxbigfilempi.ColumnMPILowLevelAPI(comm)
+                b.create(x, name, dtype=d, size=total, Nfile=2)
+                for i in range(2):
+                    b.write_planned(0, local + i, plan)
+                    assert_array_equal(b.read_planned(0, plan), local + i)
+                b.close()
+
+                comm.barrier()
+                with BigFile(fname)[name] as bb:
+                    assert_array_equal(bb[:], data + 1)
+            plan.free()
+            assert_raises(ValueError, b.read_planned, 0, plan)
+    finally:
+        pyxbigfilempi.set_aggregated_threshold(0)
+
+    x.close()
+    comm.barrier()
+    if comm.rank == 0:
+        shutil.rmtree(fname)
+
+@pytest.mark.parametrize("comm", [MPI.COMM_WORLD,])
+@pytest.mark.mpi
+def test_mpi_plan_mismatch(comm):
+    pyxbigfilempi = pytest.importorskip('bigfile.pyxbigfilempi')
+    if comm.rank == 0:
+        fname = tempfile.mkdtemp()
+        fname = comm.bcast(fname)
+    else:
+        fname = comm.bcast(None)
+
+    x = pyxbigfilempi.FileMPILowLevelAPI(comm, fname, create=True)
+    plan = pyxbigfilempi.PlanMPI(comm, 10, 1)
+    b = pyxbigfilempi.ColumnMPILowLevelAPI(comm)
+    b.create(x, 'a', dtype='f8', size=10 * comm.size + 1, Nfile=1)
+
+    # one more row on rank 0 only; the error is raised on all ranks
+    buf = numpy.zeros(11 if comm.rank == 0 else 10, dtype='f8')
+    assert_raises(BigFileError, b.write_planned, 0, buf, plan)
+    # and the plan is still good
+    b.write_planned(0, numpy.ones(10), plan)
+    assert_array_equal(b.read_planned(0, plan), numpy.ones(10))
+
+    b.close()
+    plan.free()
+    x.close()
+    comm.barrier()
+    if comm.rank == 0:
+        shutil.rmtree(fname)
@@ -1,6 +1,7 @@
 from setuptools import setup, Extension
 from Cython.Build import cythonize
 import numpy
+import os
 
 extensions = [
         Extension("bigfile.pyxbigfile",
@@ -15,6 +16,42 @@ extensions = [
             ],
             include_dirs = ["src/", numpy.get_include()])]
 
+def find_mpi_flags(mpicc):
+    """ The compile and link flags of an MPI compiler wrapper, or None if there is no MPI. """
+    import subprocess, shlex
+    # Open MPI, then MPICH
+    for compile, link in [('--showme:compile', '--showme:link'), ('-compile_info', '-link_info')]:
+        try:
+            flags = [shlex.split(subprocess.check_output([mpicc, query],
+                        stderr=subprocess.STDOUT).decode()) for query in (compile, link)]
+        except (OSError, subprocess.CalledProcessError):
+            continue
+        # MPICH prints the compiler before the flags.
+        return [[flag for flag in f if flag.startswith('-')] for f in flags]
+    return None
+
+# The binding of bigfile-mpi.h is only built where an MPI compiler wrapper is found.
+mpiflags = find_mpi_flags(os.environ.get('MPICC', 'mpicc'))
+if mpiflags is not None:
+    extensions.append(
+        Extension("bigfile.pyxbigfilempi",
+            sources = [
+                "bigfile/pyxbigfilempi.pyx",
+                "src/bigfile.c",
+                "src/bigfile-mpi.c",
+                "src/mp-mpiu.c",
+                "src/bigfile-record.c",
+            ],
+            depends = [
+                "src/bigfile.h",
+                "src/bigfile-mpi.h",
+                "src/mp-mpiu.h",
+                "src/bigfile-internal.h",
+            ],
+            include_dirs = ["src/", numpy.get_include()],
+            extra_compile_args = mpiflags[0],
+            extra_link_args = mpiflags[1]))
+
 def find_version(path):
     import re
     # path shall be a plain ascii text file.
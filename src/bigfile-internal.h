@@ -1,8 +1,40 @@
+#include <time.h>
+#include <sys/types.h>
 
 int _big_file_mksubdir_r(const char * pathname, const char * subdir);
 
+/* The directories on the way to a new block, for the block index. */
+typedef struct BigFileIndexState {
+    char * name; /* as the scan spells it, NULL if the scan would not see the block */
+    int ndirs; /* the root and the parents */
+    struct timespec * before; /* mtimes before making the directory of the block, zero if absent */
+    struct timespec * after; /* and after */
+} BigFileIndexState;
+
+/* Makes the directory of a new block (raises), then add the block with the state, or NULL
+ * if it was not made; the block is not added if anything else changed the directories on the way. */
+int _big_file_index_mkdir(const char * basename, const char * blockname, BigFileIndexState * state);
+void _big_file_index_add(const char * basename, BigFileIndexState * state, BigBlock * bb);
+
 int _dtype_convert(BigArrayIter * dst, BigArrayIter * src, size_t nmemb);
 
+/* A conversion between two dtypes, resolved once and applied to many chunks. */
+typedef void (*BigCastKernel)(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n);
+/* reverses the bytes of n contiguous items; dst may be src */
+typedef void (*BigSwapKernel)(char * dst, const char * src, size_t n);
+typedef struct BigDtypeConverter {
+    BigCastKernel contiguous; /* both sides contiguous */
+    BigCastKernel strided; /* both sides with a fixed stride; NULL for items wider than 16 bytes */
+    BigSwapKernel swap_src; /* byte swap of src before the cast, NULL if native */
+    BigSwapKernel swap_dst; /* byte swap of dst after the cast, NULL if native */
+    BigSwapKernel swap; /* same type in the opposite byte order, the swap is the conversion */
+    int dstsize;
+    int srcsize;
+} BigDtypeConverter;
+
+int _dtype_converter_init(BigDtypeConverter * conv, const char * dstdtype, const char * srcdtype); /* raises */
+int _dtype_converter_apply(const BigDtypeConverter * conv, BigArrayIter * dst, BigArrayIter * src, size_t nmemb);
+
 /* The internal code creates the meta data but not the physical back-end storage files */
 int _big_block_create_internal(BigBlock * bb, const char * basename, const char * dtype, int nmemb, int Nfile, const size_t fsize[]);
 
@@ -12,9 +44,26 @@ void _big_block_close_internal(BigBlock * block);
 /* The internal code grows the internal meta data but not the physical back-end stroage files */
 int _big_block_grow_internal(BigBlock * bb, int Nfile_grow, const size_t fsize_grow[]);
 
+/* The path of a file of the block; fileid is a physical file, or negative for the meta data.
+ * unbuffered is set to 1 for a physical file. The caller frees the path. */
+char * _big_file_path_of(const char * basename, int fileid, int * unbuffered);
+
+/* Adds bytes written at offset of a physical file by other means than big_block_write
+ * to the checksums of the block, and marks the block dirty. */
+void _big_block_add_checksums(BigBlock * bb, int fileid, size_t offset, const char * buf, size_t bytes);
+
 /* The internal routine to open a physical file */
 FILE * _big_file_open_a_file(const char * basename, int fileid, const char * mode, const int raise);
 
+/* The internal routine to open a physical file as a descriptor for positional IO;
+ * mode is a fopen style mode string. Returns -1 on failure. */
+int _big_file_open_a_fd(const char * basename, int fileid, const char * mode, const int raise);
+
+/* Positional IO on a descriptor, no shared file position is involved.
+ * Returns the number of bytes transferred; short only on error or EOF. */
+ptrdiff_t _big_file_pread(int fd, void * buf, size_t bytes, ptrdiff_t offset);
+ptrdiff_t _big_file_pwrite(int fd, const void * buf, size_t bytes, ptrdiff_t offset);
+
 /* Internal routine to serialize/deserialize a block. */
 
 void *
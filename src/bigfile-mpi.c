@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <alloca.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
 #include "bigfile-mpi.h"
 #include "bigfile-internal.h"
 #include "mp-mpiu.h"
@@ -10,6 +12,29 @@
 /* disable aggregation by default */
 static size_t _BigFileAggThreshold = 0;
 
+/* the segment leader of an aggregated IO holds this many bytes per slab */
+static size_t _BigFileAggSlabSize = 64 * 1024 * 1024;
+
+/* The number of slabs in flight; one slab is written while the next is gathered */
+#define AGG_SLABS 2
+
+/* disable the two-phase collective IO by default */
+static size_t _BigFileCollectiveBufferSize = 0;
+
+/* use the MPI-IO backend; disabled by default */
+static int _BigFileMPIIO = 0;
+static MPI_Info _BigFileMPIIOInfo = MPI_INFO_NULL;
+
+/* big_block_mpi_write_begin writes in a progress thread where MPI allows */
+static int _BigFileMPIProgressThread = 1;
+
+/* The MPI-IO backend converts up to this many bytes per call */
+#define MPIIO_BUFFER_BYTES (64 * 1024 * 1024)
+
+/* The file domains of the aggregators start at a multiple of this
+ * many bytes into a physical file, the usual stripe size of lustre. */
+#define TWO_PHASE_ALIGN (1024 * 1024)
+
 static int big_block_mpi_broadcast(BigBlock * bb, int root, MPI_Comm comm);
 static int big_file_mpi_broadcast_anyerror(int rt, MPI_Comm comm);
 
@@ -35,6 +60,58 @@ big_file_mpi_get_aggregated_threshold()
     return _BigFileAggThreshold;
 }
 
+void
+big_file_mpi_set_aggregated_slab_size(size_t bytes)
+{
+    _BigFileAggSlabSize = bytes;
+}
+
+size_t
+big_file_mpi_get_aggregated_slab_size()
+{
+    return _BigFileAggSlabSize;
+}
+
+void
+big_file_mpi_set_collective_buffer_size(size_t bytes)
+{
+    _BigFileCollectiveBufferSize = bytes;
+}
+
+size_t
+big_file_mpi_get_collective_buffer_size()
+{
+    return _BigFileCollectiveBufferSize;
+}
+
+void
+big_file_mpi_set_mpiio(int enable, MPI_Info info)
+{
+    _BigFileMPIIO = enable;
+    if(_BigFileMPIIOInfo != MPI_INFO_NULL)
+        MPI_Info_free(&_BigFileMPIIOInfo);
+    if(info != MPI_INFO_NULL)
+        MPI_Info_dup(info, &_BigFileMPIIOInfo);
+}
+
+int
+big_file_mpi_get_mpiio()
+{
+    return _BigFileMPIIO;
+}
+
+void
+big_file_mpi_set_progress_thread(int enable)
+{
+    _BigFileMPIProgressThread = enable;
+}
+
+int
+big_file_mpi_get_progress_thread()
+{
+    return _BigFileMPIProgressThread;
+}
+
 int big_file_mpi_open(BigFile * bf, const char * basename, MPI_Comm comm) {
     if(comm == MPI_COMM_NULL) return 0;
     int rank;
@@ -91,6 +168,66 @@ int big_file_mpi_open_block(BigFile * bf, BigBlock * block, const char * blockna
     return _big_block_mpi_open(block, basename, comm);
 }
 
+int
+big_file_mpi_open_blocks(BigFile * bf, BigBlock * blocks, const char * const blocknames[], int nblocks, MPI_Comm comm)
+{
+    if(comm == MPI_COMM_NULL) return 0;
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    int rt = 0;
+    if(rank == 0) {
+        rt = big_file_open_blocks(bf, blocks, blocknames, nblocks);
+    }
+
+    BCAST_AND_RAISEIF(rt, comm);
+
+    /* one message with all blocks: the sizes, then the packed blocks */
+    size_t * sizes = (size_t *) calloc(nblocks + 1, sizeof(size_t));
+    size_t bytes = (nblocks + 1) * sizeof(size_t);
+    char * buf = NULL;
+    int i;
+    if(rank == 0) {
+        void ** packed = (void **) calloc(nblocks + 1, sizeof(void *));
+        for(i = 0; i < nblocks; i ++) {
+            packed[i] = _big_block_pack(&blocks[i], &sizes[i]);
+            bytes += sizes[i];
+        }
+        buf = malloc(bytes);
+        memcpy(buf, sizes, (nblocks + 1) * sizeof(size_t));
+        char * p = buf + (nblocks + 1) * sizeof(size_t);
+        for(i = 0; i < nblocks; i ++) {
+            memcpy(p, packed[i], sizes[i]);
+            p += sizes[i];
+            free(packed[i]);
+        }
+        free(packed);
+    }
+
+    MPI_Bcast(&bytes, sizeof(bytes), MPI_BYTE, 0, comm);
+
+    if(rank != 0) {
+        buf = malloc(bytes);
+    }
+
+    MPI_Bcast(buf, bytes, MPI_BYTE, 0, comm);
+
+    if(rank != 0) {
+        memcpy(sizes, buf, (nblocks + 1) * sizeof(size_t));
+        char * p = buf + (nblocks + 1) * sizeof(size_t);
+        for(i = 0; i < nblocks; i ++) {
+            _big_block_unpack(&blocks[i], p);
+            p += sizes[i];
+            /* the chunk checksums are reduced with XOR at flush; see big_block_mpi_flush. */
+            if(blocks[i].crcsize) {
+                memset(blocks[i].fcrc, 0, blocks[i].fcrcoffset[blocks[i].Nfile] * sizeof(blocks[i].fcrc[0]));
+            }
+        }
+    }
+    free(buf);
+    free(sizes);
+    return 0;
+}
+
 int
 big_file_mpi_create_block(BigFile * bf,
         BigBlock * block,
@@ -126,8 +263,9 @@ _big_file_mpi_create_block(BigFile * bf,
     MPI_Comm_rank(comm, &rank);
 
     int rt = 0;
+    BigFileIndexState index = {0};
     if (rank == 0) {
-        rt = _big_file_mksubdir_r(bf->basename, blockname);
+        rt = _big_file_index_mkdir(bf->basename, blockname, &index);
     } else {
         rt = 0;
     }
@@ -136,7 +274,11 @@ _big_file_mpi_create_block(BigFile * bf,
 
     char * basename = (char *) alloca(strlen(bf->basename) + strlen(blockname) + 128);
     sprintf(basename, "%s/%s/", bf->basename, blockname);
-    return _big_block_mpi_create(block, basename, dtype, nmemb, Nfile, fsize, comm);
+    rt = _big_block_mpi_create(block, basename, dtype, nmemb, Nfile, fsize, comm);
+    if(rank == 0) {
+        _big_file_index_add(bf->basename, &index, rt == 0 ? block : NULL);
+    }
+    return rt;
 }
 
 int big_file_mpi_close(BigFile * bf, MPI_Comm comm) {
@@ -281,6 +423,16 @@ big_block_mpi_flush(BigBlock * block, MPI_Comm comm)
     MPI_Reduce(block->fchecksum, checksum, block->Nfile, MPI_UNSIGNED, MPI_SUM, 0, comm);
     int dirty;
     MPI_Reduce(&block->dirty, &dirty, 1, MPI_INT, MPI_LOR, 0, comm);
+    if(block->crcsize) {
+        /* only the root holds the chunk checksums of the data before the last broadcast;
+         * the others hold the checksums of their own writes since. */
+        size_t ncrc = block->fcrcoffset[block->Nfile];
+        if(rank == 0) {
+            MPI_Reduce(MPI_IN_PLACE, block->fcrc, ncrc, MPI_UNSIGNED, MPI_BXOR, 0, comm);
+        } else {
+            MPI_Reduce(block->fcrc, NULL, ncrc, MPI_UNSIGNED, MPI_BXOR, 0, comm);
+        }
+    }
     int rt;
     if(rank == 0) {
         /* only the root rank updates */
@@ -375,11 +527,32 @@ big_block_mpi_broadcast(BigBlock * bb, int root, MPI_Comm comm)
 
     if(rank != root) {
         _big_block_unpack(bb, buf);
+        /* the chunk checksums are reduced with XOR at flush; see big_block_mpi_flush. */
+        if(bb->crcsize) {
+            memset(bb->fcrc, 0, bb->fcrcoffset[bb->Nfile] * sizeof(bb->fcrc[0]));
+        }
     }
     free(buf);
     return 0;
 }
 
+/* The communicators and the shared window of the node path of the aggregated IO on a segment;
+ * they are made on the first use, and kept until _agg_node_destroy. */
+typedef struct {
+    int ready;
+    int maxnodesize; /* of all nodes; the node path is taken if larger than 1 */
+    MPI_Comm node; /* ranks of the segment on this node; the root has rank 0 */
+    MPI_Comm leaders; /* ranks 0 of the nodes, the root first; MPI_COMM_NULL elsewhere */
+    int leader; /* rank of the node in leaders */
+    int nleader;
+    MPI_Win win; /* held by the rank 0 of the node; MPI_WIN_NULL until used */
+    size_t winbytes;
+    char * nodebuf; /* the window, as seen from this rank */
+} AggNode;
+
+static void
+_agg_node_destroy(AggNode * nodes);
+
 static int
 _aggregated(
             BigBlock * block,
@@ -390,42 +563,69 @@ _aggregated(
             int write,
             int root,
             const char * mode,
-            MPI_Comm comm);
+            MPI_Comm comm,
+            AggNode * nodes);
+
+struct BigFileMPIPlan {
+    MPI_Comm comm;
+    int concurrency;
+    size_t localsize;
+    size_t myoffset; /* rows before this rank */
+    size_t totalsize;
+    MPIU_Segmenter seggrp[1];
+    AggNode nodes[1]; /* of the segment of this rank */
+};
 
-static int
-_throttle_action(MPI_Comm comm, int concurrency, BigBlock * block,
-    BigBlockPtr * ptr,
-    BigArray * array,
-    int write)
+static void
+_plan_init(BigFileMPIPlan * plan, size_t localsize, int concurrency, MPI_Comm comm)
 {
     int ThisTask, NTask;
 
     MPI_Comm_size(comm, &NTask);
     MPI_Comm_rank(comm, &ThisTask);
 
-    MPIU_Segmenter seggrp[1];
+    plan->comm = comm;
+    plan->concurrency = concurrency;
+    plan->localsize = localsize;
+    plan->myoffset = 0;
+    plan->totalsize = 0;
 
-    size_t totalsize = 0;
-    size_t localsize = array->dims[0];
-    size_t myoffset = 0;
     size_t * sizes = (size_t *) malloc(sizeof(sizes[0]) * NTask);
     sizes[ThisTask] = localsize;
 
     MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, sizes, 1, MPI_UNSIGNED_LONG, comm);
     int i;
     for(i = 0; i < ThisTask; i ++)
-        myoffset += sizes[i];
+        plan->myoffset += sizes[i];
     for(i = 0; i < NTask; i ++)
-        totalsize += sizes[i];
+        plan->totalsize += sizes[i];
 
 
     size_t minsegsize = 32 * 1024 * 1024;
     /* Creates segments and groups. The number of groups is roughly equal
      * to the number of writing processes (with a complexity if some processes have no data to write).
      * The number of segments is set by the average size of data to write to a file.*/
-    MPIU_Segmenter_init(seggrp, sizes, totalsize, _BigFileAggThreshold, minsegsize, concurrency, comm);
+    MPIU_Segmenter_init(plan->seggrp, sizes, plan->totalsize, _BigFileAggThreshold, minsegsize, concurrency, comm);
+    plan->nodes->ready = 0;
 
     free(sizes);
+}
+
+static void
+_plan_destroy(BigFileMPIPlan * plan)
+{
+    _agg_node_destroy(plan->nodes);
+    MPIU_Segmenter_destroy(plan->seggrp);
+}
+
+static int
+_throttle_planned(BigFileMPIPlan * plan, BigBlock * block,
+    BigBlockPtr * ptr,
+    BigArray * array,
+    int write)
+{
+    MPIU_Segmenter * seggrp = plan->seggrp;
+    size_t localsize = plan->localsize;
 
     int rt = 0;
     int segment;
@@ -445,23 +645,103 @@ _throttle_action(MPI_Comm comm, int concurrency, BigBlock * block,
         if(seggrp->ThisSegment != segment) continue;
 
         /* use the offset on the first task in the SegGroup */
-        size_t offset = myoffset;
+        size_t offset = plan->myoffset;
         MPI_Bcast(&offset, 1, MPI_UNSIGNED_LONG, 0, seggrp->Segment);
 
-        rt = _aggregated(block, ptr, offset, localsize, array, write, seggrp->segment_leader_rank, "r+", seggrp->Segment);
+        rt = _aggregated(block, ptr, offset, localsize, array, write, seggrp->segment_leader_rank, "r+", seggrp->Segment, plan->nodes);
     }
 
-    if(0 == (rt = big_file_mpi_broadcast_anyerror(rt, comm))) {
+    if(0 == (rt = big_file_mpi_broadcast_anyerror(rt, plan->comm))) {
         /* no errors*/
-        big_block_seek_rel(block, ptr, totalsize);
+        big_block_seek_rel(block, ptr, plan->totalsize);
     }
 
-    MPIU_Segmenter_destroy(seggrp);
     return rt;
 }
 
 static int
-_aggregated(
+_throttle_action(MPI_Comm comm, int concurrency, BigBlock * block,
+    BigBlockPtr * ptr,
+    BigArray * array,
+    int write)
+{
+    BigFileMPIPlan plan[1];
+    _plan_init(plan, array->dims[0], concurrency, comm);
+    int rt = _throttle_planned(plan, block, ptr, array, write);
+    _plan_destroy(plan);
+    return rt;
+}
+
+/* Makes the communicators of the node path on comm; collective on comm. */
+static void
+_agg_node_init(AggNode * nodes, int root, MPI_Comm comm)
+{
+    int rank, nodesize, noderank;
+    MPI_Comm_rank(comm, &rank);
+
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank == root ? -1 : rank, MPI_INFO_NULL, &nodes->node);
+    MPI_Comm_size(nodes->node, &nodesize);
+    MPI_Comm_rank(nodes->node, &noderank);
+    MPI_Allreduce(&nodesize, &nodes->maxnodesize, 1, MPI_INT, MPI_MAX, comm);
+
+    nodes->leaders = MPI_COMM_NULL;
+    nodes->leader = 0;
+    nodes->nleader = 0;
+    if(nodes->maxnodesize > 1) {
+        /* one leader per node, the root first */
+        MPI_Comm_split(comm, noderank == 0 ? 0 : MPI_UNDEFINED, rank == root ? -1 : rank, &nodes->leaders);
+        if(noderank == 0) {
+            MPI_Comm_rank(nodes->leaders, &nodes->leader);
+            MPI_Comm_size(nodes->leaders, &nodes->nleader);
+        }
+        MPI_Bcast(&nodes->leader, 1, MPI_INT, 0, nodes->node);
+    }
+    nodes->win = MPI_WIN_NULL;
+    nodes->winbytes = 0;
+    nodes->nodebuf = NULL;
+    nodes->ready = 1;
+}
+
+/* The shared window of the node, of at least bytes; it only grows.
+ * Collective on the node, where all ranks ask for the same bytes. */
+static char *
+_agg_node_window(AggNode * nodes, size_t bytes)
+{
+    if(nodes->win != MPI_WIN_NULL && bytes <= nodes->winbytes)
+        return nodes->nodebuf;
+
+    if(nodes->win != MPI_WIN_NULL)
+        MPI_Win_free(&nodes->win);
+
+    int noderank;
+    MPI_Comm_rank(nodes->node, &noderank);
+    char * base;
+    MPI_Win_allocate_shared(noderank == 0 ? bytes + 1 : 0, 1, MPI_INFO_NULL, nodes->node, &base, &nodes->win);
+    MPI_Aint size;
+    int dispunit;
+    MPI_Win_shared_query(nodes->win, 0, &size, &dispunit, &nodes->nodebuf);
+    nodes->winbytes = bytes;
+    return nodes->nodebuf;
+}
+
+static void
+_agg_node_destroy(AggNode * nodes)
+{
+    if(!nodes->ready) return;
+    if(nodes->win != MPI_WIN_NULL)
+        MPI_Win_free(&nodes->win);
+    if(nodes->leaders != MPI_COMM_NULL)
+        MPI_Comm_free(&nodes->leaders);
+    MPI_Comm_free(&nodes->node);
+    nodes->ready = 0;
+}
+
+/* Aggregates to the root in two stages when ranks share a node:
+ * the ranks of a node convert their data into one shared memory window,
+ * and the leader of the node sends the window to the root in one message,
+ * which lands at the offsets of each rank of the node. Reads go the other way. */
+static int
+_aggregated_by_node(
             BigBlock * block,
             BigBlockPtr * ptr,
             ptrdiff_t offset, /* offset of the entire comm */
@@ -470,80 +750,389 @@ _aggregated(
             int write,
             int root,
             const char * mode,
-            MPI_Comm comm)
+            MPI_Comm comm,
+            AggNode * nodes)
 {
     size_t elsize = big_file_dtype_itemsize(block->dtype) * block->nmemb;
 
-    /* This will aggregate to the root and write */
     BigBlockPtr ptr1[1];
-    /* use memcpy because older compilers doesn't like *ptr assignments */
     memcpy(ptr1, ptr, sizeof(BigBlockPtr));
 
     int i;
     int e = 0;
-    int rank;
-    int nrank;
+    int rank, nrank;
+    int noderank, nodesize;
+
+    MPI_Comm node = nodes->node;
+    MPI_Comm leaders = nodes->leaders;
+    int leader = nodes->leader;
+    int nleader = nodes->nleader;
 
     MPI_Comm_rank(comm, &rank);
     MPI_Comm_size(comm, &nrank);
-
-    BigArray garray[1], larray[1];
-    BigArrayIter iarray[1], ilarray[1];
-    void * lbuf = malloc(elsize * localsize);
-    void * gbuf = NULL;
-
-    int recvcounts[nrank];
-    int recvdispls[nrank + 1];
-
-    recvdispls[0] = 0;
-    recvcounts[rank] = localsize;
-    MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, recvcounts, 1, MPI_INT, comm);
-
+    MPI_Comm_rank(node, &noderank);
+    MPI_Comm_size(node, &nodesize);
+
+    /* where the data of every rank is: node, rank in node and size */
+    int * where = (int *) malloc(sizeof(int) * 3 * nrank);
+    where[3 * rank] = leader;
+    where[3 * rank + 1] = noderank;
+    where[3 * rank + 2] = localsize;
+    MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, where, 3, MPI_INT, comm);
+
+    int * displs = (int *) malloc(sizeof(int) * (nrank + 1));
+    displs[0] = 0;
     for(i = 0; i < nrank; i ++) {
-        recvdispls[i + 1] = recvdispls[i] + recvcounts[i];
+        displs[i + 1] = displs[i] + where[3 * i + 2];
     }
-
-    size_t grouptotalsize = recvdispls[nrank];
+    size_t grouptotalsize = displs[nrank];
 
     MPI_Datatype mpidtype;
     MPI_Type_contiguous(elsize, MPI_BYTE, &mpidtype);
     MPI_Type_commit(&mpidtype);
 
-    big_array_init(larray, lbuf, block->dtype, 2, (size_t[]){localsize, (size_t) block->nmemb}, NULL);
+    /* rows of the node in its window, and of the ranks of the node before this rank */
+    int nodetotal = 0;
+    int nodedispl = 0;
+    for(i = 0; i < nrank; i ++) {
+        if(where[3 * i] != leader) continue;
+        nodetotal += where[3 * i + 2];
+        if(where[3 * i + 1] < noderank) nodedispl += where[3 * i + 2];
+    }
+
+    /* The window holds the data of the node in the order of the ranks in the node */
+    char * nodebuf = _agg_node_window(nodes, nodetotal * elsize);
+    char * lbuf = nodebuf + nodedispl * elsize;
+    MPI_Win win = nodes->win;
+
+    /* the data is already in order if the nodes hold consecutive ranks, in order */
+    int inorder = 1;
+    for(i = 1; i < nrank; i ++) {
+        if(where[3 * i] < where[3 * (i - 1)]
+        || (where[3 * i] == where[3 * (i - 1)] && where[3 * i + 1] < where[3 * (i - 1) + 1]))
+            inorder = 0;
+    }
 
+    BigArray garray[1], larray[1];
+    BigArrayIter iarray[1], ilarray[1];
+    big_array_init(larray, lbuf, block->dtype, 2, (size_t[]){localsize, (size_t) block->nmemb}, NULL);
     big_array_iter_init(iarray, array);
     big_array_iter_init(ilarray, larray);
 
+    char * gbuf = NULL;
+    MPI_Request * requests = NULL;
+    MPI_Datatype * nodetypes = NULL;
+    /* with one node in order the window is the whole data */
+    int direct = rank == root && nleader == 1 && inorder;
+
     if(rank == root) {
-        gbuf = malloc(grouptotalsize * elsize);
+        if(direct) {
+            gbuf = nodebuf;
+        } else {
+            gbuf = (char *) malloc(grouptotalsize * elsize + 1);
+        }
         big_array_init(garray, gbuf, block->dtype, 2, (size_t[]){grouptotalsize, (size_t) block->nmemb}, NULL);
+        /* the rows of each node, in the order of its window */
+        requests = (MPI_Request *) malloc(sizeof(MPI_Request) * nleader);
+        nodetypes = (MPI_Datatype *) malloc(sizeof(MPI_Datatype) * nleader);
+        int * blocklens = (int *) malloc(sizeof(int) * nrank);
+        int * blockdispls = (int *) malloc(sizeof(int) * nrank);
+        int * nodestart = (int *) calloc(nleader + 1, sizeof(int));
+        int r, j;
+        /* the ranks of node j, in the order of its window, are at nodestart[j] */
+        for(r = 0; r < nrank; r ++) {
+            nodestart[where[3 * r] + 1] ++;
+        }
+        for(j = 0; j < nleader; j ++) {
+            nodestart[j + 1] += nodestart[j];
+        }
+        for(r = 0; r < nrank; r ++) {
+            int k = nodestart[where[3 * r]] + where[3 * r + 1];
+            blocklens[k] = where[3 * r + 2];
+            blockdispls[k] = displs[r];
+        }
+        for(j = 0; j < nleader; j ++) {
+            MPI_Type_indexed(nodestart[j + 1] - nodestart[j],
+                    blocklens + nodestart[j], blockdispls + nodestart[j],
+                    mpidtype, &nodetypes[j]);
+            MPI_Type_commit(&nodetypes[j]);
+        }
+        free(nodestart);
+        free(blockdispls);
+        free(blocklens);
     }
 
+    MPI_Win_fence(0, win);
     if(write) {
         _dtype_convert(ilarray, iarray, localsize * block->nmemb);
-        MPI_Gatherv(lbuf, recvcounts[rank], mpidtype,
-                    gbuf, recvcounts, recvdispls, mpidtype, root, comm);
-    }
-    if(rank == root) {
-        big_block_seek_rel(block, ptr1, offset);
-        if(write)
+        MPI_Win_fence(0, win);
+        if(rank == root) {
+            int j;
+            for(j = 1; j < nleader; j ++) {
+                MPI_Irecv(gbuf, 1, nodetypes[j], j, 0, leaders, &requests[j]);
+            }
+            if(!direct) {
+                MPI_Sendrecv(nodebuf, nodetotal, mpidtype, 0, 0,
+                             gbuf, 1, nodetypes[0], 0, 0, leaders, MPI_STATUS_IGNORE);
+            }
+            if(nleader > 1)
+                MPI_Waitall(nleader - 1, requests + 1, MPI_STATUSES_IGNORE);
+            big_block_seek_rel(block, ptr1, offset);
             e = _big_block_write_mode(block, ptr1, garray, mode);
-        else
+        } else if(noderank == 0) {
+            MPI_Send(nodebuf, nodetotal, mpidtype, 0, 0, leaders);
+        }
+    } else {
+        if(rank == root) {
+            big_block_seek_rel(block, ptr1, offset);
             e = big_block_read(block, ptr1, garray);
+            int j;
+            for(j = 1; j < nleader; j ++) {
+                MPI_Isend(gbuf, 1, nodetypes[j], j, 0, leaders, &requests[j]);
+            }
+            if(!direct) {
+                MPI_Sendrecv(gbuf, 1, nodetypes[0], 0, 0,
+                             nodebuf, nodetotal, mpidtype, 0, 0, leaders, MPI_STATUS_IGNORE);
+            }
+            if(nleader > 1)
+                MPI_Waitall(nleader - 1, requests + 1, MPI_STATUSES_IGNORE);
+        } else if(noderank == 0) {
+            MPI_Recv(nodebuf, nodetotal, mpidtype, 0, 0, leaders, MPI_STATUS_IGNORE);
+        }
+        MPI_Win_fence(0, win);
+        _dtype_convert(iarray, ilarray, localsize * block->nmemb);
+    }
+    MPI_Win_fence(0, win);
+
+    if(rank == root) {
+        int j;
+        for(j = 0; j < nleader; j ++) {
+            MPI_Type_free(&nodetypes[j]);
+        }
+        free(nodetypes);
+        free(requests);
+        if(!direct) free(gbuf);
+    }
+    MPI_Type_free(&mpidtype);
+    free(displs);
+    free(where);
+
+    return big_file_mpi_broadcast_anyerror(e, comm);
+}
+
+/* The state of an aggregated IO that goes through the root in slabs */
+typedef struct {
+    BigBlock * block;
+    BigBlockPtr * ptr;
+    ptrdiff_t offset;
+    const char * mode; /* NULL for reads */
+    int root;
+    int rank;
+    int nrank;
+    MPI_Comm comm;
+    MPI_Datatype mpidtype;
+    size_t elsize;
+    char * lbuf;
+    size_t * displs; /* first row of each rank in the segment */
+    size_t grouptotalsize;
+    size_t slabrows;
+    /* on the root only */
+    char * slabbuf[AGG_SLABS];
+    int * counts;
+    int * slabdispls;
+    MPI_Request requests[AGG_SLABS];
+    int e;
+} AggSlabs;
+
+/* posts the gather (scatter) of slab s in slot s % AGG_SLABS */
+static void
+_agg_slab_post(AggSlabs * agg, size_t s)
+{
+    int slot = s % AGG_SLABS;
+    size_t lo = s * agg->slabrows;
+    size_t hi = lo + agg->slabrows < agg->grouptotalsize ? lo + agg->slabrows : agg->grouptotalsize;
+    size_t * displs = agg->displs;
+
+    size_t mylo = displs[agg->rank] > lo ? displs[agg->rank] : lo;
+    size_t myhi = displs[agg->rank + 1] < hi ? displs[agg->rank + 1] : hi;
+    int mycount = myhi > mylo ? myhi - mylo : 0;
+    char * mybuf = agg->lbuf + (mycount ? (mylo - displs[agg->rank]) * agg->elsize : 0);
+
+    int * counts = NULL;
+    int * slabdispls = NULL;
+    if(agg->rank == agg->root) {
+        counts = agg->counts + slot * agg->nrank;
+        slabdispls = agg->slabdispls + slot * agg->nrank;
+        int r;
+        for(r = 0; r < agg->nrank; r ++) {
+            size_t rlo = displs[r] > lo ? displs[r] : lo;
+            size_t rhi = displs[r + 1] < hi ? displs[r + 1] : hi;
+            counts[r] = rhi > rlo ? rhi - rlo : 0;
+            slabdispls[r] = rhi > rlo ? rlo - lo : 0;
+        }
+    }
+    if(agg->mode)
+        MPI_Igatherv(mybuf, mycount, agg->mpidtype,
+                agg->slabbuf[slot], counts, slabdispls, agg->mpidtype, agg->root, agg->comm, &agg->requests[slot]);
+    else
+        MPI_Iscatterv(agg->slabbuf[slot], counts, slabdispls, agg->mpidtype,
+                mybuf, mycount, agg->mpidtype, agg->root, agg->comm, &agg->requests[slot]);
+}
+
+/* the root writes (reads) slab s in slot s % AGG_SLABS; after an error only the collectives go on. */
+static void
+_agg_slab_io(AggSlabs * agg, size_t s)
+{
+    BigBlock * block = agg->block;
+    size_t lo = s * agg->slabrows;
+    size_t hi = lo + agg->slabrows < agg->grouptotalsize ? lo + agg->slabrows : agg->grouptotalsize;
+
+    if(agg->e != 0) return;
+
+    BigArray garray[1];
+    BigBlockPtr ptr1[1];
+    big_array_init(garray, agg->slabbuf[s % AGG_SLABS], block->dtype, 2, (size_t[]){hi - lo, (size_t) block->nmemb}, NULL);
+    /* use memcpy because older compilers doesn't like *ptr assignments */
+    memcpy(ptr1, agg->ptr, sizeof(BigBlockPtr));
+    big_block_seek_rel(block, ptr1, agg->offset + lo);
+    if(agg->mode) {
+        agg->e = _big_block_write_mode(block, ptr1, garray, agg->mode);
+        /* only the first slab may truncate the file */
+        agg->mode = "r+";
+    } else {
+        agg->e = big_block_read(block, ptr1, garray);
+    }
+}
+
+static int
+_aggregated(
+            BigBlock * block,
+            BigBlockPtr * ptr,
+            ptrdiff_t offset, /* offset of the entire comm */
+            size_t localsize,
+            BigArray * array,
+            int write,
+            int root,
+            const char * mode,
+            MPI_Comm comm,
+            AggNode * nodes)
+{
+    size_t elsize = big_file_dtype_itemsize(block->dtype) * block->nmemb;
+
+    int i;
+    int e = 0;
+    int rank;
+    int nrank;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nrank);
+
+    size_t * sizes = (size_t *) malloc(sizeof(size_t) * nrank);
+    sizes[rank] = localsize;
+    MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, sizes, 1, MPI_UNSIGNED_LONG, comm);
+
+    size_t * displs = (size_t *) malloc(sizeof(size_t) * (nrank + 1));
+    displs[0] = 0;
+    for(i = 0; i < nrank; i ++) {
+        displs[i + 1] = displs[i] + sizes[i];
     }
-    /* We are a read*/
-    if(!write) {
-        MPI_Scatterv(gbuf, recvcounts, recvdispls, mpidtype,
-                    lbuf, localsize, mpidtype, root, comm);
+    size_t grouptotalsize = displs[nrank];
+
+    /* rows per slab; the counts of one slab must fit an int */
+    size_t slabrows = elsize > 0 ? _BigFileAggSlabSize / elsize : grouptotalsize;
+    if(slabrows > INT_MAX) slabrows = INT_MAX;
+    if(slabrows == 0) slabrows = 1;
+
+    /* the root leads its node; the node path moves the segment in one piece */
+    if(grouptotalsize <= slabrows) {
+        if(!nodes->ready)
+            _agg_node_init(nodes, root, comm);
+        if(nodes->maxnodesize > 1) {
+            e = _aggregated_by_node(block, ptr, offset, localsize, array, write, root, mode, comm, nodes);
+            free(displs);
+            free(sizes);
+            return e;
+        }
+    }
+
+    AggSlabs agg[1] = {{0}};
+    agg->block = block;
+    agg->ptr = ptr;
+    agg->offset = offset;
+    agg->mode = write ? mode : NULL;
+    agg->root = root;
+    agg->rank = rank;
+    agg->nrank = nrank;
+    agg->comm = comm;
+    agg->elsize = elsize;
+    agg->lbuf = (char *) malloc(elsize * localsize + 1);
+    agg->displs = displs;
+    agg->grouptotalsize = grouptotalsize;
+    agg->slabrows = slabrows;
+
+    MPI_Type_contiguous(elsize, MPI_BYTE, &agg->mpidtype);
+    MPI_Type_commit(&agg->mpidtype);
+
+    BigArray larray[1];
+    BigArrayIter iarray[1], ilarray[1];
+    big_array_init(larray, agg->lbuf, block->dtype, 2, (size_t[]){localsize, (size_t) block->nmemb}, NULL);
+
+    big_array_iter_init(iarray, array);
+    big_array_iter_init(ilarray, larray);
+
+    /* The segment goes through the root in slabs of slabrows rows.
+     * AGG_SLABS slabs are in flight, such that the root writes one slab
+     * while the next is gathered, or reads one slab while the previous is scattered. */
+    size_t nslab = (grouptotalsize + slabrows - 1) / slabrows;
+    int nslots = nslab < AGG_SLABS ? nslab : AGG_SLABS;
+
+    if(rank == root) {
+        for(i = 0; i < nslots; i ++) {
+            agg->slabbuf[i] = (char *) malloc(slabrows * elsize + 1);
+        }
+        agg->counts = (int *) malloc(sizeof(int) * nrank * AGG_SLABS);
+        agg->slabdispls = (int *) malloc(sizeof(int) * nrank * AGG_SLABS);
+    }
+
+    size_t s;
+    if(write) {
+        _dtype_convert(ilarray, iarray, localsize * block->nmemb);
+        for(s = 0; s < nslab; s ++) {
+            _agg_slab_post(agg, s);
+            if(s + 1 >= AGG_SLABS) {
+                MPI_Wait(&agg->requests[(s + 1) % AGG_SLABS], MPI_STATUS_IGNORE);
+                if(rank == root) _agg_slab_io(agg, s + 1 - AGG_SLABS);
+            }
+        }
+        for(s = nslab >= AGG_SLABS ? nslab + 1 - AGG_SLABS : 0; s < nslab; s ++) {
+            MPI_Wait(&agg->requests[s % AGG_SLABS], MPI_STATUS_IGNORE);
+            if(rank == root) _agg_slab_io(agg, s);
+        }
+    } else {
+        for(s = 0; s < nslab; s ++) {
+            if(s >= AGG_SLABS) {
+                MPI_Wait(&agg->requests[s % AGG_SLABS], MPI_STATUS_IGNORE);
+            }
+            if(rank == root) _agg_slab_io(agg, s);
+            _agg_slab_post(agg, s);
+        }
+        MPI_Waitall(nslots, agg->requests, MPI_STATUSES_IGNORE);
         _dtype_convert(iarray, ilarray, localsize * block->nmemb);
     }
+    e = agg->e;
 
     if(rank == root) {
-        free(gbuf);
+        for(i = 0; i < nslots; i ++) {
+            free(agg->slabbuf[i]);
+        }
+        free(agg->slabdispls);
+        free(agg->counts);
     }
-    free(lbuf);
+    free(agg->lbuf);
+    free(displs);
+    free(sizes);
 
-    MPI_Type_free(&mpidtype);
+    MPI_Type_free(&agg->mpidtype);
 
     return big_file_mpi_broadcast_anyerror(e, comm);
 }
@@ -628,6 +1217,7 @@ big_block_mpi_create_and_write(BigFile * bf,
     big_block_mpi_broadcast(&block, 0, comm);
 
     BigBlockPtr ptr = {0};
+    AggNode nodes[1] = {{0}};
 
     int segment;
 
@@ -650,9 +1240,10 @@ big_block_mpi_create_and_write(BigFile * bf,
         MPI_Bcast(&offset, 1, MPI_UNSIGNED_LONG, 0, seggrp->Segment);
 
         /* write = 1 : Always writing here and we use mode 'w' so we create the files.*/
-        rt = _aggregated(&block, &ptr, offset, localsize, array, 1, seggrp->segment_leader_rank, "w", seggrp->Segment);
+        rt = _aggregated(&block, &ptr, offset, localsize, array, 1, seggrp->segment_leader_rank, "w", seggrp->Segment, nodes);
     }
 
+    _agg_node_destroy(nodes);
     MPIU_Segmenter_destroy(seggrp);
 
     /* Block written, close it: we need to close even if we have a write error,
@@ -665,17 +1256,558 @@ big_block_mpi_create_and_write(BigFile * bf,
 }
 
 
+/* Splits the rows [start, end) of the block into naggr contiguous file domains,
+ * the domain of aggregator k is [dstart[k], dstart[k + 1]).
+ * A boundary moves to a nearby physical file boundary, such that no file is shared
+ * by two aggregators, or else to the start of a stripe in the file. */
+static void
+_two_phase_domains(BigBlock * block, size_t start, size_t end, int naggr, size_t * dstart)
+{
+    size_t elsize = big_file_dtype_itemsize(block->dtype) * block->nmemb;
+    size_t totalsize = end - start;
+    /* how far a boundary may move to a file boundary */
+    size_t slack = totalsize / naggr / 4;
+    int k;
+    int f = 0;
+
+    dstart[0] = start;
+    for(k = 1; k < naggr; k ++) {
+        /* a block without files has no rows, and no file boundaries */
+        if(block->Nfile == 0) {
+            dstart[k] = start;
+            continue;
+        }
+        size_t ideal = start + totalsize / naggr * k + totalsize % naggr * k / naggr;
+        while(f < block->Nfile - 1 && block->foffset[f + 1] <= ideal) f ++;
+
+        size_t lo = block->foffset[f];
+        size_t hi = block->foffset[f + 1];
+        size_t b;
+        if(ideal - lo <= slack) {
+            b = lo;
+        } else if(hi - ideal <= slack) {
+            b = hi;
+        } else if(elsize > 0) {
+            size_t bytes = (ideal - lo) * elsize / TWO_PHASE_ALIGN * TWO_PHASE_ALIGN;
+            b = lo + (bytes + elsize - 1) / elsize;
+        } else {
+            b = ideal;
+        }
+        if(b < dstart[k - 1]) b = dstart[k - 1];
+        if(b > end) b = end;
+        dstart[k] = b;
+    }
+    dstart[naggr] = end;
+}
+
+/* a view of n rows of array, from row */
+static void
+_big_array_rows(BigArray * view, const BigArray * array, size_t row, size_t n)
+{
+    memcpy(view, array, sizeof(BigArray));
+    view->data = (char *) array->data + row * array->strides[0];
+    view->dims[0] = n;
+    view->size = array->size / array->dims[0] * n;
+}
+
+/* the overlap of [lo1, hi1) and [lo2, hi2); returns the size and sets the start. */
+static size_t
+_overlap(size_t lo1, size_t hi1, size_t lo2, size_t hi2, size_t * lo)
+{
+    *lo = lo1 > lo2 ? lo1 : lo2;
+    size_t hi = hi1 < hi2 ? hi1 : hi2;
+    return hi > *lo ? hi - *lo : 0;
+}
+
+/* Two-phase collective IO:
+ *
+ * concurrency aggregator ranks each own a contiguous domain of the rows;
+ * in every round each aggregator moves up to a collective buffer of its domain,
+ * and the rows are exchanged between the ranks and the aggregators with one MPI_Alltoallv.
+ * The ranks convert the dtype; the aggregators only read or write. */
+static int
+_two_phase_action(MPI_Comm comm, int concurrency, BigBlock * block,
+    BigBlockPtr * ptr,
+    BigArray * array,
+    int write)
+{
+    int ThisTask, NTask;
+
+    MPI_Comm_size(comm, &NTask);
+    MPI_Comm_rank(comm, &ThisTask);
+
+    size_t elsize = big_file_dtype_itemsize(block->dtype) * block->nmemb;
+    size_t localsize = array->dims[0];
+    size_t * offsets = (size_t *) malloc(sizeof(offsets[0]) * (NTask + 1));
+    offsets[ThisTask] = localsize;
+
+    MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, offsets, 1, MPI_UNSIGNED_LONG, comm);
+
+    size_t start = block->foffset[ptr->fileid] + ptr->roffset;
+    int i;
+    /* offsets[i] is now the first row of rank i */
+    size_t next = start;
+    for(i = 0; i < NTask; i ++) {
+        size_t size = offsets[i];
+        offsets[i] = next;
+        next += size;
+    }
+    offsets[NTask] = next;
+    size_t totalsize = next - start;
+
+    int naggr = concurrency;
+    if(naggr <= 0 || naggr > NTask) naggr = NTask;
+
+    size_t * dstart = (size_t *) malloc(sizeof(dstart[0]) * (naggr + 1));
+    _two_phase_domains(block, start, start + totalsize, naggr, dstart);
+
+    /* aggregators spread over the ranks */
+    int * aggrank = (int *) malloc(sizeof(aggrank[0]) * naggr);
+    int myaggr = -1;
+    int k;
+    for(k = 0; k < naggr; k ++) {
+        aggrank[k] = (int) ((size_t) k * NTask / naggr);
+        if(aggrank[k] == ThisTask) myaggr = k;
+    }
+
+    /* displacements are counted in rows, and must fit an int */
+    size_t cbrows = _BigFileCollectiveBufferSize / (elsize > 0 ? elsize : 1);
+    if(cbrows == 0) cbrows = 1;
+    if(cbrows > INT_MAX / naggr) cbrows = INT_MAX / naggr;
+
+    size_t nrounds = 0;
+    for(k = 0; k < naggr; k ++) {
+        size_t n = (dstart[k + 1] - dstart[k] + cbrows - 1) / cbrows;
+        if(n > nrounds) nrounds = n;
+    }
+
+    size_t lbufsize = localsize < naggr * cbrows ? localsize : naggr * cbrows;
+    char * lbuf = (char *) malloc(lbufsize * elsize + 1);
+    char * abuf = (char *) malloc((myaggr >= 0 ? cbrows : 0) * elsize + 1);
+
+    /* rank side: rows sent to / received from each rank; aggregator side: the same. */
+    int * lcounts = (int *) calloc(4 * NTask, sizeof(int));
+    int * ldispls = lcounts + NTask;
+    int * acounts = lcounts + 2 * NTask;
+    int * adispls = lcounts + 3 * NTask;
+    size_t * lrow = (size_t *) malloc(sizeof(lrow[0]) * naggr);
+
+    MPI_Datatype mpidtype;
+    MPI_Type_contiguous(elsize, MPI_BYTE, &mpidtype);
+    MPI_Type_commit(&mpidtype);
+
+    int rt = 0;
+    size_t round;
+    for(round = 0; round < nrounds; round ++) {
+        /* the part of my rows in the window of each aggregator */
+        int displ = 0;
+        for(k = 0; k < naggr; k ++) {
+            size_t wlo = dstart[k] + round * cbrows;
+            if(wlo > dstart[k + 1]) wlo = dstart[k + 1];
+            size_t whi = wlo + cbrows < dstart[k + 1] ? wlo + cbrows : dstart[k + 1];
+            size_t lo;
+            size_t n = _overlap(wlo, whi, offsets[ThisTask], offsets[ThisTask + 1], &lo);
+            lcounts[aggrank[k]] = n;
+            ldispls[aggrank[k]] = displ;
+            lrow[k] = lo - offsets[ThisTask];
+            displ += n;
+        }
+
+        /* the window of my aggregator, in the order of the ranks */
+        size_t wlo = 0, whi = 0;
+        if(myaggr >= 0) {
+            wlo = dstart[myaggr] + round * cbrows;
+            if(wlo > dstart[myaggr + 1]) wlo = dstart[myaggr + 1];
+            whi = wlo + cbrows < dstart[myaggr + 1] ? wlo + cbrows : dstart[myaggr + 1];
+        }
+        displ = 0;
+        for(i = 0; i < NTask; i ++) {
+            size_t lo;
+            acounts[i] = _overlap(wlo, whi, offsets[i], offsets[i + 1], &lo);
+            adispls[i] = displ;
+            displ += acounts[i];
+        }
+
+        BigArray garray[1];
+        BigBlockPtr ptr1[1];
+        if(myaggr >= 0 && whi > wlo) {
+            big_array_init(garray, abuf, block->dtype, 2, (size_t[]){whi - wlo, (size_t) block->nmemb}, NULL);
+            big_block_seek(block, ptr1, wlo);
+        }
+
+        if(!write && myaggr >= 0 && whi > wlo && rt == 0) {
+            rt = big_block_read(block, ptr1, garray);
+        }
+
+        if(write) {
+            for(k = 0; k < naggr; k ++) {
+                size_t n = lcounts[aggrank[k]];
+                if(n == 0) continue;
+                BigArray src[1], dst[1];
+                BigArrayIter isrc[1], idst[1];
+                _big_array_rows(src, array, lrow[k], n);
+                big_array_init(dst, lbuf + ldispls[aggrank[k]] * elsize,
+                    block->dtype, 2, (size_t[]){n, (size_t) block->nmemb}, NULL);
+                big_array_iter_init(isrc, src);
+                big_array_iter_init(idst, dst);
+                _dtype_convert(idst, isrc, n * block->nmemb);
+            }
+            MPI_Alltoallv(lbuf, lcounts, ldispls, mpidtype,
+                          abuf, acounts, adispls, mpidtype, comm);
+        } else {
+            MPI_Alltoallv(abuf, acounts, adispls, mpidtype,
+                          lbuf, lcounts, ldispls, mpidtype, comm);
+            for(k = 0; k < naggr; k ++) {
+                size_t n = lcounts[aggrank[k]];
+                if(n == 0) continue;
+                BigArray src[1], dst[1];
+                BigArrayIter isrc[1], idst[1];
+                big_array_init(src, lbuf + ldispls[aggrank[k]] * elsize,
+                    block->dtype, 2, (size_t[]){n, (size_t) block->nmemb}, NULL);
+                _big_array_rows(dst, array, lrow[k], n);
+                big_array_iter_init(isrc, src);
+                big_array_iter_init(idst, dst);
+                _dtype_convert(idst, isrc, n * block->nmemb);
+            }
+        }
+
+        if(write && myaggr >= 0 && whi > wlo && rt == 0) {
+            rt = _big_block_write_mode(block, ptr1, garray, "r+");
+        }
+    }
+
+    MPI_Type_free(&mpidtype);
+    free(lrow);
+    free(lcounts);
+    free(abuf);
+    free(lbuf);
+    free(aggrank);
+    free(dstart);
+    free(offsets);
+
+    if(0 == (rt = big_file_mpi_broadcast_anyerror(rt, comm))) {
+        /* no errors*/
+        big_block_seek_rel(block, ptr, totalsize);
+    }
+    return rt;
+}
+
+/* raises the error of a MPI-IO call on a physical file */
+static void
+_mpiio_raise(int err, const char * call, const char * filename)
+{
+    char msg[MPI_MAX_ERROR_STRING];
+    int len;
+    MPI_Error_string(err, msg, &len);
+    _big_file_raise("%s failed on physical file `%s' (%s)", __FILE__, __LINE__, call, filename, msg);
+}
+
+/* MPI-IO backend:
+ *
+ * every physical file in the range is opened with MPI_File_open on comm, with a view of
+ * rows, and the rows of each rank are moved with MPI_File_write_at_all and MPI_File_read_at_all
+ * at their offset from foffset. The collective buffering of the MPI-IO library, tuned by the hints
+ * of big_file_mpi_set_mpiio, does the aggregation; concurrency is the default of cb_nodes. */
+static int
+_mpiio_action(MPI_Comm comm, int concurrency, BigBlock * block,
+    BigBlockPtr * ptr,
+    BigArray * array,
+    int write)
+{
+    int ThisTask, NTask;
+
+    MPI_Comm_size(comm, &NTask);
+    MPI_Comm_rank(comm, &ThisTask);
+
+    size_t elsize = big_file_dtype_itemsize(block->dtype) * block->nmemb;
+    size_t localsize = array->dims[0];
+    size_t offset = 0;
+    size_t totalsize = 0;
+
+    MPI_Exscan(&localsize, &offset, 1, MPI_UNSIGNED_LONG, MPI_SUM, comm);
+    if(ThisTask == 0) offset = 0;
+    MPI_Allreduce(&localsize, &totalsize, 1, MPI_UNSIGNED_LONG, MPI_SUM, comm);
+
+    size_t start = block->foffset[ptr->fileid] + ptr->roffset;
+    size_t mylo = start + offset;
+    size_t myhi = mylo + localsize;
+
+    int rt = 0;
+    if(start + totalsize > block->size) {
+        _big_file_raise("%s beyond the block `%s` at (%d:%td)", __FILE__, __LINE__,
+            write ? "Writing" : "Reading", block->basename, ptr->fileid, ptr->roffset * elsize);
+        rt = -1;
+    }
+    BCAST_AND_RAISEIF(rt, comm);
+
+    MPI_Info info;
+    if(_BigFileMPIIOInfo != MPI_INFO_NULL)
+        MPI_Info_dup(_BigFileMPIIOInfo, &info);
+    else
+        MPI_Info_create(&info);
+    int flag;
+    char value[MPI_MAX_INFO_VAL + 1];
+    MPI_Info_get(info, "cb_nodes", MPI_MAX_INFO_VAL, value, &flag);
+    if(!flag && concurrency > 0) {
+        sprintf(value, "%d", concurrency);
+        MPI_Info_set(info, "cb_nodes", value);
+    }
+
+    /* rows per call; the counts must fit an int */
+    size_t bufrows = MPIIO_BUFFER_BYTES / (elsize > 0 ? elsize : 1);
+    if(bufrows == 0) bufrows = 1;
+    if(bufrows > INT_MAX) bufrows = INT_MAX;
+    char * buf = (char *) malloc((localsize < bufrows ? localsize : bufrows) * elsize + 1);
+
+    MPI_Datatype rowtype;
+    MPI_Type_contiguous(elsize, MPI_BYTE, &rowtype);
+    MPI_Type_commit(&rowtype);
+
+    int f;
+    for(f = ptr->fileid; elsize > 0 && f < block->Nfile && block->foffset[f] < start + totalsize; f ++) {
+        if(block->fsize[f] == 0) continue;
+
+        int unbuffered;
+        char * filename = _big_file_path_of(block->basename, f, &unbuffered);
+        MPI_File fh;
+        int err = MPI_File_open(comm, filename, write ? (MPI_MODE_WRONLY | MPI_MODE_CREATE) : MPI_MODE_RDONLY, info, &fh);
+        if(err != MPI_SUCCESS) {
+            _mpiio_raise(err, "MPI_File_open", filename);
+        }
+        if(0 != (rt = big_file_mpi_broadcast_anyerror(err != MPI_SUCCESS ? -1 : 0, comm))) {
+            if(err == MPI_SUCCESS) MPI_File_close(&fh);
+            free(filename);
+            break;
+        }
+        MPI_File_set_view(fh, 0, rowtype, rowtype, "native", info);
+
+        /* my rows in this file, in rounds of bufrows */
+        size_t lo;
+        size_t n = _overlap(block->foffset[f], block->foffset[f + 1], mylo, myhi, &lo);
+        size_t nrounds = (n + bufrows - 1) / bufrows;
+        MPI_Allreduce(MPI_IN_PLACE, &nrounds, 1, MPI_UNSIGNED_LONG, MPI_MAX, comm);
+
+        size_t round;
+        for(round = 0; round < nrounds; round ++) {
+            size_t rlo;
+            size_t count = _overlap(lo + round * bufrows, lo + (round + 1) * bufrows, lo, lo + n, &rlo);
+            MPI_Offset foffset = count > 0 ? rlo - block->foffset[f] : 0;
+
+            BigArray view[1], barray[1];
+            BigArrayIter iview[1], ibarray[1];
+            if(count > 0) {
+                _big_array_rows(view, array, rlo - mylo, count);
+                big_array_init(barray, buf, block->dtype, 2, (size_t[]){count, (size_t) block->nmemb}, NULL);
+                big_array_iter_init(iview, view);
+                big_array_iter_init(ibarray, barray);
+            }
+
+            MPI_Status status;
+            if(write) {
+                if(count > 0)
+                    _dtype_convert(ibarray, iview, count * block->nmemb);
+                err = MPI_File_write_at_all(fh, foffset, buf, count, rowtype, &status);
+                if(err != MPI_SUCCESS) {
+                    _mpiio_raise(err, "MPI_File_write_at_all", filename);
+                    rt = -1;
+                } else {
+                    _big_block_add_checksums(block, f, foffset * elsize, buf, count * elsize);
+                }
+            } else {
+                err = MPI_File_read_at_all(fh, foffset, buf, count, rowtype, &status);
+                int got = 0;
+                if(err == MPI_SUCCESS) MPI_Get_count(&status, rowtype, &got);
+                if(err != MPI_SUCCESS) {
+                    _mpiio_raise(err, "MPI_File_read_at_all", filename);
+                    rt = -1;
+                } else if(got != (int) count) {
+                    _big_file_raise("Short read of physical file `%s' at row %td", __FILE__, __LINE__, filename, (ptrdiff_t) foffset);
+                    rt = -1;
+                } else if(count > 0) {
+                    _dtype_convert(iview, ibarray, count * block->nmemb);
+                }
+            }
+        }
+        MPI_File_close(&fh);
+        free(filename);
+    }
+
+    MPI_Type_free(&rowtype);
+    MPI_Info_free(&info);
+    free(buf);
+
+    if(0 == (rt = big_file_mpi_broadcast_anyerror(rt, comm))) {
+        /* no errors*/
+        big_block_seek_rel(block, ptr, totalsize);
+    }
+    return rt;
+}
+
 int
 big_block_mpi_write(BigBlock * block, BigBlockPtr * ptr, BigArray * array, int concurrency, MPI_Comm comm)
 {
-    int rt = _throttle_action(comm, concurrency, block, ptr, array, 1);
+    int rt;
+    if(_BigFileMPIIO)
+        rt = _mpiio_action(comm, concurrency, block, ptr, array, 1);
+    else if(_BigFileCollectiveBufferSize > 0)
+        rt = _two_phase_action(comm, concurrency, block, ptr, array, 1);
+    else
+        rt = _throttle_action(comm, concurrency, block, ptr, array, 1);
+    return rt;
+}
+
+struct BigBlockMPIWrite {
+    BigBlock * block;
+    BigBlockPtr * ptr; /* advanced by big_block_mpi_write_end */
+    BigBlockPtr ptr1;
+    BigArray array;
+    void * snapshot;
+    int concurrency;
+    MPI_Comm comm; /* private to the progress thread */
+    int threaded;
+    pthread_t thread;
+    int rt;
+};
+
+static void *
+_big_block_mpi_write_main(void * arg)
+{
+    BigBlockMPIWrite * req = (BigBlockMPIWrite *) arg;
+    req->rt = big_block_mpi_write(req->block, &req->ptr1, &req->array, req->concurrency, req->comm);
+    return NULL;
+}
+
+int
+big_block_mpi_write_begin(BigBlock * block, BigBlockPtr * ptr, BigArray * array, int concurrency, int copy, MPI_Comm comm, BigBlockMPIWrite ** request)
+{
+    int rt = 0;
+    BigBlockMPIWrite * req = (BigBlockMPIWrite *) calloc(1, sizeof(BigBlockMPIWrite));
+    size_t localsize = array->dims[0];
+
+    req->block = block;
+    req->ptr = ptr;
+    memcpy(&req->ptr1, ptr, sizeof(BigBlockPtr));
+    req->concurrency = concurrency;
+
+    if(copy) {
+        /* a snapshot in the dtype of the block, so the write does not convert again */
+        size_t elsize = big_file_dtype_itemsize(block->dtype) * block->nmemb;
+        req->snapshot = malloc(localsize * elsize + 1);
+        rt = req->snapshot == NULL;
+        if(0 != big_file_mpi_broadcast_anyerror(rt ? -1 : 0, comm)) {
+            free(req->snapshot);
+            free(req);
+            _big_file_raise("No memory for a snapshot of %td rows", __FILE__, __LINE__, localsize);
+            return -1;
+        }
+        big_array_init(&req->array, req->snapshot, block->dtype, 2, (size_t[]){localsize, (size_t) block->nmemb}, NULL);
+        BigArrayIter isrc[1], idst[1];
+        big_array_iter_init(isrc, array);
+        big_array_iter_init(idst, &req->array);
+        _dtype_convert(idst, isrc, localsize * block->nmemb);
+    } else {
+        memcpy(&req->array, array, sizeof(BigArray));
+    }
+
+    /* the writes go on in a thread only if MPI allows calls from two threads at a time */
+    int provided;
+    MPI_Query_thread(&provided);
+    req->threaded = _BigFileMPIProgressThread && provided == MPI_THREAD_MULTIPLE;
+    if(req->threaded) {
+        MPI_Comm_dup(comm, &req->comm);
+        if(0 != pthread_create(&req->thread, NULL, _big_block_mpi_write_main, req)) {
+            /* the other ranks may have started; join them on the same comm */
+            req->threaded = 0;
+            req->rt = big_block_mpi_write(block, &req->ptr1, &req->array, concurrency, req->comm);
+            MPI_Comm_free(&req->comm);
+        }
+    } else {
+        req->rt = big_block_mpi_write(block, &req->ptr1, &req->array, concurrency, comm);
+    }
+    *request = req;
+    return 0;
+}
+
+int
+big_block_mpi_write_end(BigBlockMPIWrite * req)
+{
+    if(req->threaded) {
+        pthread_join(req->thread, NULL);
+        MPI_Comm_free(&req->comm);
+    }
+    int rt = req->rt;
+    if(rt == 0) {
+        memcpy(req->ptr, &req->ptr1, sizeof(BigBlockPtr));
+    }
+    free(req->snapshot);
+    free(req);
+    return rt;
+}
+
+int
+big_file_mpi_plan_create(BigFileMPIPlan ** plan, size_t localsize, int concurrency, MPI_Comm comm)
+{
+    *plan = NULL;
+    if(comm == MPI_COMM_NULL) return 0;
+
+    *plan = (BigFileMPIPlan *) malloc(sizeof(BigFileMPIPlan));
+    _plan_init(*plan, localsize, concurrency, comm);
+    return 0;
+}
+
+void
+big_file_mpi_plan_free(BigFileMPIPlan * plan)
+{
+    if(plan == NULL) return;
+    _plan_destroy(plan);
+    free(plan);
+}
+
+/* The collective buffering paths do not use the segments of the plan */
+static int
+_planned_action(BigFileMPIPlan * plan, BigBlock * block, BigBlockPtr * ptr, BigArray * array, int write)
+{
+    if(plan == NULL) return 0;
+
+    int rt = 0;
+    if(array->dims[0] != plan->localsize) {
+        _big_file_raise("The array has %td rows, but the plan is for %td rows", __FILE__, __LINE__,
+            (ptrdiff_t) array->dims[0], (ptrdiff_t) plan->localsize);
+        rt = -1;
+    }
+    BCAST_AND_RAISEIF(rt, plan->comm);
+
+    if(_BigFileMPIIO)
+        rt = _mpiio_action(plan->comm, plan->concurrency, block, ptr, array, write);
+    else if(_BigFileCollectiveBufferSize > 0)
+        rt = _two_phase_action(plan->comm, plan->concurrency, block, ptr, array, write);
+    else
+        rt = _throttle_planned(plan, block, ptr, array, write);
     return rt;
 }
 
+int
+big_block_mpi_write_planned(BigBlock * block, BigBlockPtr * ptr, BigArray * array, BigFileMPIPlan * plan)
+{
+    return _planned_action(plan, block, ptr, array, 1);
+}
+
+int
+big_block_mpi_read_planned(BigBlock * block, BigBlockPtr * ptr, BigArray * array, BigFileMPIPlan * plan)
+{
+    return _planned_action(plan, block, ptr, array, 0);
+}
+
 int
 big_block_mpi_read(BigBlock * block, BigBlockPtr * ptr, BigArray * array, int concurrency, MPI_Comm comm)
 {
-    int rt = _throttle_action(comm, concurrency, block, ptr, array, 0);
+    int rt;
+    if(_BigFileMPIIO)
+        rt = _mpiio_action(comm, concurrency, block, ptr, array, 0);
+    else if(_BigFileCollectiveBufferSize > 0)
+        rt = _two_phase_action(comm, concurrency, block, ptr, array, 0);
+    else
+        rt = _throttle_action(comm, concurrency, block, ptr, array, 0);
     return rt;
 }
 
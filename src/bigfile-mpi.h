@@ -35,6 +35,18 @@ int big_file_mpi_create(BigFile * bf, const char * basename, MPI_Comm comm);
  * @returns 0 if successful, -1 if could not open block. */
 int big_file_mpi_open_block(BigFile * bf, BigBlock * block, const char * blockname, MPI_Comm comm);
 
+/** Open many BigBlocks at once:
+ * The root rank opens all blocks, with big_file_open_blocks, and broadcasts them in one message,
+ * instead of a header parse and a few collectives per block.
+ * Arguments:
+ * @param BigFile bf - pointer to opened BigFile structure.
+ * @param BigBlock blocks - array of nblocks uninitialised BigBlocks.
+ * @param blocknames - names of the blocks; only used on the root rank.
+ * @param nblocks - number of blocks; the same on all ranks.
+ * @param MPI_Comm comm - MPI communicator to use.
+ * @returns 0 if successful, -1 if any block could not be opened; then none is left open. */
+int big_file_mpi_open_blocks(BigFile * bf, BigBlock * blocks, const char * const blocknames[], int nblocks, MPI_Comm comm);
+
 /** Create a BigBlock:
  * A BigBlock stores a two dimesional table of nmemb columns and size rows. Numerical typed columns are supported.
  * Arguments:
@@ -93,6 +105,8 @@ int big_block_mpi_grow_simple(BigBlock * block, int Nfile_grow, size_t fsize_gro
  *  If the total size of data per concurrent writer group is less than the threshold,
  *  the data is aggregated to the leader rank of the writer group for writing, to reduce
  *  the total number of IO requests issued to the file server.
+ *  Ranks sharing a node first collect their data in a shared memory window, and
+ *  one message per node is sent to the leader.
  *
  * Note! Multiple writers may write to the same file at the same time! The filesystem
  * locking needs to be reliable. This is a dangerous mode to use.
@@ -101,6 +115,49 @@ int big_block_mpi_grow_simple(BigBlock * block, int Nfile_grow, size_t fsize_gro
 void big_file_mpi_set_aggregated_threshold(size_t bytes);
 size_t big_file_mpi_get_aggregated_threshold();
 
+/** Set the size of the slabs of an aggregated IO.
+ *
+ *  The leader rank gathers (scatters) the data of its group in slabs of up to `bytes`,
+ *  with two slabs in flight: one slab is written while the next is gathered.
+ *  The memory of the leader thus does not grow with the size of the group.
+ *  The default is 64 MiB.
+ * */
+void big_file_mpi_set_aggregated_slab_size(size_t bytes);
+size_t big_file_mpi_get_aggregated_slab_size();
+
+/** Set the collective buffer size, which enables the two-phase collective IO.
+ *
+ *  With a buffer size larger than 0, big_block_mpi_write and big_block_mpi_read use
+ *  `concurrency` aggregator ranks instead of taking turns. Each aggregator owns a contiguous
+ *  range of the rows, starting at a physical file boundary or at a stripe in a file, and moves
+ *  up to `bytes` of it per round; the data is redistributed to and from the aggregators
+ *  with MPI_Alltoallv. Every rank holds a buffer of up to `bytes` for each aggregator.
+ *  0 (the default) disables.
+ * */
+void big_file_mpi_set_collective_buffer_size(size_t bytes);
+size_t big_file_mpi_get_collective_buffer_size();
+
+/** Select the MPI-IO backend of big_block_mpi_write and big_block_mpi_read.
+ *
+ *  With enable = 1, each physical file is opened with MPI_File_open, and the rows are
+ *  moved with MPI_File_write_at_all and MPI_File_read_at_all; the collective buffering of
+ *  the MPI-IO library replaces the throttling and aggregation of bigfile-mpi.
+ *  info holds the hints to MPI_File_open (e.g. cb_nodes, striping_factor), and is copied;
+ *  MPI_INFO_NULL for none. Unless given, cb_nodes is the concurrency of the call.
+ *  0 (the default) disables.
+ * */
+void big_file_mpi_set_mpiio(int enable, MPI_Info info);
+int big_file_mpi_get_mpiio();
+
+/** Enable the progress thread of big_block_mpi_write_begin.
+ *
+ *  With enable = 0, the write is done before big_block_mpi_write_begin returns,
+ *  as it is where MPI does not provide MPI_THREAD_MULTIPLE.
+ *  1 (the default) enables.
+ * */
+void big_file_mpi_set_progress_thread(int enable);
+int big_file_mpi_get_progress_thread();
+
 /* This function has no effect and is here only for API compatibility purposes.*/
 void big_file_mpi_set_verbose(int verbose);
 
@@ -119,6 +176,31 @@ void big_file_mpi_set_verbose(int verbose);
  * @returns 0 if successful. */
 int big_block_mpi_write(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, int concurrency, MPI_Comm comm);
 
+typedef struct BigBlockMPIWrite BigBlockMPIWrite;
+
+/** Start writing data stored in a BigArray to a BigBlock, and return before the write is done.
+ *
+ * This is a collective MPI operation; the write is the same as big_block_mpi_write,
+ * and goes on in a progress thread, on a duplicate of comm, until big_block_mpi_write_end.
+ * The progress thread needs MPI initialized with MPI_THREAD_MULTIPLE, and
+ * big_file_mpi_set_progress_thread; otherwise the write is done before this function returns.
+ *
+ * Until big_block_mpi_write_end, the block and ptr must not be used, and with copy = 0,
+ * the data of array must not be modified or freed.
+ *
+ * Arguments:
+ * @param copy - 1 to write a snapshot of the array, taken before returning, such that the array can be reused;
+ *               0 to write from the array itself.
+ * @param request - set to the pending write, to be passed to big_block_mpi_write_end.
+ * See big_block_mpi_write for the other arguments.
+ * @returns 0 if the write is started. */
+int big_block_mpi_write_begin(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, int concurrency, int copy, MPI_Comm comm, BigBlockMPIWrite ** request);
+
+/** Wait for a write started by big_block_mpi_write_begin, and free the request.
+ * This is a collective MPI operation. On success, ptr is moved past the written data.
+ * @returns 0 if the write was successful. */
+int big_block_mpi_write_end(BigBlockMPIWrite * request);
+
 /** Create a BigBlock and write data stored in a BigArray to it.
  * This is similar to doing big_file_mpi_create_block(),
  * big_block_mpi_write() and big_block_mpi_close() in a single call.
@@ -153,6 +235,33 @@ int big_block_mpi_create_and_write(BigFile * bf, const char * blockname, BigArra
  */
 int big_block_mpi_read(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, int concurrency, MPI_Comm comm);
 
+typedef struct BigFileMPIPlan BigFileMPIPlan;
+
+/** Create a plan for writing and reading many blocks with the same number of rows per rank.
+ *
+ * The plan holds the offsets of the ranks and the writer groups of big_block_mpi_write,
+ * including their communicators and the shared memory windows of the aggregated IO,
+ * such that they are set up once instead of per block.
+ * The aggregated threshold is that at the time of the plan.
+ * This is a collective MPI operation; comm must stay valid until the plan is freed.
+ *
+ * Arguments:
+ * @param plan - set to the new plan; NULL if comm is MPI_COMM_NULL.
+ * @param localsize - number of rows on this rank.
+ * @param concurrency - see big_block_mpi_write.
+ * @param comm - MPI communicator to use.
+ * @returns 0 if successful. */
+int big_file_mpi_plan_create(BigFileMPIPlan ** plan, size_t localsize, int concurrency, MPI_Comm comm);
+
+/** Free a plan. This is a collective MPI operation on the communicator of the plan. */
+void big_file_mpi_plan_free(BigFileMPIPlan * plan);
+
+/** Write (read) like big_block_mpi_write (big_block_mpi_read), with the concurrency and comm of plan.
+ * The array must have the number of rows of the plan on each rank.
+ * @returns 0 if successful. */
+int big_block_mpi_write_planned(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, BigFileMPIPlan * plan);
+int big_block_mpi_read_planned(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, BigFileMPIPlan * plan);
+
 /** Flush the BigBlock
  *
  *  Flush will write the attrset from root rank, and gather the checksums from all ranks.
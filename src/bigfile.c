@@ -1,4 +1,5 @@
 #define _POSIX_C_SOURCE 200809L  // FIXME: scandir needs this
+#define _GNU_SOURCE /* O_DIRECT */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,10 +10,16 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
+#ifdef BIGFILE_USE_IO_URING
+#include <liburing.h>
+#endif
 
 #include "bigfile.h"
 #include "bigfile-internal.h"
@@ -21,9 +28,18 @@
 #define EXT_ATTR "attr"
 #define EXT_ATTR_V2 "attr-v2"
 #define EXT_DATA   "%06X"
+#define EXT_CHECKSUM "checksum"
+#define EXT_HEADER_V2 "header-v2"
+#define EXT_INDEX_DIR ".bigfile"
+#define EXT_INDEX ".bigfile/index"
+#define EXT_ATTR_V3 "attr-v3"
+#define INDEX_MAGIC "BIGFILE-INDEX:"
 #define FILEID_ATTR -2
 #define FILEID_ATTR_V2 -3
 #define FILEID_HEADER -1
+#define FILEID_CHECKSUM -4
+#define FILEID_HEADER_V2 -5
+#define FILEID_ATTR_V3 -6
 
 #if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
     #include <stdatomic.h>
@@ -34,6 +50,28 @@ static char * volatile ERRORSTR = NULL;
 
 static size_t CHUNK_BYTES = 64 * 1024 * 1024;
 
+/* Number of threads used by big_block_read and big_block_write; 1 is serial. */
+static int NUM_THREADS = 1;
+
+/* Chunk buffers are recycled via a small pool instead of malloc / free per call.
+ * Buffers are page aligned and at most CHUNK_BYTES. */
+#define BUFFER_POOL_SIZE 4
+#define BUFFER_ALIGNMENT 4096
+static struct {
+    char * buf;
+    size_t size;
+} BUFFER_POOL[BUFFER_POOL_SIZE];
+static pthread_mutex_t BUFFER_POOL_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+/* Number of chunk buffers in flight for a read or write; 1 disables the pipeline. */
+static int PIPELINE_DEPTH = 2;
+
+/* Bytes per CRC32C chunk checksum of blocks created afterwards; 0 disables. */
+static size_t CHECKSUM_CHUNK_BYTES = 0;
+static int BINARY_HEADER = 0;
+static int ATTR_VERSION = 2;
+static int FDCACHE_SIZE = 8;
+
 /* Internal AttrSet API */
 
 struct BigAttrSet {
@@ -46,6 +84,12 @@ struct BigAttrSet {
     BigAttr * attrlist;
     size_t listused;
     size_t listsize;
+
+    /* attrlist is sorted by name only before it is listed or written;
+     * in between attributes are found by the hash. */
+    int sorted;
+    size_t * hash; /* index into attrlist + 1; 0 marks an empty slot */
+    size_t hashsize; /* a power of 2, at least twice listused */
 };
 
 static BigAttrSet *
@@ -57,6 +101,10 @@ static int
 attrset_read_attr_set_v2(BigAttrSet * attrset, const char * basename);
 static int
 attrset_write_attr_set_v2(BigAttrSet * attrset, const char * basename);
+static int
+attrset_read_attr_set_v3(BigAttrSet * attrset, const char * basename);
+static int
+attrset_write_attr_set_v3(BigAttrSet * attrset, const char * basename);
 static BigAttr *
 attrset_lookup_attr(BigAttrSet * attrset, const char * attrname);
 static int
@@ -64,10 +112,128 @@ attrset_remove_attr(BigAttrSet * attrset, const char * attrname);
 static BigAttr *
 attrset_list_attrs(BigAttrSet * attrset, size_t * count);
 static int
+attrset_sort(BigAttrSet * attrset);
+static int
 attrset_set_attr(BigAttrSet * attrset, const char * attrname, const void * data, const char * dtype, int nmemb);
 static int
+attrset_set_attrs(BigAttrSet * attrset, const BigAttr * attrs, size_t nattrs);
+static int
 attrset_get_attr(BigAttrSet * attrset, const char * attrname, void * data, const char * dtype, int nmemb);
 
+/* Internal FDCache API; caches open descriptors of physical files for a block */
+
+struct BigFDCache {
+    pthread_mutex_t lock;
+    int size; /* max number of cached descriptors */
+    unsigned long clock;
+    struct {
+        int fileid;
+        int fd;
+        int writable;
+        int direct; /* opened with O_DIRECT */
+        int refcount; /* number of users of the descriptor */
+        unsigned long stamp; /* last use, for LRU */
+    } * entries;
+    int used;
+};
+
+static BigFDCache *
+fdcache_create(void);
+static void
+fdcache_free(BigFDCache * fdcache);
+static int
+fdcache_acquire(BigFDCache * fdcache, const char * basename, int fileid, const char * mode);
+static void
+fdcache_release(BigFDCache * fdcache, int fd);
+
+/* Internal IO pipeline API; a helper thread does the IO of a ring of chunks,
+ * while the caller converts the previous or next chunk. */
+
+typedef struct BigPipe BigPipe;
+typedef struct BigPipeSlot {
+    char * buf;
+    size_t capacity;
+    size_t skew; /* offset of the data in buf */
+    int fd;
+    int fileid;
+    ptrdiff_t offset; /* in bytes */
+    size_t bytes;
+    int state;
+    ptrdiff_t result;
+    int error; /* errno of a failed IO */
+} BigPipeSlot;
+
+static BigPipe *
+bigpipe_create(BigBlock * bb, int depth, size_t bytes, int writing);
+static void
+bigpipe_free(BigPipe * bp);
+static BigPipeSlot *
+bigpipe_slot(BigPipe * bp, int i);
+static void
+bigpipe_submit(BigPipe * bp, int i);
+static void
+bigpipe_flush(BigPipe * bp);
+static BigPipeSlot *
+bigpipe_wait(BigPipe * bp, int i);
+
+/* Internal direct IO API */
+#define DIRECTIO_ALIGNMENT 4096
+static ptrdiff_t
+_big_file_direct_io(int fd, int dfd, char * buf, size_t bytes, ptrdiff_t offset, int writing);
+static int
+_big_block_acquire_direct(BigBlock * bb, int fileid, int writing);
+static size_t
+_big_block_chunk_slack(BigBlock * bb);
+static size_t
+_big_block_chunk_skew(BigBlock * bb, ptrdiff_t offset, size_t bytes, size_t capacity);
+static ptrdiff_t
+_big_block_chunk_io(BigBlock * bb, int fd, int fileid, char * buf, size_t bytes, ptrdiff_t offset, int writing);
+
+/* Internal chunk checksum API;
+ * the running CRC32C of a chunk is the XOR of the CRCs of its pieces, each shifted
+ * to the end of the chunk, such that pieces are added in any order and from any rank. */
+static int
+_big_block_crc_alloc(BigBlock * bb, int oldNfile);
+static void
+_big_block_crc_update(BigBlock * bb, int fileid, size_t offset, const char * buf, size_t bytes);
+static int
+_big_block_read_checksums(BigBlock * bb);
+static int
+_big_block_write_checksums(BigBlock * bb);
+
+/* Internal binary header API;
+ * the binary header is a copy of the text header that loads with one read.
+ * It records the size and mtime of the text header it was made with, and is
+ * ignored once the text header is rewritten, e.g. by an older library. */
+static int
+_big_block_read_binary_header(BigBlock * bb, FILE * fheader);
+static int
+_big_block_write_binary_header(BigBlock * bb);
+
+/* Internal chunk buffer API */
+static char *
+_big_file_buffer_get(size_t bytes, size_t * capacity);
+static void
+_big_file_buffer_put(char * buf, size_t capacity);
+static void
+_big_file_buffer_drain(void);
+
+/* Internal block IO, on a range of rows */
+static int
+_big_block_read_rows(BigBlock * bb, BigBlockPtr * ptr, BigArrayIter * array_iter, ptrdiff_t toread);
+static int
+_big_block_write_rows(BigBlock * bb, BigBlockPtr * ptr, BigArrayIter * array_iter, ptrdiff_t towrite, const char * mode);
+static int
+_big_block_fanout(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, const char * mode);
+static int
+_big_block_pipelined(BigBlock * bb, ptrdiff_t nrows);
+static int
+_big_block_read_pipelined(BigBlock * bb, BigBlockPtr * ptr, BigArrayIter * array_iter, ptrdiff_t toread);
+static int
+_big_block_write_pipelined(BigBlock * bb, BigBlockPtr * ptr, BigArrayIter * array_iter, ptrdiff_t towrite, const char * mode);
+static void
+_big_array_iter_seek(BigArrayIter * iter, ptrdiff_t index);
+
 /* Internal dtype API */
 static int
 dtype_convert_simple(void * dst, const char * dstdtype, const void * src, const char * srcdtype, size_t nmemb);
@@ -92,7 +258,57 @@ int
 big_file_set_buffer_size(size_t bytes)
 {
     CHUNK_BYTES = bytes;
+    /* also releases the memory held by the buffer pool */
+    _big_file_buffer_drain();
+    return 0;
+}
+
+int
+big_file_set_num_threads(int nthreads)
+{
+    NUM_THREADS = nthreads < 1 ? 1 : nthreads;
+    return 0;
+}
+
+int
+big_file_set_pipeline_depth(int depth)
+{
+    PIPELINE_DEPTH = depth < 1 ? 1 : depth;
+    return 0;
+}
+
+int
+big_file_set_fd_cache_size(int nfiles)
+{
+    if(nfiles < 0) nfiles = 0;
+    FDCACHE_SIZE = nfiles;
+    return 0;
+}
+
+int
+big_file_set_checksum_chunk_size(size_t bytes)
+{
+    CHECKSUM_CHUNK_BYTES = bytes;
+    return 0;
+}
+
+int
+big_file_set_binary_header(int enable)
+{
+    BINARY_HEADER = enable != 0;
+    return 0;
+}
+
+int
+big_file_set_attr_version(int version)
+{
+    RAISEIF(version != 2 && version != 3,
+        ex_version,
+        "Attribute file version %d is not supported; use 2 or 3", version);
+    ATTR_VERSION = version;
     return 0;
+ex_version:
+    return -1;
 }
 
 /* Error handling */
@@ -207,6 +423,11 @@ ex_subdir:
 struct bblist {
     struct bblist * next;
     char * blockname;
+    /* only filled when the list is for the index */
+    char dtype[8];
+    int nmemb;
+    size_t size;
+    struct timespec mtime; /* of a directory */
 };
 static int (filter)(const struct dirent * ent) {
     if(ent->d_name[0] == '.') return 0;
@@ -220,8 +441,144 @@ _alphasort (const struct dirent **a, const struct dirent **b)
     return strcoll ((*a)->d_name, (*b)->d_name);
 }
 
+static struct bblist *
+_bblist_push(struct bblist * bblist, const char * blockname)
+{
+    struct bblist * n = (struct bblist *) calloc(1, sizeof(struct bblist) + strlen(blockname) + 1);
+    n->next = bblist;
+    n->blockname = (char*) &n[1];
+    strcpy(n->blockname, blockname);
+    return n;
+}
+
+static int
+_bblist_cmp(const void * a, const void * b)
+{
+    const struct bblist * p = *(const struct bblist * const *) a;
+    const struct bblist * q = *(const struct bblist * const *) b;
+    int c = strcmp(p->blockname, q->blockname);
+    if(c != 0) return c;
+    /* earlier in the list first */
+    return (p->nmemb < q->nmemb) ? -1 : (p->nmemb > q->nmemb);
+}
+
+/* drops the entries of names seen earlier in the list; returns the new list. */
+static struct bblist *
+_bblist_unique(struct bblist * bblist)
+{
+    struct bblist * p;
+    size_t n = 0, i;
+    for(p = bblist; p; p = p->next) n ++;
+    if(n < 2) return bblist;
+
+    struct bblist ** sorted = malloc(sizeof(sorted[0]) * n);
+    int * nmemb = malloc(sizeof(nmemb[0]) * n);
+    for(p = bblist, i = 0; p; p = p->next, i ++) {
+        sorted[i] = p;
+        /* borrowed for the position in the list */
+        nmemb[i] = p->nmemb;
+        p->nmemb = i;
+    }
+    qsort(sorted, n, sizeof(sorted[0]), _bblist_cmp);
+    /* the first of each run of a name is kept */
+    struct bblist * kept = sorted[0];
+    for(i = 1; i < n; i ++) {
+        if(0 == strcmp(sorted[i]->blockname, kept->blockname)) {
+            /* marked for removal */
+            sorted[i]->blockname[0] = 0;
+        } else {
+            kept = sorted[i];
+        }
+    }
+    free(sorted);
+
+    struct bblist * head = NULL, ** tail = &head;
+    for(p = bblist, i = 0; p; i ++) {
+        struct bblist * next = p->next;
+        p->nmemb = nmemb[i];
+        if(p->blockname[0] == 0) {
+            free(p);
+        } else {
+            *tail = p;
+            tail = &p->next;
+        }
+        p = next;
+    }
+    *tail = NULL;
+    free(nmemb);
+    return head;
+}
+
+static struct bblist *
+_bblist_find(struct bblist * bblist, const char * blockname)
+{
+    for(; bblist; bblist = bblist->next) {
+        if(0 == strcmp(bblist->blockname, blockname)) break;
+    }
+    return bblist;
+}
+
+static void
+_bblist_free(struct bblist * bblist)
+{
+    while(bblist) {
+        struct bblist * p = bblist;
+        bblist = bblist->next;
+        free(p);
+    }
+}
+
+/* reads dtype, nmemb and size from the text header of a block */
+static int
+_big_block_read_summary(const char * basename, struct bblist * entry)
+{
+    FILE * fheader = _big_file_open_a_file(basename, FILEID_HEADER, "r", 0);
+    if(fheader == NULL) return -1;
+    int Nfile;
+    int rt = -1;
+    if(1 == fscanf(fheader, " DTYPE: %7s", entry->dtype)
+    && 1 == fscanf(fheader, " NMEMB: %d", &entry->nmemb)
+    && 1 == fscanf(fheader, " NFILE: %d", &Nfile)) {
+        int i;
+        entry->size = 0;
+        for(i = 0; i < Nfile; i ++) {
+            int fid;
+            size_t size;
+            unsigned int cksum, sysv;
+            if(4 != fscanf(fheader, " " EXT_DATA ": %td : %u : %u", &fid, &size, &cksum, &sysv)) break;
+            entry->size += size;
+        }
+        if(i == Nfile) rt = 0;
+    }
+    fclose(fheader);
+    return rt;
+}
+
+/* the mtime of a directory to record in the index; zero, which matches no directory,
+ * if in whole seconds and recent, as it may change again in the same second. */
+static struct timespec
+_big_file_index_mtime(const struct timespec * mtime)
+{
+    struct timespec zero = {0};
+    if(mtime->tv_nsec == 0 && mtime->tv_sec >= time(NULL) - 1) return zero;
+    return *mtime;
+}
+
+static int
+_timespec_older(const struct timespec * a, const struct timespec * b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static int
+_timespec_equal(const struct timespec * a, const struct timespec * b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* dirs collects the directories that are not blocks, for the index; may be NULL. */
 static struct
-bblist * listbigfile_r(const char * basename, const char * blockname, struct bblist * bblist) {
+bblist * listbigfile_r(const char * basename, const char * blockname, struct bblist * bblist, struct bblist ** dirs) {
     struct dirent **namelist;
     int n;
     int i;
@@ -229,22 +586,31 @@ bblist * listbigfile_r(const char * basename, const char * blockname, struct bbl
     char * current;
     current = _path_join(basename, blockname);
 
+    /* before the scan, such that a change during the scan makes the index stale */
+    struct stat st;
+    int r = dirs ? stat(current, &st) : -1;
+
     n = scandir(current, &namelist, filter, _alphasort);
     free(current);
     if (n < 0)
         return bblist;
 
+    if(dirs) {
+        *dirs = _bblist_push(*dirs, blockname[0] ? blockname : ".");
+        if(r == 0) (*dirs)->mtime = _big_file_index_mtime(&st.st_mtim);
+    }
+
     for(i = 0; i < n ; i ++) {
         char * blockname1 = _path_join(blockname, namelist[i]->d_name);
         char * fullpath1 = _path_join(basename, blockname1);
         if(_big_file_path_is_block(fullpath1)) {
-            struct bblist * n = (struct bblist *) malloc(sizeof(struct bblist) + strlen(blockname1) + 1);
-            n->next = bblist;
-            n->blockname = (char*) &n[1];
-            strcpy(n->blockname, blockname1);
-            bblist = n;
+            bblist = _bblist_push(bblist, blockname1);
+            if(dirs && 0 != _big_block_read_summary(fullpath1, bblist)) {
+                /* header changed under us; not for the index. */
+                bblist->nmemb = -1;
+            }
         } else {
-            bblist = listbigfile_r(basename, blockname1, bblist);
+            bblist = listbigfile_r(basename, blockname1, bblist, dirs);
         }
         free(fullpath1);
         free(blockname1);
@@ -254,10 +620,352 @@ bblist * listbigfile_r(const char * basename, const char * blockname, struct bbl
     return bblist;
 }
 
+/*
+ * The block index.
+ *
+ * `.bigfile/index` at the root of a file lists the blocks with their dtype, nmemb and
+ * size at creation, and the directories that are not blocks with their mtime, such that
+ * big_file_list does not scan the directory tree. The index is fresh if every
+ * listed directory still has its mtime: a block added or removed by anything
+ * else changes the mtime of its parent directory. A stale index is rebuilt by
+ * the next big_file_list.
+ *
+ * Creating a block costs a stat of each directory on the way before and after
+ * making them, and one more of the parent before the records of the new block
+ * and the directories it changed are appended.
+ *
+ * Lines are
+ *     DIR: name sec nsec
+ *     BLOCK: name dtype nmemb size
+ * later lines replace earlier ones of the same name.
+ * */
+
+/* the mtime of the directory dirname, "." for the root; zero if it does not exist. */
+static struct timespec
+_big_file_index_dirtime(const char * basename, const char * dirname)
+{
+    struct timespec mtime = {0};
+    struct stat st;
+    char * path = _path_join(basename, strcmp(dirname, ".") ? dirname : "");
+    if(0 == stat(path, &st)) mtime = st.st_mtim;
+    free(path);
+    return mtime;
+}
+
+/* 1 if the index is present and readable, 0 if absent, -1 if unreadable. */
+static int
+_big_file_index_read(const char * basename, struct bblist ** dirs, struct bblist ** blocks)
+{
+    char * indexname = _path_join(basename, EXT_INDEX);
+    FILE * findex = fopen(indexname, "r");
+    free(indexname);
+    if(findex == NULL) return 0;
+
+    struct bblist * dirlist = NULL;
+    struct bblist * list = NULL;
+    int rt = -1;
+    char * line = NULL;
+    char * name = NULL;
+    size_t cap = 0;
+    int version;
+
+    if(1 != fscanf(findex, " " INDEX_MAGIC " %d\n", &version)
+    || version != 2) {
+        goto ex_read;
+    }
+
+    while(-1 != getline(&line, &cap, findex)) {
+        name = realloc(name, cap);
+        struct bblist entry = {0};
+        long sec, nsec;
+        if(3 == sscanf(line, "DIR: %s %ld %ld", name, &sec, &nsec)) {
+            dirlist = _bblist_push(dirlist, name);
+            dirlist->mtime.tv_sec = sec;
+            dirlist->mtime.tv_nsec = nsec;
+        } else
+        if(4 == sscanf(line, "BLOCK: %s %7s %d %td", name, entry.dtype, &entry.nmemb, &entry.size)) {
+            list = _bblist_push(list, name);
+            memcpy(list->dtype, entry.dtype, sizeof(entry.dtype));
+            list->nmemb = entry.nmemb;
+            list->size = entry.size;
+        } else {
+            goto ex_read;
+        }
+    }
+
+    /* the newest entry of a name is first */
+    *dirs = _bblist_unique(dirlist);
+    *blocks = _bblist_unique(list);
+    dirlist = NULL;
+    list = NULL;
+    rt = 1;
+
+ex_read:
+    free(name);
+    free(line);
+    _bblist_free(dirlist);
+    _bblist_free(list);
+    fclose(findex);
+    return rt;
+}
+
+/* 1 if the index is present and fresh, 0 if absent, -1 if stale or unreadable.
+ * The blocks are returned in *blocks. */
+static int
+_big_file_index_load(const char * basename, struct bblist ** blocks)
+{
+    struct bblist * dirs = NULL;
+    struct bblist * list = NULL;
+    int rt = _big_file_index_read(basename, &dirs, &list);
+    if(rt != 1) return rt;
+
+    struct bblist * p;
+    for(p = dirs; p; p = p->next) {
+        struct timespec mtime = _big_file_index_dirtime(basename, p->blockname);
+        if(p->mtime.tv_sec == 0 || !_timespec_equal(&mtime, &p->mtime)) {
+            rt = -1;
+            break;
+        }
+    }
+    _bblist_free(dirs);
+    if(rt == 1) {
+        *blocks = list;
+    } else {
+        _bblist_free(list);
+    }
+    return rt;
+}
+
+/* writes the index from a fresh scan. */
+static struct bblist *
+_big_file_index_rebuild(const char * basename)
+{
+    char * indexname = _path_join(basename, EXT_INDEX);
+    char * tmpname = malloc(strlen(indexname) + 32);
+    sprintf(tmpname, "%s.%d", indexname, (int) getpid());
+
+    /* the index and its temporary files live in a directory of their own,
+     * made before the scan, such that writing them does not touch the mtime of the root. */
+    char * indexdir = _path_join(basename, EXT_INDEX_DIR);
+    mkdir(indexdir, 0777);
+    free(indexdir);
+
+    struct bblist * dirs = NULL;
+    struct bblist * bblist;
+    FILE * findex = fopen(tmpname, "w");
+    if(findex == NULL) {
+        /* read-only file, or no permission: list only */
+        bblist = listbigfile_r(basename, "", NULL, NULL);
+        goto ex_open;
+    }
+
+    struct bblist ** pdirs = &dirs;
+    bblist = listbigfile_r(basename, "", NULL, pdirs);
+    int ok = dirs != NULL;
+
+    struct bblist * p;
+    for(p = bblist; p; p = p->next) {
+        if(p->nmemb < 0) ok = 0;
+    }
+    ok = ok && 0 <= fprintf(findex, INDEX_MAGIC " 2\n");
+    for(p = dirs; ok && p; p = p->next) {
+        ok = 0 <= fprintf(findex, "DIR: %s %ld %ld\n", p->blockname, (long) p->mtime.tv_sec, (long) p->mtime.tv_nsec);
+    }
+    for(p = bblist; ok && p; p = p->next) {
+        ok = 0 <= fprintf(findex, "BLOCK: %s %s %d %td\n", p->blockname, p->dtype, p->nmemb, p->size);
+    }
+    ok = (0 == fclose(findex)) && ok;
+    if(ok) ok = 0 == rename(tmpname, indexname);
+    if(!ok) unlink(tmpname);
+
+    _bblist_free(dirs);
+ex_open:
+    free(tmpname);
+    free(indexname);
+    return bblist;
+}
+
+/* orders names like the directory scan, one path component at a time */
+static int
+_blockname_cmp(const void * a, const void * b)
+{
+    const char * p = *(const char * const *) a;
+    const char * q = *(const char * const *) b;
+    while(1) {
+        size_t lp = strcspn(p, "/");
+        size_t lq = strcspn(q, "/");
+        char * cp = alloca(lp + 1);
+        char * cq = alloca(lq + 1);
+        memcpy(cp, p, lp); cp[lp] = 0;
+        memcpy(cq, q, lq); cq[lq] = 0;
+        int c = strcoll(cp, cq);
+        if(c != 0) return c;
+        p += lp;
+        q += lq;
+        if(*p == 0 || *q == 0) return (*p != 0) - (*q != 0);
+        p ++;
+        q ++;
+    }
+}
+
+/* the name of a block as the scan would spell it, NULL if the scan would not see it. */
+static char *
+_big_file_index_name(const char * blockname)
+{
+    char * name = malloc(strlen(blockname) + 1);
+    char * q = name;
+    const char * p = blockname;
+    while(*p) {
+        size_t l = strcspn(p, "/");
+        if(l > 0 && !(l == 1 && p[0] == '.')) {
+            /* hidden names are skipped by the scan */
+            if(p[0] == '.') goto ex_name;
+            if(q != name) *q++ = '/';
+            memcpy(q, p, l);
+            q += l;
+        }
+        p += l;
+        if(*p) p++;
+    }
+    *q = 0;
+    if(name[0] != 0) return name;
+ex_name:
+    free(name);
+    return NULL;
+}
+
+/* the i-th directory on the way to the block name, "." for the root. */
+static char *
+_big_file_index_dirname(const char * name, int i)
+{
+    const char * p = name;
+    if(i == 0) return _strdup(".");
+    while(i > 0) {
+        p = strchr(p, '/') + 1;
+        i --;
+    }
+    char * dirname = _strdup(name);
+    dirname[p - 1 - name] = 0;
+    return dirname;
+}
+
+/* the mtimes of the directories on the way; zero for those that do not exist. */
+static void
+_big_file_index_stat_dirs(const char * basename, const BigFileIndexState * state, struct timespec * mtime)
+{
+    int i;
+    for(i = 0; i < state->ndirs; i ++) {
+        char * dirname = _big_file_index_dirname(state->name, i);
+        mtime[i] = _big_file_index_dirtime(basename, dirname);
+        free(dirname);
+    }
+}
+
+static void
+_big_file_index_state_free(BigFileIndexState * state)
+{
+    free(state->name);
+    free(state->before);
+    memset(state, 0, sizeof(state[0]));
+}
+
+int
+_big_file_index_mkdir(const char * basename, const char * blockname, BigFileIndexState * state)
+{
+    memset(state, 0, sizeof(state[0]));
+    state->name = _big_file_index_name(blockname);
+    if(state->name) {
+        const char * p;
+        state->ndirs = 1;
+        for(p = strchr(state->name, '/'); p; p = strchr(p + 1, '/')) state->ndirs ++;
+        state->before = calloc(2 * state->ndirs, sizeof(state->before[0]));
+        state->after = state->before + state->ndirs;
+        _big_file_index_stat_dirs(basename, state, state->before);
+    }
+    if(0 != _big_file_mksubdir_r(basename, blockname)) {
+        _big_file_index_state_free(state);
+        return -1;
+    }
+    if(state->name) {
+        _big_file_index_stat_dirs(basename, state, state->after);
+    }
+    return 0;
+}
+
+void
+_big_file_index_add(const char * basename, BigFileIndexState * state, BigBlock * bb)
+{
+    struct bblist * dirs = NULL;
+    struct bblist * blocks = NULL;
+    char * record = NULL;
+    const char * name = state->name;
+
+    /* a missing index is created by big_file_list; a stale one will be rebuilt. */
+    if(name == NULL || bb == NULL
+    || 1 != _big_file_index_read(basename, &dirs, &blocks)) {
+        goto ex_record;
+    }
+    /* a directory that becomes a block hides the blocks under it */
+    if(_bblist_find(dirs, name)) goto ex_record;
+
+    record = malloc((state->ndirs + 1) * (strlen(name) + 128));
+    size_t len = 0;
+    int i;
+    for(i = 0; i < state->ndirs; i ++) {
+        char * dirname = _big_file_index_dirname(name, i);
+        struct bblist * known = _bblist_find(dirs, dirname);
+        struct timespec recorded = {0};
+        if(known) recorded = known->mtime;
+        struct timespec mtime = _big_file_index_mtime(&state->after[i]);
+        /* the directory was not as indexed before we made ours, e.g. it is a block; or
+         * its new mtime cannot be told from a later change. Leave the index as it is. */
+        int skip = !_timespec_equal(&recorded, &state->before[i]) || mtime.tv_sec == 0;
+        if(!skip && !_timespec_equal(&recorded, &mtime)) {
+            len += sprintf(record + len, "DIR: %s %ld %ld\n", dirname, (long) mtime.tv_sec, (long) mtime.tv_nsec);
+        }
+        free(dirname);
+        if(skip) goto ex_record;
+    }
+    struct bblist * known = _bblist_find(blocks, name);
+    /* a block made again with the same shape is already in the index */
+    if(!(known
+        && !strcmp(known->dtype, bb->dtype)
+        && known->nmemb == bb->nmemb
+        && known->size == bb->size)) {
+        len += sprintf(record + len, "BLOCK: %s %s %d %td\n", name, bb->dtype, bb->nmemb, bb->size);
+    }
+    if(len == 0) goto ex_record;
+
+    /* nothing else changed the parent since we made the block */
+    char * dirname = _big_file_index_dirname(name, state->ndirs - 1);
+    struct timespec parent = _big_file_index_dirtime(basename, dirname);
+    free(dirname);
+    if(!_timespec_equal(&parent, &state->after[state->ndirs - 1])) goto ex_record;
+
+    char * indexname = _path_join(basename, EXT_INDEX);
+    int fd = open(indexname, O_WRONLY | O_APPEND);
+    free(indexname);
+    if(fd >= 0) {
+        /* one write, such that concurrent appends do not interleave */
+        if(write(fd, record, len) < 0) {
+            /* the directories are newer than the index; it is stale */
+        }
+        close(fd);
+    }
+ex_record:
+    free(record);
+    _bblist_free(dirs);
+    _bblist_free(blocks);
+    _big_file_index_state_free(state);
+}
+
 int
 big_file_list(BigFile * bf, char *** blocknames, int * Nblocks)
 {
-    struct bblist * bblist = listbigfile_r(bf->basename, "", NULL);
+    struct bblist * bblist = NULL;
+    if(1 != _big_file_index_load(bf->basename, &bblist)) {
+        bblist = _big_file_index_rebuild(bf->basename);
+    }
     struct bblist * p;
     int N = 0;
     int i;
@@ -272,6 +980,13 @@ big_file_list(BigFile * bf, char *** blocknames, int * Nblocks)
         bblist = bblist->next;
         free(p);
     }
+    /* the order of the scan is the reversed order of the names */
+    qsort(*blocknames, N, sizeof(char*), _blockname_cmp);
+    for(i = 0; i < N / 2; i ++) {
+        char * t = (*blocknames)[i];
+        (*blocknames)[i] = (*blocknames)[N - 1 - i];
+        (*blocknames)[N - 1 - i] = t;
+    }
     return 0;
 }
 
@@ -284,16 +999,97 @@ big_file_open_block(BigFile * bf, BigBlock * block, const char * blockname)
     return rt;
 }
 
+struct BigBlockOpener {
+    BigFile * bf;
+    BigBlock * blocks;
+    const char * const * blocknames;
+    int nblocks;
+    int next;
+    int * status;
+};
+
+static void *
+_big_file_open_worker(void * data)
+{
+    struct BigBlockOpener * opener = (struct BigBlockOpener *) data;
+    while(1) {
+        int i = __atomic_fetch_add(&opener->next, 1, __ATOMIC_RELAXED);
+        if(i >= opener->nblocks) break;
+        opener->status[i] = big_file_open_block(opener->bf, &opener->blocks[i], opener->blocknames[i]);
+    }
+    return NULL;
+}
+
+int
+big_file_open_blocks(BigFile * bf, BigBlock * blocks, const char * const blocknames[], int nblocks)
+{
+    struct BigBlockOpener opener = {0};
+    opener.bf = bf;
+    opener.blocks = blocks;
+    opener.blocknames = blocknames;
+    opener.nblocks = nblocks;
+    opener.status = calloc(nblocks + 1, sizeof(int));
+    RAISEIF(opener.status == NULL,
+        ex_malloc,
+        "No memory");
+
+    int nthreads = NUM_THREADS < nblocks ? NUM_THREADS : nblocks;
+    pthread_t * threads = calloc(nthreads + 1, sizeof(pthread_t));
+    int * started = calloc(nthreads + 1, sizeof(int));
+    RAISEIF(threads == NULL || started == NULL,
+        ex_threads,
+        "No memory");
+
+    int i;
+    /* the calling thread is one of the workers */
+    for(i = 1; i < nthreads; i ++) {
+        started[i] = 0 == pthread_create(&threads[i], NULL, _big_file_open_worker, &opener);
+    }
+    _big_file_open_worker(&opener);
+    for(i = 1; i < nthreads; i ++) {
+        if(started[i]) pthread_join(threads[i], NULL);
+    }
+
+    int failed = -1;
+    for(i = 0; i < nblocks; i ++) {
+        if(opener.status[i] != 0 && failed < 0) failed = i;
+    }
+    if(failed >= 0) {
+        /* all or nothing */
+        for(i = 0; i < nblocks; i ++) {
+            if(opener.status[i] == 0) _big_block_close_internal(&blocks[i]);
+        }
+    }
+    free(started);
+    free(threads);
+    free(opener.status);
+    /* a failing open has set the error message */
+    RAISEIF(failed >= 0,
+        ex_open,
+        NULL);
+    return 0;
+
+ex_threads:
+    free(started);
+    free(threads);
+    free(opener.status);
+ex_open:
+ex_malloc:
+    return -1;
+}
+
 int
 big_file_create_block(BigFile * bf, BigBlock * block, const char * blockname, const char * dtype, int nmemb, int Nfile, const size_t fsize[])
 {
-    if(0 != _big_file_mksubdir_r(bf->basename, blockname)) {
+    BigFileIndexState index;
+    if(0 != _big_file_index_mkdir(bf->basename, blockname, &index)) {
         _big_file_raise(NULL, __FILE__, __LINE__);
         return -1;
     }
     char * basename = _path_join(bf->basename, blockname);
     int rt = _big_block_create(block, basename, dtype, nmemb, Nfile, fsize);
     free(basename);
+    _big_file_index_add(bf->basename, &index, rt == 0 ? block : NULL);
     return rt;
 }
 
@@ -305,9 +1101,6 @@ big_file_close(BigFile * bf)
     return 0;
 }
 
-static void
-sysvsum(unsigned int * sum, void * buf, size_t size);
-
 /* Bigblock */
 
 int
@@ -329,6 +1122,10 @@ _big_block_open(BigBlock * bb, const char * basename)
             ex_readattr,
             NULL);
 
+    RAISEIF(0 != attrset_read_attr_set_v3(bb->attrset, bb->basename),
+            ex_readattr,
+            NULL);
+
     if (!endswith(bb->basename, "/.") && 0 != strcmp(bb->basename, ".")) {
         FILE * fheader = _big_file_open_a_file(bb->basename, FILEID_HEADER, "r", 1);
         RAISEIF (!fheader,
@@ -361,7 +1158,11 @@ _big_block_open(BigBlock * bb, const char * basename)
                 ex_fchecksum,
                 "Failed to alloc memory `%s'", bb->basename);
         int i;
-        for(i = 0; i < bb->Nfile; i ++) {
+        int binary = _big_block_read_binary_header(bb, fheader);
+        RAISEIF(binary < 0,
+                ex_fscanf1,
+                NULL);
+        for(i = 0; i < bb->Nfile && !binary; i ++) {
             int fid;
             size_t size;
             unsigned int cksum;
@@ -382,9 +1183,16 @@ _big_block_open(BigBlock * bb, const char * basename)
         bb->size = bb->foffset[bb->Nfile];
 
         fclose(fheader);
+        fheader = NULL;
 
+        RAISEIF(0 != _big_block_read_checksums(bb),
+                ex_checksum,
+                NULL);
+
+        bb->fdcache = fdcache_create();
         return 0;
 
+ex_checksum:
 ex_fscanf1:
         free(bb->fchecksum);
 ex_fchecksum:
@@ -393,7 +1201,7 @@ ex_foffset:
         free(bb->fsize);
 ex_fsize:
 ex_fscanf:
-        fclose(fheader);
+        if(fheader) fclose(fheader);
 ex_open:
         return -1;
     } else {
@@ -436,13 +1244,14 @@ _big_block_grow_internal(BigBlock * bb, int Nfile_grow, const size_t fsize_grow[
     free(bb->foffset);
     free(bb->fchecksum);
 
+    int oldNfile = bb->Nfile;
     bb->fsize = fsize;
     bb->foffset = foffset;
     bb->fchecksum = fchecksum;
     bb->Nfile = Nfile;
     bb->size = bb->foffset[Nfile];
     bb->dirty = 1;
-    return 0;
+    return _big_block_crc_alloc(bb, oldNfile);
 }
 
 int
@@ -516,12 +1325,20 @@ _big_block_create_internal(BigBlock * bb, const char * basename, const char * dt
         bb->size = bb->foffset[bb->Nfile];
         bb->dirty = 1;
 
+        bb->crcsize = CHECKSUM_CHUNK_BYTES;
+        RAISEIF(0 != _big_block_crc_alloc(bb, 0),
+                ex_crc, NULL);
+
         RAISEIF(0 != big_block_flush(bb),
                 ex_flush, NULL);
 
         bb->dirty = 0;
+        bb->fdcache = fdcache_create();
         return 0;
 ex_flush:
+        free(bb->fcrc);
+        free(bb->fcrcoffset);
+ex_crc:
         attrset_free(bb->attrset);
         free(bb->foffset);
 ex_foffset:
@@ -581,6 +1398,56 @@ big_block_set_dirty(BigBlock * block, int value)
     block->dirty = value;
 }
 
+void
+big_block_set_direct_io(BigBlock * block, int value)
+{
+    block->directio = value;
+}
+
+/* returns a descriptor with O_DIRECT of the physical file, or -1 if direct IO is off or unavailable;
+ * the buffered descriptor is used then. */
+static int
+_big_block_acquire_direct(BigBlock * bb, int fileid, int writing)
+{
+    if(!bb->directio) return -1;
+    return fdcache_acquire(bb->fdcache, bb->basename, fileid, writing ? "r+d" : "rd");
+}
+
+/* room reserved in a chunk buffer for the skew */
+static size_t
+_big_block_chunk_slack(BigBlock * bb)
+{
+    return bb->directio ? DIRECTIO_ALIGNMENT : 0;
+}
+
+/* offset of the data in a chunk buffer; with direct IO the data is placed such that
+ * it is aligned in memory where it is aligned in the file, if it fits the buffer. */
+static size_t
+_big_block_chunk_skew(BigBlock * bb, ptrdiff_t offset, size_t bytes, size_t capacity)
+{
+    size_t skew = offset % DIRECTIO_ALIGNMENT;
+    if(!bb->directio || bytes + skew > capacity) return 0;
+    return skew;
+}
+
+/* IO of a chunk of a physical file, via fd, or with direct IO if enabled on the block. */
+static ptrdiff_t
+_big_block_chunk_io(BigBlock * bb, int fd, int fileid, char * buf, size_t bytes, ptrdiff_t offset, int writing)
+{
+    if(!bb->directio) {
+        if(writing)
+            return _big_file_pwrite(fd, buf, bytes, offset);
+        else
+            return _big_file_pread(fd, buf, bytes, offset);
+    }
+    int dfd = _big_block_acquire_direct(bb, fileid, writing);
+    ptrdiff_t result = _big_file_direct_io(fd, dfd, buf, bytes, offset, writing);
+    int error = errno;
+    if(dfd >= 0) fdcache_release(bb->fdcache, dfd);
+    errno = error;
+    return result;
+}
+
 int
 big_block_flush(BigBlock * block)
 {
@@ -596,19 +1463,27 @@ big_block_flush(BigBlock * block)
                 ex_fprintf,
                 "Writing file header");
         for(i = 0; i < block->Nfile; i ++) {
-            unsigned int s = block->fchecksum[i];
-            unsigned int r = (s & 0xffff) + ((s & 0xffffffff) >> 16);
-            unsigned int checksum = (r & 0xffff) + (r >> 16);
+            unsigned int checksum = big_file_sysvsum_fold(block->fchecksum[i]);
             RAISEIF(0 > fprintf(fheader, EXT_DATA ": %td : %u : %u\n", i, block->fsize[i], block->fchecksum[i], checksum),
                 ex_fprintf, "Writing file information to header");
         }
         fclose(fheader);
+        RAISEIF(0 != _big_block_write_binary_header(block),
+                ex_fileio, NULL);
+        RAISEIF(0 != _big_block_write_checksums(block),
+                ex_fileio, NULL);
         block->dirty = 0;
     }
     if(block->attrset->dirty) {
-        RAISEIF(0 != attrset_write_attr_set_v2(block->attrset, block->basename),
-            ex_write_attr,
-            NULL);
+        if(ATTR_VERSION == 3) {
+            RAISEIF(0 != attrset_write_attr_set_v3(block->attrset, block->basename),
+                ex_write_attr,
+                NULL);
+        } else {
+            RAISEIF(0 != attrset_write_attr_set_v2(block->attrset, block->basename),
+                ex_write_attr,
+                NULL);
+        }
         block->attrset->dirty = 0;
     }
     return 0;
@@ -624,11 +1499,14 @@ void
 _big_block_close_internal(BigBlock * block)
 {
     attrset_free(block->attrset);
+    fdcache_free(block->fdcache);
 
     free(block->basename);
     free(block->fchecksum);
     free(block->fsize);
     free(block->foffset);
+    free(block->fcrcoffset);
+    free(block->fcrc);
     memset(block, 0, sizeof(BigBlock));
 }
 
@@ -673,6 +1551,12 @@ big_block_set_attr(BigBlock * block, const char * attrname, const void * data, c
     return attrset_set_attr(block->attrset, attrname, data, dtype, nmemb);
 }
 
+int
+big_block_set_attrs(BigBlock * block, const BigAttr * attrs, size_t nattrs)
+{
+    return attrset_set_attrs(block->attrset, attrs, nattrs);
+}
+
 int
 big_block_get_attr(BigBlock * block, const char * attrname, void * data, const char * dtype, int nmemb)
 {
@@ -796,49 +1680,75 @@ ex_seek:
 int
 big_block_read(BigBlock * bb, BigBlockPtr * ptr, BigArray * array)
 {
-    char * chunkbuf = (char *) malloc(CHUNK_BYTES);
+    int64_t nmemb = bb->nmemb ? bb->nmemb : 1;
+    int64_t felsize = big_file_dtype_itemsize(bb->dtype) * nmemb;
+    ptrdiff_t toread = array->size / nmemb;
+
+    ptrdiff_t abs = bb->foffset[ptr->fileid] + ptr->roffset + toread;
+    RAISEIF(abs > bb->size,
+                ex_eof,
+                "Reading beyond the block `%s` at (%d:%td)",
+                bb->basename, ptr->fileid, ptr->roffset * felsize);
+
+    return _big_block_fanout(bb, ptr, array, NULL);
+ex_eof:
+    return -1;
+}
+
+static int
+_big_block_read_rows(BigBlock * bb, BigBlockPtr * ptr, BigArrayIter * array_iter, ptrdiff_t toread)
+{
+    char * chunkbuf = NULL;
+    size_t chunkbytes = 0;
 
     int64_t nmemb = bb->nmemb ? bb->nmemb : 1;
     int64_t felsize = big_file_dtype_itemsize(bb->dtype) * nmemb;
-    size_t CHUNK_SIZE = CHUNK_BYTES / felsize;
+    size_t CHUNK_SIZE = 0;
 
     BigArray chunk_array = {0};
     size_t dims[2];
-    dims[0] = CHUNK_SIZE;
-    dims[1] = bb->nmemb;
 
     BigArrayIter chunk_iter;
-    BigArrayIter array_iter;
 
-    FILE * fp = NULL;
-    ptrdiff_t toread = 0;
+    int fd = -1;
 
-    if(chunkbuf == NULL) {
-        _big_file_raise("Not enough memory for chunkbuf", __FILE__, __LINE__);
-        return -1;
+    /* If the array is contiguous and of the same dtype as the block (including the byte order),
+     * there is nothing to convert; read directly into the array, skipping the chunk buffer.
+     * Not with direct IO, which needs aligned memory. */
+    int direct = !bb->directio && array_iter->contiguous && 0 == strcmp(array_iter->array->dtype, bb->dtype);
+    size_t slack = _big_block_chunk_slack(bb);
+
+    /* overlap reading with conversion if there is more than a chunk */
+    if(!direct && _big_block_pipelined(bb, toread)) {
+        return _big_block_read_pipelined(bb, ptr, array_iter, toread);
     }
 
-    big_array_init(&chunk_array, chunkbuf, bb->dtype, 2, dims, NULL);
-    big_array_iter_init(&array_iter, array);
+    /* the conversion is resolved once for all chunks */
+    BigDtypeConverter conv;
+    if(0 != _dtype_converter_init(&conv, array_iter->array->dtype, bb->dtype)) {
+        return -1;
+    }
 
-    toread = array->size / nmemb;
+    if(!direct) {
+        /* small requests get small buffers */
+        chunkbuf = _big_file_buffer_get(toread * felsize + slack, &chunkbytes);
+        if(chunkbuf == NULL) {
+            _big_file_raise("Not enough memory for chunkbuf", __FILE__, __LINE__);
+            return -1;
+        }
+        CHUNK_SIZE = (chunkbytes > slack + felsize ? chunkbytes - slack : chunkbytes) / felsize;
+        dims[0] = CHUNK_SIZE;
+        dims[1] = bb->nmemb;
+        big_array_init(&chunk_array, chunkbuf, bb->dtype, 2, dims, NULL);
+    }
 
-    ptrdiff_t abs = bb->foffset[ptr->fileid] + ptr->roffset + toread;
-    RAISEIF(abs > bb->size,
-                ex_eof,
-                "Reading beyond the block `%s` at (%d:%td)",
-                bb->basename, ptr->fileid, ptr->roffset * felsize);
-    fp = _big_file_open_a_file(bb->basename, ptr->fileid, "r", 1);
-    RAISEIF(fp == NULL,
+    fd = fdcache_acquire(bb->fdcache, bb->basename, ptr->fileid, "r");
+    RAISEIF(fd < 0,
             ex_open,
             NULL);
-    RAISEIF(0 > fseek(fp, ptr->roffset * felsize, SEEK_SET),
-            ex_seek,
-            "Failed to seek in block `%s' at (%d:%td) (%s)",
-            bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
 
     while(toread > 0 && ! big_block_eof(bb, ptr)) {
-        size_t chunk_size = CHUNK_SIZE;
+        size_t chunk_size = direct ? toread : CHUNK_SIZE;
         /* remaining items in the file */
         if(chunk_size > bb->fsize[ptr->fileid] - ptr->roffset) {
             chunk_size = bb->fsize[ptr->fileid] - ptr->roffset;
@@ -852,17 +1762,27 @@ big_block_read(BigBlock * bb, BigBlockPtr * ptr, BigArray * array)
             "Insufficient number of items in file `%s' at (%d:%td)",
             bb->basename, ptr->fileid, ptr->roffset * felsize);
 
-        /* read to the beginning of chunk */
-        big_array_iter_init(&chunk_iter, &chunk_array);
-
-        RAISEIF(chunk_size != fread(chunkbuf, felsize, chunk_size, fp),
-                ex_read,
-                "Failed to read in block `%s' at (%d:%td) (%s)",
-                bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
-
-        /* now translate the data from chunkbuf to mptr */
-        RAISEIF(0 != _dtype_convert(&array_iter, &chunk_iter, chunk_size * bb->nmemb),
-            ex_convert, NULL);
+        if(direct) {
+            RAISEIF(chunk_size * felsize != _big_file_pread(fd, array_iter->dataptr, chunk_size * felsize, ptr->roffset * felsize),
+                    ex_read,
+                    "Failed to read in block `%s' at (%d:%td) (%s)",
+                    bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
+            array_iter->dataptr = (char *) array_iter->dataptr + chunk_size * felsize;
+        } else {
+            /* read to the beginning of chunk */
+            chunk_array.data = chunkbuf + _big_block_chunk_skew(bb, ptr->roffset * felsize, chunk_size * felsize, chunkbytes);
+            big_array_iter_init(&chunk_iter, &chunk_array);
+
+            /* positional read; the offset is explicit so no seek is needed */
+            RAISEIF(chunk_size * felsize != _big_block_chunk_io(bb, fd, ptr->fileid, chunk_array.data, chunk_size * felsize, ptr->roffset * felsize, 0),
+                    ex_read,
+                    "Failed to read in block `%s' at (%d:%td) (%s)",
+                    bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
+
+            /* now translate the data from chunkbuf to mptr */
+            RAISEIF(0 != _dtype_converter_apply(&conv, array_iter, &chunk_iter, chunk_size * bb->nmemb),
+                ex_convert, NULL);
+        }
 
         toread -= chunk_size;
         /* big_block_seek may change the fileid (because the physical file is full up)
@@ -871,27 +1791,104 @@ big_block_read(BigBlock * bb, BigBlockPtr * ptr, BigArray * array)
         RAISEIF(0 != big_block_seek_rel(bb, ptr, chunk_size),
                 ex_blockseek,
                 NULL);
-        if(ptr->fileid != fileid) {
-            fclose(fp);
-            fp = _big_file_open_a_file(bb->basename, ptr->fileid, "r", 1);
-            RAISEIF(fp == NULL,
+        if(ptr->fileid != fileid && toread > 0) {
+            fdcache_release(bb->fdcache, fd);
+            fd = fdcache_acquire(bb->fdcache, bb->basename, ptr->fileid, "r");
+            RAISEIF(fd < 0,
                 ex_open,
                 NULL);
         }
     }
 
-    fclose(fp);
-    free(chunkbuf);
+    fdcache_release(bb->fdcache, fd);
+    _big_file_buffer_put(chunkbuf, chunkbytes);
     return 0;
 ex_read:
-ex_seek:
 ex_insuf:
 ex_convert:
 ex_blockseek:
-    fclose(fp);
+    fdcache_release(bb->fdcache, fd);
 ex_open:
-ex_eof:
-    free(chunkbuf);
+    _big_file_buffer_put(chunkbuf, chunkbytes);
+    return -1;
+}
+
+int
+big_block_map(BigBlock * bb, BigBlockPtr * ptr, size_t size, BigArray * array)
+{
+    int64_t nmemb = bb->nmemb ? bb->nmemb : 1;
+    int64_t felsize = big_file_dtype_itemsize(bb->dtype) * nmemb;
+    size_t dims[2];
+    dims[0] = size;
+    dims[1] = bb->nmemb;
+
+    RAISEIF(ptr->fileid >= bb->Nfile && size > 0,
+        ex_span,
+        "Mapping beyond the block `%s' at (%d:%td)",
+        bb->basename, ptr->fileid, ptr->roffset * felsize);
+
+    RAISEIF(size > 0 && ptr->roffset + size > bb->fsize[ptr->fileid],
+        ex_span,
+        "Mapping across physical files of block `%s' is not supported, at (%d:%td)",
+        bb->basename, ptr->fileid, ptr->roffset * felsize);
+
+    if(size == 0) {
+        /* nothing to map; an empty view. */
+        return big_array_init(array, NULL, bb->dtype, 2, dims, NULL);
+    }
+
+    int fd = fdcache_acquire(bb->fdcache, bb->basename, ptr->fileid, "r");
+    RAISEIF(fd < 0,
+        ex_open,
+        NULL);
+
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t offset = ptr->roffset * felsize;
+    size_t head = offset % pagesize;
+    size_t bytes = size * felsize;
+
+    struct stat st;
+    /* accessing pages beyond the end of the file would raise SIGBUS. */
+    RAISEIF(0 != fstat(fd, &st) || st.st_size < offset + bytes,
+        ex_short,
+        "Physical file of block `%s' is shorter than expected at (%d:%td)",
+        bb->basename, ptr->fileid, offset + bytes);
+
+    void * base = mmap(NULL, head + bytes, PROT_READ, MAP_SHARED, fd, offset - head);
+    RAISEIF(base == MAP_FAILED,
+        ex_mmap,
+        "Failed to map block `%s' at (%d:%td) (%s)",
+        bb->basename, ptr->fileid, offset, strerror(errno));
+
+    /* the mapping stays valid after the descriptor is released */
+    fdcache_release(bb->fdcache, fd);
+
+    return big_array_init(array, (char *) base + head, bb->dtype, 2, dims, NULL);
+
+ex_mmap:
+ex_short:
+    fdcache_release(bb->fdcache, fd);
+ex_open:
+ex_span:
+    return -1;
+}
+
+int
+big_block_unmap(BigArray * array)
+{
+    if(array->data == NULL || array->size == 0) return 0;
+
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    /* mmap returns page aligned addresses, so the base is the page containing data. */
+    size_t head = ((uintptr_t) array->data) % pagesize;
+    size_t bytes = array->size * big_file_dtype_itemsize(array->dtype);
+
+    RAISEIF(0 != munmap((char *) array->data - head, head + bytes),
+        ex_munmap,
+        "Failed to unmap array (%s)", strerror(errno));
+    array->data = NULL;
+    return 0;
+ex_munmap:
     return -1;
 }
 
@@ -909,58 +1906,75 @@ _big_block_write_mode(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, const
     bb->dirty = 1;
     int64_t nmemb = bb->nmemb ? bb->nmemb : 1;
     int64_t felsize = big_file_dtype_itemsize(bb->dtype) * nmemb;
-    size_t CHUNK_SIZE = CHUNK_BYTES / felsize;
+
+    ptrdiff_t towrite = array->size / nmemb;
+
+    ptrdiff_t abs = bb->foffset[ptr->fileid] + ptr->roffset + towrite;
+    RAISEIF(abs > bb->size,
+        ex_eof,
+        "Writing beyond the block `%s` at (%d:%td)",
+        bb->basename, ptr->fileid, ptr->roffset * felsize);
+
+    return _big_block_fanout(bb, ptr, array, mode);
+ex_eof:
+    return -1;
+}
+
+static int
+_big_block_write_rows(BigBlock * bb, BigBlockPtr * ptr, BigArrayIter * array_iter, ptrdiff_t towrite, const char * mode)
+{
+    int64_t nmemb = bb->nmemb ? bb->nmemb : 1;
+    int64_t felsize = big_file_dtype_itemsize(bb->dtype) * nmemb;
+
+    /* overlap writing with conversion if there is more than a chunk */
+    if(_big_block_pipelined(bb, towrite)) {
+        return _big_block_write_pipelined(bb, ptr, array_iter, towrite, mode);
+    }
+
+    /* the conversion is resolved once for all chunks */
+    BigDtypeConverter conv;
+    if(0 != _dtype_converter_init(&conv, bb->dtype, array_iter->array->dtype)) {
+        return -1;
+    }
 
     BigArray chunk_array = {0};
     size_t dims[2];
-    dims[0] = CHUNK_SIZE;
-    dims[1] = bb->nmemb;
 
     BigArrayIter chunk_iter;
-    BigArrayIter array_iter;
 
-    char * chunkbuf = (char *) malloc(CHUNK_BYTES);
+    /* small requests get small buffers */
+    size_t chunkbytes;
+    size_t slack = _big_block_chunk_slack(bb);
+    char * chunkbuf = _big_file_buffer_get(towrite * felsize + slack, &chunkbytes);
     if(chunkbuf == NULL) {
         _big_file_raise("not enough memory for chunkbuf of size %zu bytes", __FILE__, __LINE__,  CHUNK_BYTES);
         return -1;
     }
+    size_t CHUNK_SIZE = (chunkbytes > slack + felsize ? chunkbytes - slack : chunkbytes) / felsize;
+    dims[0] = CHUNK_SIZE;
+    dims[1] = bb->nmemb;
 
     big_array_init(&chunk_array, chunkbuf, bb->dtype, 2, dims, NULL);
-    big_array_iter_init(&array_iter, array);
-
-    ptrdiff_t towrite = array->size / nmemb;
 
-    ptrdiff_t abs = bb->foffset[ptr->fileid] + ptr->roffset + towrite;
-    if(abs > bb->size) {
-        free(chunkbuf);
-        _big_file_raise("Writing beyond the block `%s` at (%d:%td)", __FILE__, __LINE__,
-        bb->basename, ptr->fileid, ptr->roffset * felsize);
-        return -1;
-    }
-    FILE * fp = _big_file_open_a_file(bb->basename, ptr->fileid, mode, 1);
-    if(fp == NULL) {
-        free(chunkbuf);
+    int fd = fdcache_acquire(bb->fdcache, bb->basename, ptr->fileid, mode);
+    if(fd < 0) {
+        _big_file_buffer_put(chunkbuf, chunkbytes);
         _big_file_raise("Could not open file '%s:%d'", __FILE__, __LINE__,  bb->basename, ptr->fileid);
         return -1;
     }
     int fileid = ptr->fileid;
 
-    RAISEIF(0 > fseek(fp, ptr->roffset * felsize, SEEK_SET),
-        ex_seek,
-        "Failed to seek in block `%s' at (%d:%td) (%s)",
-        bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
-
     while(towrite > 0 && ! big_block_eof(bb, ptr)) {
         if(ptr->fileid != fileid) {
-            fclose(fp);
+            fdcache_release(bb->fdcache, fd);
             if(strcmp(mode, "r+") != 0) {
-                free(chunkbuf);
+                _big_file_buffer_put(chunkbuf, chunkbytes);
                 _big_file_raise("Opened second file with mode w in one call, not allowed: '%d->%d'", __FILE__, __LINE__,  fileid, ptr->fileid);
                 return -1;
             }
-            fp = _big_file_open_a_file(bb->basename, ptr->fileid, mode, 1);
-            if(fp == NULL) {
-                free(chunkbuf);
+            fd = fdcache_acquire(bb->fdcache, bb->basename, ptr->fileid, mode);
+            if(fd < 0) {
+                _big_file_buffer_put(chunkbuf, chunkbytes);
                 _big_file_raise("Could not open file '%s:%d'", __FILE__, __LINE__,  bb->basename, ptr->fileid);
                 return -1;
             }
@@ -976,17 +1990,20 @@ _big_block_write_mode(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, const
             chunk_size = towrite;
         }
         /* write from the beginning of chunk */
+        chunk_array.data = chunkbuf + _big_block_chunk_skew(bb, ptr->roffset * felsize, chunk_size * felsize, chunkbytes);
         big_array_iter_init(&chunk_iter, &chunk_array);
 
         /* now translate the data to format in the file*/
-        RAISEIF(0 != _dtype_convert(&chunk_iter, &array_iter, chunk_size * bb->nmemb),
+        RAISEIF(0 != _dtype_converter_apply(&conv, &chunk_iter, array_iter, chunk_size * bb->nmemb),
             ex_convert, NULL);
 
-        RAISEIF(chunk_size != fwrite(chunkbuf, felsize, chunk_size, fp),
+        /* positional write; the offset is explicit so no seek is needed */
+        RAISEIF(chunk_size * felsize != _big_block_chunk_io(bb, fd, ptr->fileid, chunk_array.data, chunk_size * felsize, ptr->roffset * felsize, 1),
                 ex_write,
                 "Failed to write in block `%s' at (%d:%td) (%s)",
                 bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
-        sysvsum(&bb->fchecksum[ptr->fileid], chunkbuf, chunk_size * felsize);
+        big_file_sysvsum(&bb->fchecksum[ptr->fileid], chunk_array.data, chunk_size * felsize);
+        _big_block_crc_update(bb, ptr->fileid, ptr->roffset * felsize, chunk_array.data, chunk_size * felsize);
 
         towrite -= chunk_size;
         /* big_block_seek may change the fileid (because the physical file is full up)
@@ -994,122 +2011,484 @@ _big_block_write_mode(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, const
         RAISEIF(0 != big_block_seek_rel(bb, ptr, chunk_size),
                 ex_blockseek, NULL);
     }
-    fclose(fp);
-    free(chunkbuf);
+    fdcache_release(bb->fdcache, fd);
+    _big_file_buffer_put(chunkbuf, chunkbytes);
     return 0;
 ex_write:
-ex_seek:
 ex_convert:
 ex_blockseek:
-    fclose(fp);
-    free(chunkbuf);
+    fdcache_release(bb->fdcache, fd);
+    _big_file_buffer_put(chunkbuf, chunkbytes);
     return -1;
 }
 
-/**
- * dtype stuff
- * */
-
-#define MACHINE_ENDIANNESS MACHINE_ENDIAN_F()
-static char
-MACHINE_ENDIAN_F(void)
+/* rows in a chunk buffer of the pipeline; the buffer size is shared by the buffers in flight. */
+static ptrdiff_t
+_big_block_pipeline_rows(BigBlock * bb)
 {
-    uint32_t i = 0x01234567;
-    return ((*((uint8_t*)(&i))) == 0x67)?'<':'>';
+    int64_t nmemb = bb->nmemb ? bb->nmemb : 1;
+    int64_t felsize = big_file_dtype_itemsize(bb->dtype) * nmemb;
+    size_t slack = _big_block_chunk_slack(bb);
+    size_t bytes = CHUNK_BYTES / PIPELINE_DEPTH;
+    if(PIPELINE_DEPTH <= 1) return 0;
+    if(bytes > slack + felsize) bytes -= slack;
+    return bytes / felsize;
 }
 
-int
-_dtype_normalize(char * dst, const char * src)
+/* whether a request of nrows is worth pipelining: it must take more than one chunk. */
+static int
+_big_block_pipelined(BigBlock * bb, ptrdiff_t nrows)
 {
-/* normalize a dtype, so that
- * dst[0] is the endian-ness
- * dst[1] is the type kind char
- * dtype[2:] is the width
- * */
-    memset(dst, 0, 8);
-    switch(src[0]) {
-        case '<':
-        case '>':
-        case '|':
-        case '=':
-            strncpy(dst, src, 8);
-        break;
-        default:
-            dst[0] = '=';
-            strncpy(dst + 1, src, 7);
-    }
-    dst[7]='\0';
-    if(dst[0] == '=') {
-        dst[0] = MACHINE_ENDIANNESS;
-    }
-    if(dst[0] == '|') {
-        dst[0] = MACHINE_ENDIANNESS;
-    }
-    return 0;
+    ptrdiff_t rows = _big_block_pipeline_rows(bb);
+    return rows > 0 && nrows > rows;
 }
 
-/*Check that the passed dtype is valid.
- * Returns 1 if valid, 0 if invalid*/
 static int
-dtype_isvalid(const char * dtype)
+_big_block_read_pipelined(BigBlock * bb, BigBlockPtr * ptr, BigArrayIter * array_iter, ptrdiff_t toread)
 {
-    if(!dtype)
-        return 0;
-    switch(dtype[0]) {
-        case '<':
-        case '>':
-        case '|':
-        case '=':
-            break;
-        default:
-            return 0;
-    }
-    switch(dtype[1]) {
-        case 'S':
-        case 'b':
-        case 'i':
-        case 'f':
-        case 'u':
-        case 'c':
-            break;
-        default:
-            return 0;
+    int64_t nmemb = bb->nmemb ? bb->nmemb : 1;
+    int64_t felsize = big_file_dtype_itemsize(bb->dtype) * nmemb;
+    ptrdiff_t CHUNK_SIZE = _big_block_pipeline_rows(bb);
+    int depth = PIPELINE_DEPTH;
+
+    BigArray chunk_array = {0};
+    BigArrayIter chunk_iter;
+    size_t dims[2];
+
+    BigBlockPtr next = *ptr;
+    ptrdiff_t tosubmit = toread;
+    ptrdiff_t submitted = 0;
+    ptrdiff_t completed = 0;
+
+    BigDtypeConverter conv;
+    if(0 != _dtype_converter_init(&conv, array_iter->array->dtype, bb->dtype)) {
+        return -1;
     }
-    int width = atoi(&dtype[2]);
-    if(width > 16 || width <= 0)
-        return 0;
-    return 1;
-}
 
-int
-big_file_dtype_itemsize(const char * dtype)
-{
-    char ndtype[8];
-    _dtype_normalize(ndtype, dtype);
-    return atoi(&ndtype[2]);
-}
+    BigPipe * bp = bigpipe_create(bb, depth, CHUNK_SIZE * felsize + _big_block_chunk_slack(bb), 0);
+    RAISEIF(bp == NULL,
+        ex_pipe,
+        "Not enough memory for chunkbuf");
+
+    while(completed < submitted || tosubmit > 0) {
+        /* keep all buffers busy */
+        while(tosubmit > 0 && submitted < completed + depth) {
+            BigPipeSlot * slot = bigpipe_slot(bp, submitted % depth);
+            ptrdiff_t chunk_size = CHUNK_SIZE;
+            /* remaining items in the file */
+            if(chunk_size > bb->fsize[next.fileid] - next.roffset) {
+                chunk_size = bb->fsize[next.fileid] - next.roffset;
+            }
+            /* remaining items to read */
+            if(chunk_size > tosubmit) {
+                chunk_size = tosubmit;
+            }
+            RAISEIF(chunk_size == 0 || big_block_eof(bb, &next),
+                ex_insuf,
+                "Insufficient number of items in file `%s' at (%d:%td)",
+                bb->basename, next.fileid, next.roffset * felsize);
 
-int
-big_file_dtype_kind(const char * dtype)
-{
-    char ndtype[8];
-    _dtype_normalize(ndtype, dtype);
-    return ndtype[1];
-}
+            slot->fd = fdcache_acquire(bb->fdcache, bb->basename, next.fileid, "r");
+            RAISEIF(slot->fd < 0,
+                ex_open,
+                NULL);
+            slot->fileid = next.fileid;
+            slot->offset = next.roffset * felsize;
+            slot->bytes = chunk_size * felsize;
+            slot->skew = _big_block_chunk_skew(bb, slot->offset, slot->bytes, slot->capacity);
+            bigpipe_submit(bp, submitted % depth);
+            submitted ++;
+
+            tosubmit -= chunk_size;
+            RAISEIF(0 != big_block_seek_rel(bb, &next, chunk_size),
+                ex_blockseek,
+                NULL);
+        }
+        /* one batch for the refill */
+        bigpipe_flush(bp);
 
-int
-big_array_init(BigArray * array, void * buf, const char * dtype, int ndim, const size_t dims[], const ptrdiff_t strides[])
-{
+        BigPipeSlot * slot = bigpipe_wait(bp, completed % depth);
+        completed ++;
+        fdcache_release(bb->fdcache, slot->fd);
 
-    memset(array, 0, sizeof(array[0]));
+        RAISEIF(slot->result != slot->bytes,
+                ex_read,
+                "Failed to read in block `%s' at (%d:%td) (%s)",
+                bb->basename, slot->fileid, slot->offset, strerror(slot->error));
 
-    _dtype_normalize(array->dtype, dtype);
-    array->data = buf;
-    array->ndim = ndim;
-    int i;
-    memset(array->dims, 0, sizeof(ptrdiff_t) * 32);
-    memset(array->strides, 0, sizeof(ptrdiff_t) * 32);
-    array->size = 1;
+        /* now translate the data from chunkbuf to mptr, while the next chunks are read */
+        dims[0] = slot->bytes / felsize;
+        dims[1] = bb->nmemb;
+        big_array_init(&chunk_array, slot->buf + slot->skew, bb->dtype, 2, dims, NULL);
+        big_array_iter_init(&chunk_iter, &chunk_array);
+        RAISEIF(0 != _dtype_converter_apply(&conv, array_iter, &chunk_iter, dims[0] * bb->nmemb),
+            ex_convert, NULL);
+    }
+
+    bigpipe_free(bp);
+    return big_block_seek_rel(bb, ptr, toread);
+
+ex_read:
+ex_convert:
+ex_insuf:
+ex_open:
+ex_blockseek:
+    /* drain the chunks in flight */
+    while(completed < submitted) {
+        BigPipeSlot * slot = bigpipe_wait(bp, completed % depth);
+        completed ++;
+        fdcache_release(bb->fdcache, slot->fd);
+    }
+    bigpipe_free(bp);
+ex_pipe:
+    return -1;
+}
+
+static int
+_big_block_write_pipelined(BigBlock * bb, BigBlockPtr * ptr, BigArrayIter * array_iter, ptrdiff_t towrite, const char * mode)
+{
+    int64_t nmemb = bb->nmemb ? bb->nmemb : 1;
+    int64_t felsize = big_file_dtype_itemsize(bb->dtype) * nmemb;
+    ptrdiff_t CHUNK_SIZE = _big_block_pipeline_rows(bb);
+    int depth = PIPELINE_DEPTH;
+
+    BigArray chunk_array = {0};
+    BigArrayIter chunk_iter;
+    size_t dims[2];
+
+    int fileid = ptr->fileid;
+    const char * chunkmode = mode;
+    ptrdiff_t submitted = 0;
+    ptrdiff_t completed = 0;
+
+    BigDtypeConverter conv;
+    if(0 != _dtype_converter_init(&conv, bb->dtype, array_iter->array->dtype)) {
+        return -1;
+    }
+
+    BigPipe * bp = bigpipe_create(bb, depth, CHUNK_SIZE * felsize + _big_block_chunk_slack(bb), 1);
+    RAISEIF(bp == NULL,
+        ex_pipe,
+        "not enough memory for chunkbuf of size %zu bytes", CHUNK_BYTES);
+
+    while(towrite > 0 && ! big_block_eof(bb, ptr)) {
+        BigPipeSlot * slot;
+        /* recycle the oldest buffer once its write is done */
+        if(submitted == completed + depth) {
+            slot = bigpipe_wait(bp, completed % depth);
+            completed ++;
+            fdcache_release(bb->fdcache, slot->fd);
+            RAISEIF(slot->result != slot->bytes,
+                ex_write,
+                "Failed to write in block `%s' at (%d:%td) (%s)",
+                bb->basename, slot->fileid, slot->offset, strerror(slot->error));
+        }
+        if(ptr->fileid != fileid) {
+            RAISEIF(strcmp(mode, "r+") != 0,
+                ex_mode,
+                "Opened second file with mode w in one call, not allowed: '%d->%d'", fileid, ptr->fileid);
+            fileid = ptr->fileid;
+        }
+        ptrdiff_t chunk_size = CHUNK_SIZE;
+        /* remaining items in the file */
+        if(chunk_size > bb->fsize[ptr->fileid] - ptr->roffset) {
+            chunk_size = bb->fsize[ptr->fileid] - ptr->roffset;
+        }
+        /* remaining items to write */
+        if(chunk_size > towrite) {
+            chunk_size = towrite;
+        }
+
+        slot = bigpipe_slot(bp, submitted % depth);
+        /* the file is created (and truncated for 'w') by the first chunk only */
+        slot->fd = fdcache_acquire(bb->fdcache, bb->basename, ptr->fileid, chunkmode);
+        RAISEIF(slot->fd < 0,
+            ex_open,
+            "Could not open file '%s:%d'", bb->basename, ptr->fileid);
+        chunkmode = "r+";
+
+        slot->fileid = ptr->fileid;
+        slot->offset = ptr->roffset * felsize;
+        slot->bytes = chunk_size * felsize;
+        slot->skew = _big_block_chunk_skew(bb, slot->offset, slot->bytes, slot->capacity);
+
+        /* now translate the data to format in the file, while the previous chunks are written */
+        dims[0] = chunk_size;
+        dims[1] = bb->nmemb;
+        big_array_init(&chunk_array, slot->buf + slot->skew, bb->dtype, 2, dims, NULL);
+        big_array_iter_init(&chunk_iter, &chunk_array);
+        RAISEIF(0 != _dtype_converter_apply(&conv, &chunk_iter, array_iter, chunk_size * bb->nmemb),
+            ex_convert, NULL);
+        big_file_sysvsum(&bb->fchecksum[ptr->fileid], slot->buf + slot->skew, chunk_size * felsize);
+        _big_block_crc_update(bb, ptr->fileid, slot->offset, slot->buf + slot->skew, slot->bytes);
+
+        bigpipe_submit(bp, submitted % depth);
+        bigpipe_flush(bp);
+        submitted ++;
+
+        towrite -= chunk_size;
+        RAISEIF(0 != big_block_seek_rel(bb, ptr, chunk_size),
+                ex_blockseek, NULL);
+    }
+
+    int failed = 0;
+    while(completed < submitted) {
+        BigPipeSlot * slot = bigpipe_wait(bp, completed % depth);
+        completed ++;
+        fdcache_release(bb->fdcache, slot->fd);
+        if(slot->result != slot->bytes && !failed) {
+            failed = 1;
+            _big_file_raise("Failed to write in block `%s' at (%d:%td) (%s)", __FILE__, __LINE__,
+                bb->basename, slot->fileid, slot->offset, strerror(slot->error));
+        }
+    }
+    bigpipe_free(bp);
+    return failed ? -1 : 0;
+
+ex_convert:
+    fdcache_release(bb->fdcache, bigpipe_slot(bp, submitted % depth)->fd);
+ex_write:
+ex_mode:
+ex_open:
+ex_blockseek:
+    /* drain the chunks in flight */
+    while(completed < submitted) {
+        BigPipeSlot * slot = bigpipe_wait(bp, completed % depth);
+        completed ++;
+        fdcache_release(bb->fdcache, slot->fd);
+    }
+    bigpipe_free(bp);
+ex_pipe:
+    return -1;
+}
+
+static void *
+_big_block_worker(void * data);
+
+struct BigBlockWorker {
+    BigBlock * bb;
+    BigArray * array;
+    const char * mode; /* NULL for reads */
+    ptrdiff_t start; /* first row in the block */
+    ptrdiff_t offset; /* first row in the array */
+    ptrdiff_t nrows;
+    int status;
+};
+
+/*
+ * Reads or writes (mode != NULL) the rows of array starting at ptr.
+ *
+ * With more than one thread (big_file_set_num_threads) the rows are split along
+ * the boundaries of physical files. A physical file is always handled by a single
+ * worker, such that its fchecksum is only updated by one thread.
+ * */
+static int
+_big_block_fanout(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, const char * mode)
+{
+    int64_t nmemb = bb->nmemb ? bb->nmemb : 1;
+    ptrdiff_t nrows = array->size / nmemb;
+    ptrdiff_t start = bb->foffset[ptr->fileid] + ptr->roffset;
+
+    int first = ptr->fileid;
+    int last = first;
+    while(last + 1 < bb->Nfile && bb->foffset[last + 1] < start + nrows) {
+        last ++;
+    }
+    int nworkers = last - first + 1;
+    if(nworkers > NUM_THREADS) nworkers = NUM_THREADS;
+    /* only r+ may span several files in one call; leave the others to the serial path to raise. */
+    if(mode != NULL && 0 != strcmp(mode, "r+")) nworkers = 1;
+
+    if(nworkers <= 1 || nrows == 0) {
+        BigArrayIter array_iter;
+        big_array_iter_init(&array_iter, array);
+        if(mode == NULL)
+            return _big_block_read_rows(bb, ptr, &array_iter, nrows);
+        else
+            return _big_block_write_rows(bb, ptr, &array_iter, nrows, mode);
+    }
+
+    struct BigBlockWorker * workers = calloc(nworkers, sizeof(workers[0]));
+    pthread_t * threads = calloc(nworkers, sizeof(threads[0]));
+    int * started = calloc(nworkers, sizeof(started[0]));
+    RAISEIF(workers == NULL || threads == NULL || started == NULL,
+        ex_malloc,
+        "Not enough memory for %d workers", nworkers);
+
+    int i;
+    for(i = 0; i < nworkers; i ++) {
+        int f0 = first + (ptrdiff_t) (last - first + 1) * i / nworkers;
+        int f1 = first + (ptrdiff_t) (last - first + 1) * (i + 1) / nworkers;
+        ptrdiff_t a = (i == 0) ? start : (ptrdiff_t) bb->foffset[f0];
+        ptrdiff_t b = (i == nworkers - 1) ? start + nrows : (ptrdiff_t) bb->foffset[f1];
+        workers[i].bb = bb;
+        workers[i].array = array;
+        workers[i].mode = mode;
+        workers[i].start = a;
+        workers[i].offset = a - start;
+        workers[i].nrows = b - a;
+        workers[i].status = -1;
+    }
+    /* the calling thread takes the first share */
+    for(i = 1; i < nworkers; i ++) {
+        started[i] = (0 == pthread_create(&threads[i], NULL, _big_block_worker, &workers[i]));
+        if(!started[i]) {
+            _big_block_worker(&workers[i]);
+        }
+    }
+    _big_block_worker(&workers[0]);
+
+    int status = 0;
+    for(i = 0; i < nworkers; i ++) {
+        if(started[i]) pthread_join(threads[i], NULL);
+        if(workers[i].status != 0) status = -1;
+    }
+    free(started);
+    free(threads);
+    free(workers);
+
+    /* the failing worker has set the error message */
+    RAISEIF(status != 0,
+        ex_worker,
+        NULL);
+
+    return big_block_seek_rel(bb, ptr, nrows);
+
+ex_malloc:
+    free(started);
+    free(threads);
+    free(workers);
+ex_worker:
+    return -1;
+}
+
+static void *
+_big_block_worker(void * data)
+{
+    struct BigBlockWorker * worker = (struct BigBlockWorker *) data;
+    BigBlock * bb = worker->bb;
+    int64_t nmemb = bb->nmemb ? bb->nmemb : 1;
+    BigBlockPtr ptr;
+    BigArrayIter array_iter;
+
+    if(0 != big_block_seek(bb, &ptr, worker->start)) {
+        worker->status = -1;
+        return NULL;
+    }
+    big_array_iter_init(&array_iter, worker->array);
+    _big_array_iter_seek(&array_iter, worker->offset * nmemb);
+
+    if(worker->mode == NULL)
+        worker->status = _big_block_read_rows(bb, &ptr, &array_iter, worker->nrows);
+    else
+        worker->status = _big_block_write_rows(bb, &ptr, &array_iter, worker->nrows, worker->mode);
+    return NULL;
+}
+
+/**
+ * dtype stuff
+ * */
+
+#define MACHINE_ENDIANNESS MACHINE_ENDIAN_F()
+static char
+MACHINE_ENDIAN_F(void)
+{
+    uint32_t i = 0x01234567;
+    return ((*((uint8_t*)(&i))) == 0x67)?'<':'>';
+}
+
+int
+_dtype_normalize(char * dst, const char * src)
+{
+/* normalize a dtype, so that
+ * dst[0] is the endian-ness
+ * dst[1] is the type kind char
+ * dtype[2:] is the width
+ * */
+    memset(dst, 0, 8);
+    switch(src[0]) {
+        case '<':
+        case '>':
+        case '|':
+        case '=':
+            strncpy(dst, src, 8);
+        break;
+        default:
+            dst[0] = '=';
+            strncpy(dst + 1, src, 7);
+    }
+    dst[7]='\0';
+    if(dst[0] == '=') {
+        dst[0] = MACHINE_ENDIANNESS;
+    }
+    if(dst[0] == '|') {
+        dst[0] = MACHINE_ENDIANNESS;
+    }
+    return 0;
+}
+
+/*Check that the passed dtype is valid.
+ * Returns 1 if valid, 0 if invalid*/
+static int
+dtype_isvalid(const char * dtype)
+{
+    if(!dtype)
+        return 0;
+    switch(dtype[0]) {
+        case '<':
+        case '>':
+        case '|':
+        case '=':
+            break;
+        default:
+            return 0;
+    }
+    switch(dtype[1]) {
+        case 'S':
+        case 'b':
+        case 'i':
+        case 'f':
+        case 'u':
+        case 'c':
+            break;
+        default:
+            return 0;
+    }
+    int width = atoi(&dtype[2]);
+    if(width > 16 || width <= 0)
+        return 0;
+    return 1;
+}
+
+int
+big_file_dtype_itemsize(const char * dtype)
+{
+    char ndtype[8];
+    _dtype_normalize(ndtype, dtype);
+    return atoi(&ndtype[2]);
+}
+
+int
+big_file_dtype_kind(const char * dtype)
+{
+    char ndtype[8];
+    _dtype_normalize(ndtype, dtype);
+    return ndtype[1];
+}
+
+int
+big_array_init(BigArray * array, void * buf, const char * dtype, int ndim, const size_t dims[], const ptrdiff_t strides[])
+{
+
+    memset(array, 0, sizeof(array[0]));
+
+    _dtype_normalize(array->dtype, dtype);
+    array->data = buf;
+    array->ndim = ndim;
+    int i;
+    memset(array->dims, 0, sizeof(ptrdiff_t) * 32);
+    memset(array->strides, 0, sizeof(ptrdiff_t) * 32);
+    array->size = 1;
     for(i = 0; i < ndim; i ++) {
         array->dims[i] = dims[i];
         array->size *= dims[i];
@@ -1153,6 +2532,25 @@ big_array_iter_init(BigArrayIter * iter, BigArray * array)
     return 0;
 }
 
+/* position the iterator at the index-th item of the array, in C order. */
+static void
+_big_array_iter_seek(BigArrayIter * iter, ptrdiff_t index)
+{
+    BigArray * array = iter->array;
+
+    if(iter->contiguous) {
+        iter->dataptr = (char*) array->data + index * array->strides[array->ndim - 1];
+        return;
+    }
+    int k;
+    iter->dataptr = array->data;
+    for(k = array->ndim - 1; k >= 0; k --) {
+        iter->pos[k] = index % array->dims[k];
+        index /= array->dims[k];
+        iter->dataptr = ((char*) iter->dataptr) + array->strides[k] * iter->pos[k];
+    }
+}
+
 void
 big_array_iter_advance(BigArrayIter * iter)
 {
@@ -1291,172 +2689,1858 @@ dtype_convert_simple(void * dst, const char * dstdtype, const void * src, const
     return _dtype_convert(&dst_iter, &src_iter, nmemb);
 }
 
-static int cast(BigArrayIter * dst, BigArrayIter * src, size_t nmemb);
-static void byte_swap(BigArrayIter * array, size_t nmemb);
-int
-_dtype_convert(BigArrayIter * dst, BigArrayIter * src, size_t nmemb)
+/*
+ * Conversion kernels;
+ *
+ * A kernel converts n items of src to dst, with strides in bytes, assuming native byte order.
+ * The kernels are looked up once by the (kind, width) of the dtypes into a BigDtypeConverter,
+ * which is then applied to as many chunks as needed.
+ * */
+
+enum {
+    DTYPE_B1, DTYPE_I4, DTYPE_I8, DTYPE_U4, DTYPE_U8, DTYPE_F4, DTYPE_F8, DTYPE_C8, DTYPE_C16,
+    DTYPE_NCODES
+};
+
+/* the index of a normalized dtype in the kernel table, -1 if there is no kernel */
+static int
+_dtype_code(const char * dtype)
 {
-    /* cast buf2 of dtype2 into buf1 of dtype1 */
-    /* match src to machine endianness */
-    if(src->array->dtype[0] != MACHINE_ENDIANNESS) {
-        BigArrayIter iter = *src;
-        byte_swap(&iter, nmemb);
+    int width = atoi(dtype + 2);
+    switch(dtype[1]) {
+        case 'b': return width == 1 ? DTYPE_B1 : -1;
+        case 'i': return width == 4 ? DTYPE_I4 : (width == 8 ? DTYPE_I8 : -1);
+        case 'u': return width == 4 ? DTYPE_U4 : (width == 8 ? DTYPE_U8 : -1);
+        case 'f': return width == 4 ? DTYPE_F4 : (width == 8 ? DTYPE_F8 : -1);
+        case 'c': return width == 8 ? DTYPE_C8 : (width == 16 ? DTYPE_C16 : -1);
     }
+    return -1;
+}
 
-    BigArrayIter iter1 = *dst;
-    BigArrayIter iter2 = *src;
+#define CAST_KERNELS(name, t1, t2) \
+static void \
+cast_contiguous_##name(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n) \
+{ \
+    t1 * restrict p1 = (t1 *) dst; const t2 * restrict p2 = (const t2 *) src; \
+    size_t i; \
+    for(i = 0; i < n; i ++) p1[i] = p2[i]; \
+} \
+static void \
+cast_strided_##name(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n) \
+{ \
+    size_t i; \
+    for(i = 0; i < n; i ++) { \
+        * (t1 *) (dst + i * dstride) = * (const t2 *) (src + i * sstride); \
+    } \
+}
+#define CAST_KERNELS2(name, t1, t2) \
+static void \
+cast_contiguous_##name(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n) \
+{ \
+    t1 * restrict p1 = (t1 *) dst; const t2 * restrict p2 = (const t2 *) src; \
+    size_t i; \
+    for(i = 0; i < n; i ++) { p1[i].r = p2[i].r; p1[i].i = p2[i].i; } \
+} \
+static void \
+cast_strided_##name(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n) \
+{ \
+    size_t i; \
+    for(i = 0; i < n; i ++) { \
+        t1 * p1 = (t1 *) (dst + i * dstride); const t2 * p2 = (const t2 *) (src + i * sstride); \
+        p1->r = p2->r; p1->i = p2->i; \
+    } \
+}
 
-    if(0 != cast(&iter1, &iter2, nmemb)) {
-        /* cast is not supported */
-        return -1;
+typedef char b1_t;
+typedef int32_t i4_t;
+typedef int64_t i8_t;
+typedef uint32_t u4_t;
+typedef uint64_t u8_t;
+typedef float f4_t;
+typedef double f8_t;
+
+/* a kernel from each of the numeric types to t1, except t1 itself */
+#define CAST_ROW(t1, t2a, t2b, t2c, t2d, t2e, t2f) \
+    CAST_KERNELS(t1##_##t2a, t1##_t, t2a##_t) \
+    CAST_KERNELS(t1##_##t2b, t1##_t, t2b##_t) \
+    CAST_KERNELS(t1##_##t2c, t1##_t, t2c##_t) \
+    CAST_KERNELS(t1##_##t2d, t1##_t, t2d##_t) \
+    CAST_KERNELS(t1##_##t2e, t1##_t, t2e##_t) \
+    CAST_KERNELS(t1##_##t2f, t1##_t, t2f##_t)
+
+CAST_ROW(i8, i4, u4, u8, f8, f4, b1)
+CAST_ROW(u8, u4, i4, i8, f8, f4, b1)
+CAST_ROW(f8, f4, i4, i8, u4, u8, b1)
+CAST_ROW(i4, i8, u4, u8, f8, f4, b1)
+CAST_ROW(u4, u8, i4, i8, f8, f4, b1)
+CAST_ROW(f4, f8, i4, i8, u4, u8, b1)
+CAST_KERNELS2(c8_c16, cplx64_t, cplx128_t)
+CAST_KERNELS2(c16_c8, cplx128_t, cplx64_t)
+
+#define CAST_ENTRY(t1, c2, t2) \
+    [DTYPE_##c2] = { cast_contiguous_##t1##_##t2, cast_strided_##t1##_##t2 }
+
+#define CAST_TABLE_ROW(c1, t1, c2a, t2a, c2b, t2b, c2c, t2c, c2d, t2d, c2e, t2e, c2f, t2f) \
+    [DTYPE_##c1] = { \
+        CAST_ENTRY(t1, c2a, t2a), CAST_ENTRY(t1, c2b, t2b), CAST_ENTRY(t1, c2c, t2c), \
+        CAST_ENTRY(t1, c2d, t2d), CAST_ENTRY(t1, c2e, t2e), CAST_ENTRY(t1, c2f, t2f), \
     }
 
-    /* match dst to machine endianness */
-    if(dst->array->dtype[0] != MACHINE_ENDIANNESS) {
-        BigArrayIter iter = *dst;
-        byte_swap(&iter, nmemb);
-    }
-    *dst = iter1;
-    *src = iter2;
-    return 0;
+/* CAST_TABLE[dst][src]; a NULL entry is an unsupported conversion.
+ * Same types are copied, and never looked up here. */
+static const struct {
+    BigCastKernel contiguous;
+    BigCastKernel strided;
+} CAST_TABLE[DTYPE_NCODES][DTYPE_NCODES] = {
+    CAST_TABLE_ROW(I8, i8, I4, i4, U4, u4, U8, u8, F8, f8, F4, f4, B1, b1),
+    CAST_TABLE_ROW(U8, u8, U4, u4, I4, i4, I8, i8, F8, f8, F4, f4, B1, b1),
+    CAST_TABLE_ROW(F8, f8, F4, f4, I4, i4, I8, i8, U4, u4, U8, u8, B1, b1),
+    CAST_TABLE_ROW(I4, i4, I8, i8, U4, u4, U8, u8, F8, f8, F4, f4, B1, b1),
+    CAST_TABLE_ROW(U4, u4, U8, u8, I4, i4, I8, i8, F8, f8, F4, f4, B1, b1),
+    CAST_TABLE_ROW(F4, f4, F8, f8, I4, i4, I8, i8, U4, u4, U8, u8, B1, b1),
+    [DTYPE_C8] = { CAST_ENTRY(c8, C16, c16) },
+    [DTYPE_C16] = { CAST_ENTRY(c16, C8, c8) },
+};
+
+/* copy kernels of the same dtype */
+static void
+copy_contiguous(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n)
+{
+    /* the stride is the item size */
+    memcpy(dst, src, n * dstride);
+}
+
+#define COPY_KERNEL(width) \
+static void \
+copy_strided_##width(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n) \
+{ \
+    size_t i; \
+    for(i = 0; i < n; i ++) { \
+        memcpy(dst + i * dstride, src + i * sstride, width); \
+    } \
+}
+COPY_KERNEL(1)
+COPY_KERNEL(2)
+COPY_KERNEL(3)
+COPY_KERNEL(4)
+COPY_KERNEL(5)
+COPY_KERNEL(6)
+COPY_KERNEL(7)
+COPY_KERNEL(8)
+COPY_KERNEL(9)
+COPY_KERNEL(10)
+COPY_KERNEL(11)
+COPY_KERNEL(12)
+COPY_KERNEL(13)
+COPY_KERNEL(14)
+COPY_KERNEL(15)
+COPY_KERNEL(16)
+
+/* indexed by the width */
+static const BigCastKernel COPY_KERNELS[17] = {
+    NULL, copy_strided_1, copy_strided_2, copy_strided_3, copy_strided_4,
+    copy_strided_5, copy_strided_6, copy_strided_7, copy_strided_8,
+    copy_strided_9, copy_strided_10, copy_strided_11, copy_strided_12,
+    copy_strided_13, copy_strided_14, copy_strided_15, copy_strided_16,
+};
+
+/* swap kernels; reverse the bytes of n contiguous items from src to dst, which may be the same */
+#define SWAP_KERNEL(width, type, bswap) \
+static void \
+swap_##width(char * dst, const char * src, size_t n) \
+{ \
+    size_t i; \
+    for(i = 0; i < n; i ++) { \
+        type v; \
+        memcpy(&v, src + i * width, width); \
+        v = bswap(v); \
+        memcpy(dst + i * width, &v, width); \
+    } \
 }
+SWAP_KERNEL(2, uint16_t, __builtin_bswap16)
+SWAP_KERNEL(4, uint32_t, __builtin_bswap32)
+SWAP_KERNEL(8, uint64_t, __builtin_bswap64)
 
+static void
+swap_16(char * dst, const char * src, size_t n)
+{
+    /* the full width is reversed, like any other width */
+    size_t i;
+    for(i = 0; i < n; i ++) {
+        uint64_t v[2];
+        memcpy(v, src + i * 16, 16);
+        uint64_t t = __builtin_bswap64(v[0]);
+        v[0] = __builtin_bswap64(v[1]);
+        v[1] = t;
+        memcpy(dst + i * 16, v, 16);
+    }
+}
 
 static void
-byte_swap(BigArrayIter * iter, size_t nmemb)
+swap_generic(char * dst, const char * src, size_t n, int elsize)
 {
-    /* swap a buffer in-place */
-    int elsize = big_file_dtype_itemsize(iter->array->dtype);
-    if(elsize == 1) return;
-    /* need byte swap; do it now on buf2 */
-    /* XXX: this may still be wrong. */
-    ptrdiff_t i;
+    size_t i;
     int half = elsize >> 1;
-    for(i = 0; i < nmemb; i ++) {
+    for(i = 0; i < n; i ++) {
         int j;
-        char * ptr = (char *) iter->dataptr;
+        const char * p = src + i * elsize;
+        char * q = dst + i * elsize;
         for(j = 0; j < half; j ++) {
-            char tmp = ptr[j];
-            ptr[j] = ptr[elsize - j - 1];
-            ptr[elsize - j - 1] = tmp;
+            char tmp = p[j];
+            q[j] = p[elsize - j - 1];
+            q[elsize - j - 1] = tmp;
         }
-        big_array_iter_advance(iter);
+        if(elsize & 1) q[half] = p[half];
+    }
+}
+
+#define SWAP_KERNEL_GENERIC(width) \
+static void \
+swap_##width(char * dst, const char * src, size_t n) \
+{ \
+    swap_generic(dst, src, n, width); \
+}
+SWAP_KERNEL_GENERIC(3)
+SWAP_KERNEL_GENERIC(5)
+SWAP_KERNEL_GENERIC(6)
+SWAP_KERNEL_GENERIC(7)
+SWAP_KERNEL_GENERIC(9)
+SWAP_KERNEL_GENERIC(10)
+SWAP_KERNEL_GENERIC(11)
+SWAP_KERNEL_GENERIC(12)
+SWAP_KERNEL_GENERIC(13)
+SWAP_KERNEL_GENERIC(14)
+SWAP_KERNEL_GENERIC(15)
+
+/*
+ * SIMD kernels for the swaps and the common casts;
+ *
+ * On x86 the kernels are compiled for SSSE3 and AVX2 with target attributes and picked at run time,
+ * such that the library still runs on any x86 cpu. NEON is always available on aarch64.
+ * The remainder of a run that does not fill a vector goes through the scalar kernel.
+ * */
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define BIGFILE_SIMD_X86
+#include <immintrin.h>
+
+#define SIMD_SWAP_MASK2 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+#define SIMD_SWAP_MASK4 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+#define SIMD_SWAP_MASK8 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+#define SIMD_SWAP_MASK16 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
+
+#define SIMD_SWAP_KERNELS(width) \
+__attribute__((target("ssse3"))) \
+static void \
+swap_ssse3_##width(char * dst, const char * src, size_t n) \
+{ \
+    const __m128i mask = _mm_setr_epi8(SIMD_SWAP_MASK##width); \
+    size_t i = 0; \
+    size_t bytes = n * width; \
+    for(; i + 16 <= bytes; i += 16) { \
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i)); \
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_shuffle_epi8(v, mask)); \
+    } \
+    swap_##width(dst + i, src + i, (bytes - i) / width); \
+} \
+__attribute__((target("avx2"))) \
+static void \
+swap_avx2_##width(char * dst, const char * src, size_t n) \
+{ \
+    const __m256i mask = _mm256_setr_epi8(SIMD_SWAP_MASK##width, SIMD_SWAP_MASK##width); \
+    size_t i = 0; \
+    size_t bytes = n * width; \
+    for(; i + 32 <= bytes; i += 32) { \
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + i)); \
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_shuffle_epi8(v, mask)); \
+    } \
+    swap_##width(dst + i, src + i, (bytes - i) / width); \
+}
+SIMD_SWAP_KERNELS(2)
+SIMD_SWAP_KERNELS(4)
+SIMD_SWAP_KERNELS(8)
+SIMD_SWAP_KERNELS(16)
+
+__attribute__((target("avx2")))
+static void
+cast_avx2_f4_f8(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n)
+{
+    float * p1 = (float *) dst; const double * p2 = (const double *) src;
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(p1 + i, _mm256_cvtpd_ps(_mm256_loadu_pd(p2 + i)));
+    }
+    for(; i < n; i ++) p1[i] = p2[i];
+}
+
+__attribute__((target("avx2")))
+static void
+cast_avx2_f8_f4(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n)
+{
+    double * p1 = (double *) dst; const float * p2 = (const float *) src;
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(p1 + i, _mm256_cvtps_pd(_mm_loadu_ps(p2 + i)));
+    }
+    for(; i < n; i ++) p1[i] = p2[i];
+}
+
+__attribute__((target("avx2")))
+static void
+cast_avx2_i8_i4(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n)
+{
+    int64_t * p1 = (int64_t *) dst; const int32_t * p2 = (const int32_t *) src;
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p2 + i));
+        _mm256_storeu_si256((__m256i *) (p1 + i), _mm256_cvtepi32_epi64(v));
+    }
+    for(; i < n; i ++) p1[i] = p2[i];
+}
+
+__attribute__((target("avx2")))
+static void
+cast_avx2_i4_i8(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n)
+{
+    /* keeps the low 32 bits, as the scalar cast does */
+    int32_t * p1 = (int32_t *) dst; const int64_t * p2 = (const int64_t *) src;
+    const __m256i low = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (p2 + i));
+        v = _mm256_permutevar8x32_epi32(v, low);
+        _mm_storeu_si128((__m128i *) (p1 + i), _mm256_castsi256_si128(v));
+    }
+    for(; i < n; i ++) p1[i] = p2[i];
+}
+
+static int
+_dtype_simd_level(void)
+{
+    /* 2 : avx2, 1 : ssse3, 0 : none */
+    static int level = -1;
+    if(level < 0) {
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2")) level = 2;
+        else if(__builtin_cpu_supports("ssse3")) level = 1;
+        else level = 0;
+    }
+    return level;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define BIGFILE_SIMD_NEON
+#include <arm_neon.h>
+
+#define NEON_SWAP_KERNEL(width, rev) \
+static void \
+swap_neon_##width(char * dst, const char * src, size_t n) \
+{ \
+    size_t i = 0; \
+    size_t bytes = n * width; \
+    for(; i + 16 <= bytes; i += 16) { \
+        uint8x16_t v = vld1q_u8((const uint8_t *) (src + i)); \
+        vst1q_u8((uint8_t *) (dst + i), rev); \
+    } \
+    swap_##width(dst + i, src + i, (bytes - i) / width); \
+}
+NEON_SWAP_KERNEL(2, vrev16q_u8(v))
+NEON_SWAP_KERNEL(4, vrev32q_u8(v))
+NEON_SWAP_KERNEL(8, vrev64q_u8(v))
+NEON_SWAP_KERNEL(16, vextq_u8(vrev64q_u8(v), vrev64q_u8(v), 8))
+
+static void
+cast_neon_f4_f8(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n)
+{
+    float * p1 = (float *) dst; const double * p2 = (const double *) src;
+    size_t i = 0;
+    for(; i + 2 <= n; i += 2) {
+        vst1_f32(p1 + i, vcvt_f32_f64(vld1q_f64(p2 + i)));
+    }
+    for(; i < n; i ++) p1[i] = p2[i];
+}
+
+static void
+cast_neon_f8_f4(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n)
+{
+    double * p1 = (double *) dst; const float * p2 = (const float *) src;
+    size_t i = 0;
+    for(; i + 2 <= n; i += 2) {
+        vst1q_f64(p1 + i, vcvt_f64_f32(vld1_f32(p2 + i)));
+    }
+    for(; i < n; i ++) p1[i] = p2[i];
+}
+
+static void
+cast_neon_i8_i4(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n)
+{
+    int64_t * p1 = (int64_t *) dst; const int32_t * p2 = (const int32_t *) src;
+    size_t i = 0;
+    for(; i + 2 <= n; i += 2) {
+        vst1q_s64(p1 + i, vmovl_s32(vld1_s32(p2 + i)));
+    }
+    for(; i < n; i ++) p1[i] = p2[i];
+}
+
+static void
+cast_neon_i4_i8(char * dst, ptrdiff_t dstride, const char * src, ptrdiff_t sstride, size_t n)
+{
+    int32_t * p1 = (int32_t *) dst; const int64_t * p2 = (const int64_t *) src;
+    size_t i = 0;
+    for(; i + 2 <= n; i += 2) {
+        vst1_s32(p1 + i, vmovn_s64(vld1q_s64(p2 + i)));
+    }
+    for(; i < n; i ++) p1[i] = p2[i];
+}
+#endif
+
+/* the contiguous swap kernel of a width, the fastest the cpu supports */
+static BigSwapKernel
+_dtype_swap_kernel(int width)
+{
+    static const BigSwapKernel kernels[17] = {
+        NULL, NULL, swap_2, swap_3, swap_4,
+        swap_5, swap_6, swap_7, swap_8,
+        swap_9, swap_10, swap_11, swap_12,
+        swap_13, swap_14, swap_15, swap_16,
+    };
+#if defined(BIGFILE_SIMD_X86)
+    int level = _dtype_simd_level();
+    switch(width) {
+        case 2: return level == 2 ? swap_avx2_2 : (level == 1 ? swap_ssse3_2 : swap_2);
+        case 4: return level == 2 ? swap_avx2_4 : (level == 1 ? swap_ssse3_4 : swap_4);
+        case 8: return level == 2 ? swap_avx2_8 : (level == 1 ? swap_ssse3_8 : swap_8);
+        case 16: return level == 2 ? swap_avx2_16 : (level == 1 ? swap_ssse3_16 : swap_16);
+    }
+#elif defined(BIGFILE_SIMD_NEON)
+    switch(width) {
+        case 2: return swap_neon_2;
+        case 4: return swap_neon_4;
+        case 8: return swap_neon_8;
+        case 16: return swap_neon_16;
+    }
+#endif
+    return kernels[width];
+}
+
+/* a SIMD kernel of a contiguous cast, NULL if there is none */
+static BigCastKernel
+_dtype_simd_cast_kernel(int c1, int c2)
+{
+#if defined(BIGFILE_SIMD_X86)
+    if(_dtype_simd_level() < 2) return NULL;
+    if(c1 == DTYPE_F4 && c2 == DTYPE_F8) return cast_avx2_f4_f8;
+    if(c1 == DTYPE_F8 && c2 == DTYPE_F4) return cast_avx2_f8_f4;
+    if(c1 == DTYPE_I8 && c2 == DTYPE_I4) return cast_avx2_i8_i4;
+    if(c1 == DTYPE_I4 && c2 == DTYPE_I8) return cast_avx2_i4_i8;
+#elif defined(BIGFILE_SIMD_NEON)
+    if(c1 == DTYPE_F4 && c2 == DTYPE_F8) return cast_neon_f4_f8;
+    if(c1 == DTYPE_F8 && c2 == DTYPE_F4) return cast_neon_f8_f4;
+    if(c1 == DTYPE_I8 && c2 == DTYPE_I4) return cast_neon_i8_i4;
+    if(c1 == DTYPE_I4 && c2 == DTYPE_I8) return cast_neon_i4_i8;
+#endif
+    return NULL;
+}
+
+int
+_dtype_converter_init(BigDtypeConverter * conv, const char * dstdtype, const char * srcdtype)
+{
+    char dst[8], src[8];
+    _dtype_normalize(dst, dstdtype);
+    _dtype_normalize(src, srcdtype);
+
+    memset(conv, 0, sizeof(conv[0]));
+    conv->dstsize = atoi(dst + 2);
+    conv->srcsize = atoi(src + 2);
+    RAISEIF(conv->dstsize <= 0 || conv->srcsize <= 0,
+        ex_unsupported,
+        "Unsupported conversion from %s to %s. ", src, dst);
+
+    if(0 == strcmp(dst + 1, src + 1) && conv->dstsize > 16) {
+        /* only strings are wider than a number; copied one item at a time, never swapped */
+        conv->contiguous = copy_contiguous;
+        return 0;
+    }
+    RAISEIF(conv->dstsize > 16 || conv->srcsize > 16,
+        ex_unsupported,
+        "Unsupported conversion from %s to %s. ", src, dst);
+
+    /* match src to machine endianness before the cast, and dst back after the cast. */
+    if(src[0] != MACHINE_ENDIANNESS) {
+        conv->swap_src = _dtype_swap_kernel(conv->srcsize);
+    }
+    if(dst[0] != MACHINE_ENDIANNESS) {
+        conv->swap_dst = _dtype_swap_kernel(conv->dstsize);
+    }
+
+    /* same type, no need for casting. */
+    if(0 == strcmp(dst + 1, src + 1)) {
+        conv->contiguous = copy_contiguous;
+        conv->strided = COPY_KERNELS[conv->dstsize];
+        if(src[0] == dst[0]) {
+            /* the same byte order; a plain copy */
+            conv->swap_src = conv->swap_dst = NULL;
+        } else {
+            /* a swap is a copy */
+            conv->swap = conv->swap_src ? conv->swap_src : conv->swap_dst;
+        }
+        return 0;
+    }
+    int c1 = _dtype_code(dst);
+    int c2 = _dtype_code(src);
+    RAISEIF(c1 < 0 || c2 < 0 || CAST_TABLE[c1][c2].contiguous == NULL,
+        ex_unsupported,
+        "Unsupported conversion from %s to %s. ", src, dst);
+    conv->contiguous = CAST_TABLE[c1][c2].contiguous;
+    conv->strided = CAST_TABLE[c1][c2].strided;
+    if((c1 == DTYPE_I8 && c2 == DTYPE_U8) || (c1 == DTYPE_U8 && c2 == DTYPE_I8)
+    || (c1 == DTYPE_I4 && c2 == DTYPE_U4) || (c1 == DTYPE_U4 && c2 == DTYPE_I4)) {
+        /* the same bits */
+        conv->contiguous = copy_contiguous;
+    }
+    if(_dtype_simd_cast_kernel(c1, c2)) {
+        conv->contiguous = _dtype_simd_cast_kernel(c1, c2);
+    }
+    return 0;
+
+ex_unsupported:
+    return -1;
+}
+
+/* moves an iterator by n items, as n calls to big_array_iter_advance;
+ * a non-contiguous iterator must not cross its last dimension. */
+static void
+_dtype_iter_skip(BigArrayIter * iter, size_t n)
+{
+    BigArray * array = iter->array;
+    int k = array->ndim - 1;
+    if(iter->contiguous) {
+        iter->dataptr = (char*) iter->dataptr + n * array->strides[k];
+        return;
+    }
+    iter->pos[k] += n - 1;
+    iter->dataptr = ((char*) iter->dataptr) + array->strides[k] * (n - 1);
+    big_array_iter_advance(iter);
+}
+
+/* the index of the current item of an iterator, in C order */
+static ptrdiff_t
+_big_array_iter_index(const BigArrayIter * iter)
+{
+    BigArray * array = iter->array;
+    if(iter->contiguous) {
+        return ((char*) iter->dataptr - (char*) array->data) / array->strides[array->ndim - 1];
+    }
+    ptrdiff_t index = 0;
+    int k;
+    for(k = 0; k < array->ndim; k ++) {
+        index = index * array->dims[k] + iter->pos[k];
+    }
+    return index;
+}
+
+/* An array seen as rows of ncol items with a constant stride;
+ * the casts run along a row without touching the 32 dimensions of an iterator. */
+typedef struct BigArrayRows {
+    char * ptr; /* the current item */
+    ptrdiff_t colstride;
+    ptrdiff_t rowstride;
+    size_t ncol;
+    size_t col; /* column of the current item */
+} BigArrayRows;
+
+/* flattens the array of an iterator at the index-th item into rows,
+ * merging dimensions of length 1 and dimensions that are contiguous to each other.
+ * returns 0 if the array does not flatten to two dimensions. */
+static int
+_big_array_rows_init(BigArrayRows * rows, const BigArrayIter * iter, ptrdiff_t index)
+{
+    BigArray * array = iter->array;
+    size_t dims[2] = {1, 1};
+    ptrdiff_t strides[2] = {array->strides[array->ndim - 1], 0};
+    int n = 0;
+    int k;
+    for(k = array->ndim - 1; k >= 0; k --) {
+        if(array->dims[k] == 0) return 0;
+        if(array->dims[k] == 1) continue;
+        if(n > 0 && array->strides[k] == strides[n - 1] * (ptrdiff_t) dims[n - 1]) {
+            dims[n - 1] *= array->dims[k];
+            continue;
+        }
+        if(n == 2) return 0;
+        dims[n] = array->dims[k];
+        strides[n] = array->strides[k];
+        n ++;
+    }
+    rows->ptr = (char *) iter->dataptr;
+    rows->colstride = strides[0];
+    rows->ncol = dims[0];
+    rows->rowstride = (n == 2) ? strides[1] : strides[0] * (ptrdiff_t) dims[0];
+    rows->col = index % dims[0];
+    return 1;
+}
+
+/* a contiguous buffer of n items as a single row */
+static void
+_big_array_rows_buffer(BigArrayRows * rows, char * buf, size_t n, int elsize)
+{
+    rows->ptr = buf;
+    rows->colstride = elsize;
+    rows->ncol = n;
+    rows->rowstride = elsize * n;
+    rows->col = 0;
+}
+
+/* moves by n items, not crossing the end of the row */
+static void
+_big_array_rows_skip(BigArrayRows * rows, size_t n)
+{
+    rows->ptr += n * rows->colstride;
+    rows->col += n;
+    if(rows->col == rows->ncol) {
+        rows->ptr += rows->rowstride - (ptrdiff_t) rows->ncol * rows->colstride;
+        rows->col = 0;
+    }
+}
+
+/* runs a cast kernel over nmemb items, one stretch of constant strides at a time */
+static void
+_dtype_cast_rows(BigCastKernel contiguous, BigCastKernel strided, int dstsize, int srcsize,
+        BigArrayRows * dst, BigArrayRows * src, size_t nmemb)
+{
+    BigCastKernel kernel = strided;
+    if(dst->colstride == dstsize && src->colstride == srcsize) {
+        kernel = contiguous;
+    }
+    while(nmemb > 0) {
+        size_t n = nmemb;
+        if(dst->ncol - dst->col < n) n = dst->ncol - dst->col;
+        if(src->ncol - src->col < n) n = src->ncol - src->col;
+        kernel(dst->ptr, dst->colstride, src->ptr, src->colstride, n);
+        _big_array_rows_skip(dst, n);
+        _big_array_rows_skip(src, n);
+        nmemb -= n;
+    }
+}
+
+/* casts nmemb items between two iterators by rows, then moves the iterators;
+ * returns 0 if either array does not flatten to rows. */
+static int
+_dtype_cast_iter(BigCastKernel contiguous, BigCastKernel strided, int dstsize, int srcsize,
+        BigArrayIter * dst, BigArrayIter * src, size_t nmemb)
+{
+    BigArrayRows drows, srows;
+    ptrdiff_t dindex = _big_array_iter_index(dst);
+    ptrdiff_t sindex = _big_array_iter_index(src);
+    if(!_big_array_rows_init(&drows, dst, dindex)
+    || !_big_array_rows_init(&srows, src, sindex)) {
+        return 0;
+    }
+    _dtype_cast_rows(contiguous, strided, dstsize, srcsize, &drows, &srows, nmemb);
+    _big_array_iter_seek(dst, dindex + nmemb);
+    _big_array_iter_seek(src, sindex + nmemb);
+    return 1;
+}
+
+/* copies n items from an iterator to a contiguous buffer, moving the iterator */
+static void
+_dtype_gather(char * buf, BigArrayIter * iter, size_t n, int elsize, BigCastKernel copy)
+{
+    BigArrayRows rows, brows;
+    ptrdiff_t index = _big_array_iter_index(iter);
+    if(_big_array_rows_init(&rows, iter, index)) {
+        _big_array_rows_buffer(&brows, buf, n, elsize);
+        _dtype_cast_rows(copy_contiguous, copy, elsize, elsize, &brows, &rows, n);
+        _big_array_iter_seek(iter, index + n);
+        return;
+    }
+    size_t i;
+    for(i = 0; i < n; i ++) {
+        memcpy(buf + i * elsize, iter->dataptr, elsize);
+        big_array_iter_advance(iter);
+    }
+}
+
+/* copies n items from a contiguous buffer to an iterator, moving the iterator */
+static void
+_dtype_scatter(BigArrayIter * iter, const char * buf, size_t n, int elsize, BigCastKernel copy)
+{
+    BigArrayRows rows, brows;
+    ptrdiff_t index = _big_array_iter_index(iter);
+    if(_big_array_rows_init(&rows, iter, index)) {
+        _big_array_rows_buffer(&brows, (char *) buf, n, elsize);
+        _dtype_cast_rows(copy_contiguous, copy, elsize, elsize, &rows, &brows, n);
+        _big_array_iter_seek(iter, index + n);
+        return;
+    }
+    size_t i;
+    for(i = 0; i < n; i ++) {
+        memcpy(iter->dataptr, buf + i * elsize, elsize);
+        big_array_iter_advance(iter);
+    }
+}
+
+/* items per block of a fused swap and cast; the blocks stay in the L1 cache. */
+#define CONVERT_BLOCK 256
+
+/* swaps, casts and swaps a block at a time, such that the data is only read once from memory;
+ * src is left untouched. */
+static void
+_dtype_convert_fused(const BigDtypeConverter * conv, BigArrayIter * dst, BigArrayIter * src, size_t nmemb)
+{
+    /* 16 is the widest item */
+    char srcbuf[CONVERT_BLOCK * 16] __attribute__((aligned(64)));
+    char dstbuf[CONVERT_BLOCK * 16] __attribute__((aligned(64)));
+    BigCastKernel srccopy = COPY_KERNELS[conv->srcsize];
+    BigCastKernel dstcopy = COPY_KERNELS[conv->dstsize];
+
+    while(nmemb > 0) {
+        size_t n = nmemb < CONVERT_BLOCK ? nmemb : CONVERT_BLOCK;
+        const char * s;
+        char * d;
+        if(src->contiguous) {
+            s = (const char *) src->dataptr;
+            _dtype_iter_skip(src, n);
+        } else {
+            _dtype_gather(srcbuf, src, n, conv->srcsize, srccopy);
+            s = srcbuf;
+        }
+        if(conv->swap_src) {
+            conv->swap_src(srcbuf, s, n);
+            s = srcbuf;
+        }
+        d = dst->contiguous ? (char *) dst->dataptr : dstbuf;
+
+        conv->contiguous(d, conv->dstsize, s, conv->srcsize, n);
+
+        if(conv->swap_dst) {
+            conv->swap_dst(d, d, n);
+        }
+        if(dst->contiguous) {
+            _dtype_iter_skip(dst, n);
+        } else {
+            _dtype_scatter(dst, dstbuf, n, conv->dstsize, dstcopy);
+        }
+        nmemb -= n;
+    }
+}
+
+int
+_dtype_converter_apply(const BigDtypeConverter * conv, BigArrayIter * dst, BigArrayIter * src, size_t nmemb)
+{
+    /* cast buf2 of dtype2 into buf1 of dtype1 */
+    if(nmemb == 0) return 0;
+
+    if(conv->swap && dst->contiguous && src->contiguous) {
+        /* same type in the opposite byte order */
+        conv->swap((char *) dst->dataptr, (const char *) src->dataptr, nmemb);
+        _dtype_iter_skip(dst, nmemb);
+        _dtype_iter_skip(src, nmemb);
+        return 0;
+    }
+    if(conv->swap_src || conv->swap_dst) {
+        _dtype_convert_fused(conv, dst, src, nmemb);
+        return 0;
+    }
+
+    if(dst->contiguous && src->contiguous) {
+        conv->contiguous((char *) dst->dataptr, conv->dstsize, (const char *) src->dataptr, conv->srcsize, nmemb);
+        _dtype_iter_skip(dst, nmemb);
+        _dtype_iter_skip(src, nmemb);
+    } else
+    if(conv->strided == NULL) {
+        /* items wider than the copy kernels */
+        size_t i;
+        for(i = 0; i < nmemb; i ++) {
+            memcpy(dst->dataptr, src->dataptr, conv->dstsize);
+            big_array_iter_advance(dst);
+            big_array_iter_advance(src);
+        }
+    } else
+    if(!_dtype_cast_iter(conv->contiguous, conv->strided, conv->dstsize, conv->srcsize, dst, src, nmemb)) {
+        /* more than two strided dimensions, one item at a time */
+        size_t i;
+        for(i = 0; i < nmemb; i ++) {
+            conv->strided((char *) dst->dataptr, 0, (const char *) src->dataptr, 0, 1);
+            big_array_iter_advance(dst);
+            big_array_iter_advance(src);
+        }
+    }
+    return 0;
+}
+
+int
+_dtype_convert(BigArrayIter * dst, BigArrayIter * src, size_t nmemb)
+{
+    BigDtypeConverter conv;
+    if(0 != _dtype_converter_init(&conv, dst->array->dtype, src->array->dtype)) {
+        /* cast is not supported */
+        return -1;
+    }
+    return _dtype_converter_apply(&conv, dst, src, nmemb);
+}
+
+/*
+ * The SysV checksum (sum -s) of the physical files;
+ *
+ * The running sum is the byte sum modulo 2**32. The vector kernels add the bytes
+ * with sum of absolute differences into 64 bit lanes, which give the same sum.
+ * */
+static unsigned int
+sysvsum_scalar(unsigned int thisrun, const unsigned char * cp, size_t size)
+{
+    while(size --)
+        thisrun += *(cp++);
+    return thisrun;
+}
+
+#if defined(BIGFILE_SIMD_X86)
+__attribute__((target("sse2")))
+static unsigned int
+sysvsum_sse2(unsigned int thisrun, const unsigned char * cp, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = _mm_setzero_si128();
+    __m128i acc1 = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i + 32 <= size; i += 32) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *) (cp + i));
+        __m128i v1 = _mm_loadu_si128((const __m128i *) (cp + i + 16));
+        acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(v0, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(v1, zero));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, _mm_add_epi64(acc0, acc1));
+    thisrun += (unsigned int) (lanes[0] + lanes[1]);
+    return sysvsum_scalar(thisrun, cp + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned int
+sysvsum_avx2(unsigned int thisrun, const unsigned char * cp, size_t size)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    size_t i = 0;
+    for(; i + 64 <= size; i += 64) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *) (cp + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *) (cp + i + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(v0, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(v1, zero));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(acc0, acc1));
+    thisrun += (unsigned int) (lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+    return sysvsum_scalar(thisrun, cp + i, size - i);
+}
+#elif defined(BIGFILE_SIMD_NEON)
+static unsigned int
+sysvsum_neon(unsigned int thisrun, const unsigned char * cp, size_t size)
+{
+    uint64x2_t acc = vdupq_n_u64(0);
+    size_t i = 0;
+    while(i + 16 <= size) {
+        /* 16 bit lanes hold at most 128 pairwise sums of bytes */
+        uint16x8_t acc16 = vdupq_n_u16(0);
+        int j;
+        for(j = 0; j < 128 && i + 16 <= size; j ++, i += 16) {
+            acc16 = vpadalq_u8(acc16, vld1q_u8(cp + i));
+        }
+        acc = vpadalq_u32(acc, vpaddlq_u16(acc16));
+    }
+    thisrun += (unsigned int) (vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1));
+    return sysvsum_scalar(thisrun, cp + i, size - i);
+}
+#endif
+
+void
+big_file_sysvsum(unsigned int * sum, const void * buf, size_t size)
+{
+    const unsigned char * cp = (const unsigned char *) buf;
+#if defined(BIGFILE_SIMD_X86)
+    if(_dtype_simd_level() == 2) {
+        *sum = sysvsum_avx2(*sum, cp, size);
+    } else {
+        *sum = sysvsum_sse2(*sum, cp, size);
+    }
+#elif defined(BIGFILE_SIMD_NEON)
+    *sum = sysvsum_neon(*sum, cp, size);
+#else
+    *sum = sysvsum_scalar(*sum, cp, size);
+#endif
+}
+
+unsigned int
+big_file_sysvsum_fold(unsigned int sum)
+{
+    unsigned int r = (sum & 0xffff) + ((sum & 0xffffffff) >> 16);
+    return (r & 0xffff) + (r >> 16);
+}
+
+/*
+ * CRC32C (Castagnoli) chunk checksums;
+ *
+ * The CRC is linear over GF(2): the CRC of a chunk is the XOR of the CRCs of its pieces,
+ * each extended by the zeros after the piece, which is a multiplication by x**(8n).
+ * The running CRC of a chunk starts from 0, with no pre or post inversion; an unwritten
+ * chunk of zeros has a running CRC of 0. The checksum file stores the standard CRC32C.
+ * */
+#define CRC32C_POLY 0x82f63b78u
+
+static unsigned int CRC32C_TABLE[8][256];
+static unsigned int CRC32C_X2N[32]; /* x**(2**n) modulo the polynomial */
+static pthread_once_t CRC32C_ONCE = PTHREAD_ONCE_INIT;
+
+/* a * b modulo the polynomial, bit reflected */
+static unsigned int
+crc32c_multmodp(unsigned int a, unsigned int b)
+{
+    unsigned int m = 1u << 31;
+    unsigned int p = 0;
+    for(;;) {
+        if(a & m) {
+            p ^= b;
+            if((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+static void
+crc32c_init(void)
+{
+    int i, k;
+    for(i = 0; i < 256; i ++) {
+        unsigned int c = i;
+        for(k = 0; k < 8; k ++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        CRC32C_TABLE[0][i] = c;
+    }
+    for(i = 0; i < 256; i ++) {
+        for(k = 1; k < 8; k ++) {
+            unsigned int c = CRC32C_TABLE[k - 1][i];
+            CRC32C_TABLE[k][i] = (c >> 8) ^ CRC32C_TABLE[0][c & 0xff];
+        }
+    }
+    /* x**1 */
+    CRC32C_X2N[0] = 1u << 30;
+    for(i = 1; i < 32; i ++) {
+        CRC32C_X2N[i] = crc32c_multmodp(CRC32C_X2N[i - 1], CRC32C_X2N[i - 1]);
+    }
+}
+
+/* the running CRC after n zero bytes */
+static unsigned int
+crc32c_shift(unsigned int crc, size_t n)
+{
+    unsigned int p = 1u << 31; /* x**0 */
+    int k = 3;
+    while(n) {
+        if(n & 1) p = crc32c_multmodp(CRC32C_X2N[k & 31], p);
+        n >>= 1;
+        k ++;
+    }
+    return crc32c_multmodp(p, crc);
+}
+
+/* slicing by 8 */
+static unsigned int
+crc32c_raw_table(unsigned int crc, const unsigned char * p, size_t size)
+{
+    while(size >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        v ^= crc;
+        crc = CRC32C_TABLE[7][v & 0xff] ^ CRC32C_TABLE[6][(v >> 8) & 0xff]
+            ^ CRC32C_TABLE[5][(v >> 16) & 0xff] ^ CRC32C_TABLE[4][(v >> 24) & 0xff]
+            ^ CRC32C_TABLE[3][(v >> 32) & 0xff] ^ CRC32C_TABLE[2][(v >> 40) & 0xff]
+            ^ CRC32C_TABLE[1][(v >> 48) & 0xff] ^ CRC32C_TABLE[0][v >> 56];
+        p += 8;
+        size -= 8;
+    }
+    while(size --) {
+        crc = (crc >> 8) ^ CRC32C_TABLE[0][(crc ^ *(p++)) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(BIGFILE_SIMD_X86)
+__attribute__((target("sse4.2")))
+static unsigned int
+crc32c_raw_sse42(unsigned int crc, const unsigned char * p, size_t size)
+{
+    uint64_t c = crc;
+    while(size >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        size -= 8;
+    }
+    crc = c;
+    while(size --) {
+        crc = _mm_crc32_u8(crc, *(p++));
+    }
+    return crc;
+}
+#endif
+
+/* the running CRC, without inversions */
+static unsigned int
+crc32c_raw(unsigned int crc, const void * buf, size_t size)
+{
+    pthread_once(&CRC32C_ONCE, crc32c_init);
+#if defined(BIGFILE_SIMD_X86)
+    static int sse42 = -1;
+    if(sse42 < 0) {
+        __builtin_cpu_init();
+        sse42 = __builtin_cpu_supports("sse4.2");
+    }
+    if(sse42) {
+        return crc32c_raw_sse42(crc, (const unsigned char *) buf, size);
+    }
+#endif
+    return crc32c_raw_table(crc, (const unsigned char *) buf, size);
+}
+
+unsigned int
+big_file_crc32c(unsigned int crc, const void * buf, size_t size)
+{
+    return ~crc32c_raw(~crc, buf, size);
+}
+
+/* the bytes of a chunk checksum; the last chunk of a file may be short */
+static size_t
+_big_block_crc_bytes(BigBlock * bb, int fileid, size_t chunk)
+{
+    size_t filebytes = bb->fsize[fileid] * dtype_itemsize(bb->dtype) * bb->nmemb;
+    size_t bytes = filebytes - chunk * bb->crcsize;
+    return bytes < bb->crcsize ? bytes : bb->crcsize;
+}
+
+/* the running CRC of a chunk to and from the standard CRC32C */
+static unsigned int
+_big_block_crc_finish(BigBlock * bb, int fileid, size_t chunk, unsigned int running)
+{
+    return ~(crc32c_shift(0xffffffffu, _big_block_crc_bytes(bb, fileid, chunk)) ^ running);
+}
+
+static unsigned int
+_big_block_crc_start(BigBlock * bb, int fileid, size_t chunk, unsigned int crc32c)
+{
+    return crc32c_shift(0xffffffffu, _big_block_crc_bytes(bb, fileid, chunk)) ^ ~crc32c;
+}
+
+/* lays out the chunk checksums of the files, keeping those of the first oldNfile files. */
+static int
+_big_block_crc_alloc(BigBlock * bb, int oldNfile)
+{
+    if(bb->crcsize == 0) return 0;
+
+    size_t felsize = dtype_itemsize(bb->dtype) * bb->nmemb;
+    size_t * fcrcoffset = (size_t *) calloc(bb->Nfile + 1, sizeof(size_t));
+    RAISEIF(!fcrcoffset, ex_offset, "No memory");
+    int i;
+    fcrcoffset[0] = 0;
+    for(i = 0; i < bb->Nfile; i ++) {
+        fcrcoffset[i + 1] = fcrcoffset[i] + (bb->fsize[i] * felsize + bb->crcsize - 1) / bb->crcsize;
+    }
+    unsigned int * fcrc = (unsigned int *) calloc(fcrcoffset[bb->Nfile] + 1, sizeof(unsigned int));
+    RAISEIF(!fcrc, ex_crc, "No memory");
+    if(bb->fcrc) {
+        memcpy(fcrc, bb->fcrc, bb->fcrcoffset[oldNfile] * sizeof(unsigned int));
+    }
+    free(bb->fcrc);
+    free(bb->fcrcoffset);
+    bb->fcrc = fcrc;
+    bb->fcrcoffset = fcrcoffset;
+    return 0;
+
+ex_crc:
+    free(fcrcoffset);
+ex_offset:
+    return -1;
+}
+
+/* adds bytes written at offset of a physical file to its chunk checksums */
+static void
+_big_block_crc_update(BigBlock * bb, int fileid, size_t offset, const char * buf, size_t bytes)
+{
+    if(bb->crcsize == 0) return;
+
+    unsigned int * fcrc = bb->fcrc + bb->fcrcoffset[fileid];
+    while(bytes > 0) {
+        size_t chunk = offset / bb->crcsize;
+        size_t start = offset - chunk * bb->crcsize;
+        size_t len = bb->crcsize - start;
+        if(len > bytes) len = bytes;
+        size_t tail = _big_block_crc_bytes(bb, fileid, chunk) - start - len;
+
+        fcrc[chunk] ^= crc32c_shift(crc32c_raw(0, buf, len), tail);
+
+        offset += len;
+        buf += len;
+        bytes -= len;
+    }
+}
+
+void
+_big_block_add_checksums(BigBlock * bb, int fileid, size_t offset, const char * buf, size_t bytes)
+{
+    bb->dirty = 1;
+    big_file_sysvsum(&bb->fchecksum[fileid], buf, bytes);
+    _big_block_crc_update(bb, fileid, offset, buf, bytes);
+}
+
+int
+big_block_get_chunk_checksum(BigBlock * bb, int fileid, ptrdiff_t chunk, unsigned int * crc32c, size_t * bytes)
+{
+    RAISEIF(bb->crcsize == 0,
+        ex_none,
+        "Block `%s' has no chunk checksums", bb->basename);
+    RAISEIF(fileid < 0 || fileid >= bb->Nfile || chunk < 0
+         || chunk >= (ptrdiff_t) (bb->fcrcoffset[fileid + 1] - bb->fcrcoffset[fileid]),
+        ex_range,
+        "Chunk %td of file %d is out of range in block `%s'", chunk, fileid, bb->basename);
+
+    pthread_once(&CRC32C_ONCE, crc32c_init);
+    *crc32c = _big_block_crc_finish(bb, fileid, chunk, bb->fcrc[bb->fcrcoffset[fileid] + chunk]);
+    *bytes = _big_block_crc_bytes(bb, fileid, chunk);
+    return 0;
+
+ex_range:
+ex_none:
+    return -1;
+}
+
+/* reads the checksum file, if there is one */
+static int
+_big_block_read_checksums(BigBlock * bb)
+{
+    FILE * fcrc = _big_file_open_a_file(bb->basename, FILEID_CHECKSUM, "r", 0);
+    if(fcrc == NULL) {
+        bb->crcsize = 0;
+        return 0;
+    }
+    pthread_once(&CRC32C_ONCE, crc32c_init);
+
+    RAISEIF(1 != fscanf(fcrc, " CRC32C: %zu", &bb->crcsize) || bb->crcsize == 0,
+        ex_fscanf,
+        "Failed to read the chunk checksums of block `%s'", bb->basename);
+
+    RAISEIF(0 != _big_block_crc_alloc(bb, 0),
+        ex_alloc, NULL);
+
+    int fid;
+    ptrdiff_t chunk;
+    unsigned int crc;
+    while(3 == fscanf(fcrc, " " EXT_DATA " : %td : %x", &fid, &chunk, &crc)) {
+        RAISEIF(fid < 0 || fid >= bb->Nfile || chunk < 0
+             || chunk >= (ptrdiff_t) (bb->fcrcoffset[fid + 1] - bb->fcrcoffset[fid]),
+            ex_range,
+            "Non-existent chunk referenced: `%s' (%d : %td)", bb->basename, fid, chunk);
+        bb->fcrc[bb->fcrcoffset[fid] + chunk] = _big_block_crc_start(bb, fid, chunk, crc);
+    }
+    fclose(fcrc);
+    return 0;
+
+ex_range:
+    free(bb->fcrc);
+    free(bb->fcrcoffset);
+    bb->fcrc = NULL;
+    bb->fcrcoffset = NULL;
+ex_alloc:
+ex_fscanf:
+    bb->crcsize = 0;
+    fclose(fcrc);
+    return -1;
+}
+
+/* writes the checksum file, one line per chunk */
+static int
+_big_block_write_checksums(BigBlock * bb)
+{
+    if(bb->crcsize == 0) return 0;
+
+    pthread_once(&CRC32C_ONCE, crc32c_init);
+
+    FILE * fcrc = _big_file_open_a_file(bb->basename, FILEID_CHECKSUM, "w+", 1);
+    RAISEIF(fcrc == NULL, ex_fileio, NULL);
+    RAISEIF(0 > fprintf(fcrc, "CRC32C: %zu\n", bb->crcsize),
+        ex_fprintf,
+        "Writing the chunk checksums");
+    int i;
+    for(i = 0; i < bb->Nfile; i ++) {
+        size_t chunk;
+        for(chunk = 0; chunk < bb->fcrcoffset[i + 1] - bb->fcrcoffset[i]; chunk ++) {
+            unsigned int crc = _big_block_crc_finish(bb, i, chunk, bb->fcrc[bb->fcrcoffset[i] + chunk]);
+            RAISEIF(0 > fprintf(fcrc, EXT_DATA " : %zu : %08x\n", i, chunk, crc),
+                ex_fprintf,
+                "Writing the chunk checksums");
+        }
+    }
+    fclose(fcrc);
+    return 0;
+
+ex_fprintf:
+    fclose(fcrc);
+ex_fileio:
+    return -1;
+}
+
+/* The binary header: a fixed part, then fsize[Nfile] and fchecksum[Nfile],
+ * in the byte order of the writer. */
+#define BINARY_HEADER_MAGIC "BIGHDR3\n"
+#define BINARY_HEADER_BYTEORDER 0x01020304u
+
+struct BinaryHeader {
+    char magic[8];
+    uint32_t byteorder;
+    int32_t nmemb;
+    int32_t Nfile;
+    char dtype[8];
+    /* the text header this was made with */
+    uint64_t textsize;
+    int64_t textmtime;
+    int64_t textmtime_nsec;
+    /* a rewrite in the same second and of the same size only changes the bytes */
+    uint32_t textcrc;
+    uint32_t reserved;
+};
+
+static size_t
+_binary_header_bytes(int Nfile)
+{
+    return sizeof(struct BinaryHeader) + (size_t) Nfile * (sizeof(uint64_t) + sizeof(uint32_t));
+}
+
+/* the CRC32C of the size bytes of the text header on fd; -1 if they cannot be read. */
+static int
+_big_block_text_header_crc(int fd, size_t size, uint32_t * crc)
+{
+    char * buf = malloc(size + 1);
+    if(!buf) return -1;
+    ptrdiff_t got = _big_file_pread(fd, buf, size, 0);
+    *crc = big_file_crc32c(0, buf, size);
+    free(buf);
+    return got == (ptrdiff_t) size ? 0 : -1;
+}
+
+/* returns 1 if fsize and fchecksum are loaded from the binary header,
+ * 0 if there is none or it is stale, and -1 on a bad binary header. */
+static int
+_big_block_read_binary_header(BigBlock * bb, FILE * fheader)
+{
+    struct stat text;
+    if(0 != fstat(fileno(fheader), &text)) return 0;
+
+    FILE * fbin = _big_file_open_a_file(bb->basename, FILEID_HEADER_V2, "r", 0);
+    if(fbin == NULL) return 0;
+
+    size_t bytes = _binary_header_bytes(bb->Nfile);
+    char * buf = malloc(bytes + 1);
+    RAISEIF(!buf, ex_malloc, "No memory");
+
+    /* one more byte to tell a longer file */
+    size_t got = fread(buf, 1, bytes + 1, fbin);
+
+    struct BinaryHeader h;
+    if(got >= sizeof(h)) memcpy(&h, buf, sizeof(h));
+
+    if(got < sizeof(h)
+    || 0 != memcmp(h.magic, BINARY_HEADER_MAGIC, 8)
+    || h.byteorder != BINARY_HEADER_BYTEORDER
+    || h.textsize != (uint64_t) text.st_size
+    || h.textmtime != (int64_t) text.st_mtim.tv_sec
+    || h.textmtime_nsec != (int64_t) text.st_mtim.tv_nsec) {
+        /* written on another machine, or the text header has changed since */
+        free(buf);
+        fclose(fbin);
+        return 0;
+    }
+    uint32_t textcrc;
+    if(0 != _big_block_text_header_crc(fileno(fheader), text.st_size, &textcrc)
+    || h.textcrc != textcrc) {
+        free(buf);
+        fclose(fbin);
+        return 0;
+    }
+
+    RAISEIF(got != bytes
+        || h.Nfile != bb->Nfile
+        || h.nmemb != bb->nmemb
+        || 0 != strncmp(h.dtype, bb->dtype, 8),
+        ex_mismatch,
+        "Binary header does not match the header of block `%s'", bb->basename);
+
+    const char * p = buf + sizeof(h);
+    int i;
+    for(i = 0; i < bb->Nfile; i ++) {
+        uint64_t size;
+        memcpy(&size, p, sizeof(size));
+        bb->fsize[i] = size;
+        p += sizeof(size);
+    }
+    memcpy(bb->fchecksum, p, bb->Nfile * sizeof(uint32_t));
+
+    free(buf);
+    fclose(fbin);
+    return 1;
+
+ex_mismatch:
+    free(buf);
+ex_malloc:
+    fclose(fbin);
+    return -1;
+}
+
+/* writes the binary header after the text header, or removes an old one. */
+static int
+_big_block_write_binary_header(BigBlock * bb)
+{
+    int unbuffered;
+    if(!BINARY_HEADER) {
+        char * filename = _big_file_path_of(bb->basename, FILEID_HEADER_V2, &unbuffered);
+        /* the text header has changed; do not leave a stale copy around. */
+        unlink(filename);
+        free(filename);
+        return 0;
+    }
+    char * textname = _big_file_path_of(bb->basename, FILEID_HEADER, &unbuffered);
+    struct stat text;
+    uint32_t textcrc = 0;
+    int fd = open(textname, O_RDONLY);
+    free(textname);
+    int rt = fd < 0 || 0 != fstat(fd, &text)
+          || 0 != _big_block_text_header_crc(fd, text.st_size, &textcrc);
+    if(fd >= 0) close(fd);
+    RAISEIF(0 != rt,
+        ex_stat,
+        "Failed to read the header of block `%s' (%s)", bb->basename, strerror(errno));
+
+    size_t bytes = _binary_header_bytes(bb->Nfile);
+    char * buf = calloc(bytes, 1);
+    RAISEIF(!buf, ex_malloc, "No memory");
+
+    struct BinaryHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BINARY_HEADER_MAGIC, 8);
+    h.byteorder = BINARY_HEADER_BYTEORDER;
+    h.nmemb = bb->nmemb;
+    h.Nfile = bb->Nfile;
+    strncpy(h.dtype, bb->dtype, 8);
+    h.textsize = text.st_size;
+    h.textmtime = text.st_mtim.tv_sec;
+    h.textmtime_nsec = text.st_mtim.tv_nsec;
+    h.textcrc = textcrc;
+    memcpy(buf, &h, sizeof(h));
+
+    char * p = buf + sizeof(h);
+    int i;
+    for(i = 0; i < bb->Nfile; i ++) {
+        uint64_t size = bb->fsize[i];
+        memcpy(p, &size, sizeof(size));
+        p += sizeof(size);
+    }
+    memcpy(p, bb->fchecksum, bb->Nfile * sizeof(uint32_t));
+
+    FILE * fbin = _big_file_open_a_file(bb->basename, FILEID_HEADER_V2, "w", 1);
+    RAISEIF(fbin == NULL,
+        ex_open,
+        NULL);
+    RAISEIF(bytes != fwrite(buf, 1, bytes, fbin),
+        ex_fwrite,
+        "Writing binary header of block `%s' (%s)", bb->basename, strerror(errno));
+    RAISEIF(0 != fclose(fbin),
+        ex_open,
+        "Writing binary header of block `%s' (%s)", bb->basename, strerror(errno));
+    free(buf);
+    return 0;
+
+ex_fwrite:
+    fclose(fbin);
+ex_open:
+    free(buf);
+ex_malloc:
+ex_stat:
+    return -1;
+}
+
+/*
+ * Internal API for BigPipe objects;
+ *
+ * The caller fills in a slot and submits it; the helper thread performs the IO
+ * of the submitted slots in the order of the ring, and the caller waits
+ * for a slot before reusing its buffer. With io_uring, submitted slots are only
+ * prepared, and started together by bigpipe_flush or the next wait.
+ * */
+#define BIGPIPE_IDLE 0
+#define BIGPIPE_QUEUED 1
+#define BIGPIPE_DONE 2
+
+struct BigPipe {
+    BigBlock * bb;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int depth;
+    int writing;
+    int quit;
+    BigPipeSlot * slots;
+#ifdef BIGFILE_USE_IO_URING
+    /* if the ring is set up, IO is submitted to the kernel instead of the helper thread */
+    struct io_uring ring;
+    int uring;
+    int pending; /* prepared but not yet submitted */
+#endif
+};
+
+#ifdef BIGFILE_USE_IO_URING
+/* prepares the (remaining) IO of a slot; bigpipe_flush submits all prepared slots
+ * with one call, such that a refill of the free slots is one batch. Retries of short
+ * transfers are submitted by the next wait, with all completions reaped so far. */
+static void
+bigpipe_uring_prep(BigPipe * bp, BigPipeSlot * slot)
+{
+    struct io_uring_sqe * sqe = io_uring_get_sqe(&bp->ring);
+    if(sqe == NULL) {
+        /* submission queue is full */
+        io_uring_submit(&bp->ring);
+        bp->pending = 0;
+        sqe = io_uring_get_sqe(&bp->ring);
+    }
+    if(bp->writing) {
+        io_uring_prep_write(sqe, slot->fd, slot->buf + slot->skew + slot->result, slot->bytes - slot->result, slot->offset + slot->result);
+    } else {
+        io_uring_prep_read(sqe, slot->fd, slot->buf + slot->skew + slot->result, slot->bytes - slot->result, slot->offset + slot->result);
+    }
+    io_uring_sqe_set_data(sqe, slot);
+    bp->pending ++;
+}
+
+/* reaps completions until slot is done. */
+static void
+bigpipe_uring_wait(BigPipe * bp, BigPipeSlot * slot)
+{
+    while(slot->state == BIGPIPE_QUEUED) {
+        bigpipe_flush(bp);
+        struct io_uring_cqe * cqe;
+        int ret = io_uring_wait_cqe(&bp->ring, &cqe);
+        if(ret == -EINTR) continue;
+        if(ret < 0) {
+            /* the ring is broken; fail whatever is in flight */
+            int i;
+            for(i = 0; i < bp->depth; i ++) {
+                if(bp->slots[i].state != BIGPIPE_QUEUED) continue;
+                bp->slots[i].error = -ret;
+                bp->slots[i].state = BIGPIPE_DONE;
+            }
+            break;
+        }
+        BigPipeSlot * done = (BigPipeSlot *) io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&bp->ring, cqe);
+
+        if(res == -EINTR || res == -EAGAIN) {
+            bigpipe_uring_prep(bp, done);
+        } else if(res < 0) {
+            done->error = -res;
+            done->state = BIGPIPE_DONE;
+        } else if(res == 0) {
+            /* end of file: a short read */
+            done->state = BIGPIPE_DONE;
+        } else {
+            done->result += res;
+            if(done->result < done->bytes) {
+                /* short transfer, continue with the rest */
+                bigpipe_uring_prep(bp, done);
+            } else {
+                done->state = BIGPIPE_DONE;
+            }
+        }
+    }
+}
+#endif
+
+static void *
+bigpipe_main(void * data)
+{
+    BigPipe * bp = (BigPipe *) data;
+    int head = 0;
+    pthread_mutex_lock(&bp->lock);
+    while(1) {
+        BigPipeSlot * slot = &bp->slots[head];
+        if(slot->state != BIGPIPE_QUEUED) {
+            if(bp->quit) break;
+            pthread_cond_wait(&bp->cond, &bp->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&bp->lock);
+
+        errno = 0;
+        ptrdiff_t result = _big_block_chunk_io(bp->bb, slot->fd, slot->fileid,
+                    slot->buf + slot->skew, slot->bytes, slot->offset, bp->writing);
+        int error = errno;
+
+        pthread_mutex_lock(&bp->lock);
+        slot->result = result;
+        slot->error = error;
+        slot->state = BIGPIPE_DONE;
+        head = (head + 1) % bp->depth;
+        pthread_cond_broadcast(&bp->cond);
+    }
+    pthread_mutex_unlock(&bp->lock);
+    return NULL;
+}
+
+static BigPipe *
+bigpipe_create(BigBlock * bb, int depth, size_t bytes, int writing)
+{
+    int i;
+    BigPipe * bp = calloc(1, sizeof(BigPipe));
+    if(bp == NULL) return NULL;
+    bp->slots = calloc(depth, sizeof(BigPipeSlot));
+    if(bp->slots == NULL) goto ex_slots;
+    bp->bb = bb;
+    bp->depth = depth;
+    bp->writing = writing;
+    for(i = 0; i < depth; i ++) {
+        bp->slots[i].buf = _big_file_buffer_get(bytes, &bp->slots[i].capacity);
+        if(bp->slots[i].buf == NULL) goto ex_buf;
+    }
+#ifdef BIGFILE_USE_IO_URING
+    /* fall back to the helper thread if the kernel does not support io_uring;
+     * direct IO also uses the helper thread, for the unaligned head and tail. */
+    if(!bb->directio && 0 == io_uring_queue_init(depth, &bp->ring, 0)) {
+        bp->uring = 1;
+        return bp;
+    }
+#endif
+    pthread_mutex_init(&bp->lock, NULL);
+    pthread_cond_init(&bp->cond, NULL);
+    if(0 != pthread_create(&bp->thread, NULL, bigpipe_main, bp)) goto ex_thread;
+    return bp;
+
+ex_thread:
+    pthread_cond_destroy(&bp->cond);
+    pthread_mutex_destroy(&bp->lock);
+ex_buf:
+    for(i = 0; i < depth; i ++) {
+        _big_file_buffer_put(bp->slots[i].buf, bp->slots[i].capacity);
+    }
+    free(bp->slots);
+ex_slots:
+    free(bp);
+    return NULL;
+}
+
+/* the helper thread exits after the queued slots are done. */
+static void
+bigpipe_free(BigPipe * bp)
+{
+    int i;
+#ifdef BIGFILE_USE_IO_URING
+    if(bp->uring) {
+        io_uring_queue_exit(&bp->ring);
+    } else
+#endif
+    {
+        pthread_mutex_lock(&bp->lock);
+        bp->quit = 1;
+        pthread_cond_broadcast(&bp->cond);
+        pthread_mutex_unlock(&bp->lock);
+        pthread_join(bp->thread, NULL);
+
+        pthread_cond_destroy(&bp->cond);
+        pthread_mutex_destroy(&bp->lock);
+    }
+    for(i = 0; i < bp->depth; i ++) {
+        _big_file_buffer_put(bp->slots[i].buf, bp->slots[i].capacity);
+    }
+    free(bp->slots);
+    free(bp);
+}
+
+static BigPipeSlot *
+bigpipe_slot(BigPipe * bp, int i)
+{
+    return &bp->slots[i];
+}
+
+static void
+bigpipe_submit(BigPipe * bp, int i)
+{
+#ifdef BIGFILE_USE_IO_URING
+    if(bp->uring) {
+        bp->slots[i].state = BIGPIPE_QUEUED;
+        bp->slots[i].result = 0;
+        bp->slots[i].error = 0;
+        bigpipe_uring_prep(bp, &bp->slots[i]);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&bp->lock);
+    bp->slots[i].state = BIGPIPE_QUEUED;
+    pthread_cond_broadcast(&bp->cond);
+    pthread_mutex_unlock(&bp->lock);
+}
+
+/* starts the IO of the submitted slots; the helper thread starts them at submission. */
+static void
+bigpipe_flush(BigPipe * bp)
+{
+#ifdef BIGFILE_USE_IO_URING
+    if(bp->uring && bp->pending > 0) {
+        io_uring_submit(&bp->ring);
+        bp->pending = 0;
+    }
+#endif
+}
+
+static BigPipeSlot *
+bigpipe_wait(BigPipe * bp, int i)
+{
+#ifdef BIGFILE_USE_IO_URING
+    if(bp->uring) {
+        bigpipe_uring_wait(bp, &bp->slots[i]);
+        bp->slots[i].state = BIGPIPE_IDLE;
+        return &bp->slots[i];
+    }
+#endif
+    pthread_mutex_lock(&bp->lock);
+    while(bp->slots[i].state == BIGPIPE_QUEUED) {
+        pthread_cond_wait(&bp->cond, &bp->lock);
+    }
+    bp->slots[i].state = BIGPIPE_IDLE;
+    pthread_mutex_unlock(&bp->lock);
+    return &bp->slots[i];
+}
+
+/*
+ * Internal API for chunk buffers;
+ *
+ * Returns a buffer of at least min(bytes, CHUNK_BYTES) bytes; the actual size is in capacity.
+ * A pooled buffer is reused if one is large enough, otherwise a buffer just big enough
+ * is allocated, such that a small request never faults in a full CHUNK_BYTES buffer.
+ * */
+static char *
+_big_file_buffer_get(size_t bytes, size_t * capacity)
+{
+    if(bytes > CHUNK_BYTES) bytes = CHUNK_BYTES;
+    if(bytes == 0) bytes = 1;
+
+    int i;
+    int best = -1;
+    pthread_mutex_lock(&BUFFER_POOL_LOCK);
+    for(i = 0; i < BUFFER_POOL_SIZE; i ++) {
+        if(BUFFER_POOL[i].buf == NULL || BUFFER_POOL[i].size < bytes) continue;
+        if(best < 0 || BUFFER_POOL[i].size < BUFFER_POOL[best].size) best = i;
+    }
+    if(best >= 0) {
+        char * buf = BUFFER_POOL[best].buf;
+        *capacity = BUFFER_POOL[best].size;
+        BUFFER_POOL[best].buf = NULL;
+        BUFFER_POOL[best].size = 0;
+        pthread_mutex_unlock(&BUFFER_POOL_LOCK);
+        return buf;
+    }
+    pthread_mutex_unlock(&BUFFER_POOL_LOCK);
+
+    /* round up to whole pages, which helps reuse. */
+    size_t size = (bytes + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+    if(size > CHUNK_BYTES) size = bytes;
+    void * buf = NULL;
+    if(0 != posix_memalign(&buf, BUFFER_ALIGNMENT, size)) {
+        return NULL;
+    }
+    *capacity = size;
+    return (char *) buf;
+}
+
+static void
+_big_file_buffer_put(char * buf, size_t capacity)
+{
+    if(buf == NULL) return;
+    int i;
+    int worst = -1;
+    pthread_mutex_lock(&BUFFER_POOL_LOCK);
+    /* buffers from before a big_file_set_buffer_size are dropped */
+    if(capacity <= CHUNK_BYTES) {
+        for(i = 0; i < BUFFER_POOL_SIZE; i ++) {
+            if(BUFFER_POOL[i].buf == NULL) {
+                worst = i;
+                break;
+            }
+            /* evict the smallest pooled buffer, if it is smaller than this one */
+            if(BUFFER_POOL[i].size < capacity &&
+              (worst < 0 || BUFFER_POOL[i].size < BUFFER_POOL[worst].size)) {
+                worst = i;
+            }
+        }
+    }
+    if(worst >= 0) {
+        char * old = BUFFER_POOL[worst].buf;
+        BUFFER_POOL[worst].buf = buf;
+        BUFFER_POOL[worst].size = capacity;
+        buf = old;
+    }
+    pthread_mutex_unlock(&BUFFER_POOL_LOCK);
+    free(buf);
+}
+
+static void
+_big_file_buffer_drain(void)
+{
+    int i;
+    pthread_mutex_lock(&BUFFER_POOL_LOCK);
+    for(i = 0; i < BUFFER_POOL_SIZE; i ++) {
+        free(BUFFER_POOL[i].buf);
+        BUFFER_POOL[i].buf = NULL;
+        BUFFER_POOL[i].size = 0;
+    }
+    pthread_mutex_unlock(&BUFFER_POOL_LOCK);
+}
+
+/*
+ * Internal API for FDCache objects;
+ *
+ * A small LRU of open descriptors of the physical files of a block.
+ * Positional IO does not move a file position, so a descriptor
+ * can be shared by several threads at once; an entry is only evicted
+ * when no one is using it.
+ * */
+
+static BigFDCache *
+fdcache_create(void)
+{
+    if(FDCACHE_SIZE <= 0) return NULL;
+    BigFDCache * fdcache = (BigFDCache *) calloc(1, sizeof(BigFDCache));
+    if(!fdcache) return NULL;
+    fdcache->size = FDCACHE_SIZE;
+    fdcache->entries = calloc(fdcache->size, sizeof(fdcache->entries[0]));
+    if(!fdcache->entries) {
+        free(fdcache);
+        return NULL;
     }
+    pthread_mutex_init(&fdcache->lock, NULL);
+    return fdcache;
 }
 
-#define CAST(d1, t1, d2, t2) \
-if((0 == strcmp(d1, dst->array->dtype + 1)) && (0 == strcmp(d2, src->array->dtype + 1))) { \
-    for(i = 0; i < nmemb; i ++) { \
-        t1 * p1 = (t1 *) dst->dataptr; t2 * p2 = (t2 *) src->dataptr; \
-        * p1 = * p2; \
-        big_array_iter_advance(dst); big_array_iter_advance(src); \
-    } \
-    return 0; \
-}
-#define CAST2(d1, t1, d2, t2) \
-if((0 == strcmp(d1, dst->array->dtype + 1)) && (0 == strcmp(d2, src->array->dtype + 1))) { \
-    for(i = 0; i < nmemb; i ++) { \
-        t1 * p1 = (t1 *) dst->dataptr; t2 * p2 = (t2 *) src->dataptr; \
-        p1->r = p2->r; p1->i = p2->i; \
-        big_array_iter_advance(dst); big_array_iter_advance(src); \
-    } \
-    return 0; \
+static void
+fdcache_free(BigFDCache * fdcache)
+{
+    if(!fdcache) return;
+    int i;
+    for(i = 0; i < fdcache->used; i ++) {
+        close(fdcache->entries[i].fd);
+    }
+    pthread_mutex_destroy(&fdcache->lock);
+    free(fdcache->entries);
+    free(fdcache);
 }
+
+/* returns a descriptor of fileid that is good for mode, or -1 on failure.
+ * mode 'w' always truncates the file, and never reuses a cached descriptor.
+ * mode with 'd' opens with O_DIRECT; its failure does not raise, the caller falls back to buffered IO. */
 static int
-cast(BigArrayIter * dst, BigArrayIter * src, size_t nmemb)
+fdcache_acquire(BigFDCache * fdcache, const char * basename, int fileid, const char * mode)
 {
-    /* doing cast assuming native byte order */
-    /* convert buf2 to buf1, both are native;
-     * dtype has no endian-ness prefix
-     *   */
-    ptrdiff_t i;
-    /* same type, no need for casting. */
-    if (0 == strcmp(dst->array->dtype + 1, src->array->dtype + 1)) {
-        if(dst->contiguous && src->contiguous) {
-            /* directly copy of memory chunks; FIXME: use memmove? */
-            memcpy(dst->dataptr, src->dataptr, nmemb * dst->array->strides[dst->array->ndim-1]);
-            dst->dataptr = (char*) dst->dataptr + nmemb * dst->array->strides[dst->array->ndim - 1];
-            src->dataptr = (char*) src->dataptr + nmemb * src->array->strides[src->array->ndim - 1];
-            return 0;
-        } else {
-            /* copy one by one, discontinuous */
-            size_t elsize = big_file_dtype_itemsize(dst->array->dtype);
-            for(i = 0; i < nmemb; i ++) {
-                void * p1 = dst->dataptr;
-                void * p2 = src->dataptr;
-                memcpy(p1, p2, elsize);
-                big_array_iter_advance(dst); big_array_iter_advance(src);
+    int writable = mode[0] != 'r' || strchr(mode, '+') != NULL;
+    int direct = strchr(mode, 'd') != NULL;
+    int i;
+    if(!fdcache) {
+        return _big_file_open_a_fd(basename, fileid, mode, !direct);
+    }
+
+    pthread_mutex_lock(&fdcache->lock);
+    if(mode[0] == 'r') {
+        for(i = 0; i < fdcache->used; i ++) {
+            if(fdcache->entries[i].fileid != fileid) continue;
+            if(fdcache->entries[i].direct != direct) continue;
+            if(writable && !fdcache->entries[i].writable) continue;
+            fdcache->entries[i].refcount ++;
+            fdcache->entries[i].stamp = ++fdcache->clock;
+            pthread_mutex_unlock(&fdcache->lock);
+            return fdcache->entries[i].fd;
+        }
+    }
+    pthread_mutex_unlock(&fdcache->lock);
+
+    /* open outside of the lock; it is the slow part on a parallel file system.
+     * Writers open for read-write such that the descriptor can also serve reads. */
+    const char * omode = mode;
+    if(writable) {
+        if(mode[0] == 'w')
+            omode = direct ? "w+d" : "w+";
+        else
+            omode = direct ? "r+d" : "r+";
+    }
+    int fd = _big_file_open_a_fd(basename, fileid, omode, !direct);
+    if(fd < 0) return -1;
+
+    pthread_mutex_lock(&fdcache->lock);
+    /* pick a slot: an idle entry of the same file, a free slot, or the least recently used idle entry. */
+    int slot = -1;
+    for(i = 0; i < fdcache->used; i ++) {
+        if(fdcache->entries[i].fileid == fileid && fdcache->entries[i].direct == direct
+        && fdcache->entries[i].refcount == 0) {
+            slot = i;
+            break;
+        }
+    }
+    if(slot < 0 && fdcache->used < fdcache->size) {
+        slot = fdcache->used ++;
+        fdcache->entries[slot].fd = -1;
+    }
+    if(slot < 0) {
+        for(i = 0; i < fdcache->used; i ++) {
+            if(fdcache->entries[i].refcount != 0) continue;
+            if(slot < 0 || fdcache->entries[i].stamp < fdcache->entries[slot].stamp) {
+                slot = i;
             }
-            return 0;
         }
     }
-    if(0 == strcmp(dst->array->dtype + 1, "i8")) {
-        CAST("i8", int64_t, "i4", int32_t);
-        CAST("i8", int64_t, "u4", uint32_t);
-        CAST("i8", int64_t, "u8", uint64_t);
-        CAST("i8", int64_t, "f8", double);
-        CAST("i8", int64_t, "f4", float);
-        CAST("i8", int64_t, "b1", char);
-    } else
-    if(0 == strcmp(dst->array->dtype + 1, "u8")) {
-        CAST("u8", uint64_t, "u4", uint32_t);
-        CAST("u8", uint64_t, "i4", int32_t);
-        CAST("u8", uint64_t, "i8", int64_t);
-        CAST("u8", uint64_t, "f8", double);
-        CAST("u8", uint64_t, "f4", float);
-        CAST("u8", uint64_t, "b1", char);
-    } else
-    if(0 == strcmp(dst->array->dtype + 1, "f8")) {
-        CAST("f8", double, "f4", float);
-        CAST("f8", double, "i4", int32_t);
-        CAST("f8", double, "i8", int64_t);
-        CAST("f8", double, "u4", uint32_t);
-        CAST("f8", double, "u8", uint64_t);
-        CAST("f8", double, "b1", char);
-    } else
-    if(0 == strcmp(dst->array->dtype + 1, "i4")) {
-        CAST("i4", int32_t, "i8", int64_t);
-        CAST("i4", int32_t, "u4", uint32_t);
-        CAST("i4", int32_t, "u8", uint64_t);
-        CAST("i4", int32_t, "f8", double);
-        CAST("i4", int32_t, "f4", float);
-        CAST("i4", int32_t, "b1", char);
-    } else
-    if(0 == strcmp(dst->array->dtype + 1, "u4")) {
-        CAST("u4", uint32_t, "u8", uint64_t);
-        CAST("u4", uint32_t, "i4", int32_t);
-        CAST("u4", uint32_t, "i8", int64_t);
-        CAST("u4", uint32_t, "f8", double);
-        CAST("u4", uint32_t, "f4", float);
-        CAST("u4", uint32_t, "b1", char);
-    } else
-    if(0 == strcmp(dst->array->dtype + 1, "f4")) {
-        CAST("f4", float, "f8", double);
-        CAST("f4", float, "i4", int32_t);
-        CAST("f4", float, "i8", int64_t);
-        CAST("f4", float, "u4", uint32_t);
-        CAST("f4", float, "u8", uint64_t);
-        CAST("f4", float, "b1", char);
-    } else
-    if(0 == strcmp(dst->array->dtype + 1, "c8")) {
-        CAST2("c8", cplx64_t, "c16", cplx128_t);
-    } else
-    if(0 == strcmp(dst->array->dtype + 1, "c16")) {
-        CAST2("c16", cplx128_t, "c8", cplx64_t);
+    if(slot >= 0) {
+        if(fdcache->entries[slot].fd >= 0) {
+            close(fdcache->entries[slot].fd);
+        }
+        fdcache->entries[slot].fileid = fileid;
+        fdcache->entries[slot].fd = fd;
+        fdcache->entries[slot].writable = writable;
+        fdcache->entries[slot].direct = direct;
+        fdcache->entries[slot].refcount = 1;
+        fdcache->entries[slot].stamp = ++fdcache->clock;
     }
-    RAISE(ex, "Unsupported conversion from %s to %s. ", src->array->dtype, dst->array->dtype);
-ex:
-    return -1;
+    /* if all entries are in use, the descriptor is not cached and closed on release. */
+    pthread_mutex_unlock(&fdcache->lock);
+    return fd;
 }
 
 static void
-sysvsum(unsigned int * sum, void * buf, size_t size)
+fdcache_release(BigFDCache * fdcache, int fd)
 {
-    unsigned int thisrun = *sum;
-    unsigned char * cp = (unsigned char *) buf;
-    while(size --)
-        thisrun += *(cp++);
-    *sum = thisrun;
+    int i;
+    if(!fdcache) {
+        close(fd);
+        return;
+    }
+    pthread_mutex_lock(&fdcache->lock);
+    for(i = 0; i < fdcache->used; i ++) {
+        if(fdcache->entries[i].fd == fd) {
+            fdcache->entries[i].refcount --;
+            pthread_mutex_unlock(&fdcache->lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&fdcache->lock);
+    close(fd);
 }
 
 /*
@@ -1514,6 +4598,13 @@ static int _isblank(int ch) {
     return ch == ' ' || ch == '\t';
 }
 
+static int _hexdigit(int ch) {
+    if(ch >= '0' && ch <= '9') return ch - '0';
+    if(ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    if(ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    return 0;
+}
+
 static int
 attrset_read_attr_set_v2(BigAttrSet * attrset, const char * basename)
 {
@@ -1578,12 +4669,7 @@ ex_init:
         }
         int j, k;
         for(k = 0, j = 0; k < nmemb * itemsize; k ++, j += 2) {
-            char buf[3];
-            buf[0] = rawdata[j];
-            buf[1] = rawdata[j+1];
-            buf[2] = 0;
-            unsigned int byte = strtoll(buf, NULL, 16);
-            data[k] = byte;
+            data[k] = _hexdigit(rawdata[j]) * 16 + _hexdigit(rawdata[j + 1]);
         }
         if(0 != attrset_set_attr(attrset, name, data, dtype, nmemb)) {
             attrset->dirty = 0;
@@ -1610,6 +4696,10 @@ attrset_write_attr_set_v2(BigAttrSet * attrset, const char * basename)
             ex_open,
             NULL);
 
+    RAISEIF(0 != attrset_sort(attrset),
+            ex_open,
+            NULL);
+
     ptrdiff_t i;
     for(i = 0; i < attrset->listused; i ++) {
         BigAttr * a = & attrset->attrlist[i];
@@ -1665,6 +4755,12 @@ attrset_write_attr_set_v2(BigAttrSet * attrset, const char * basename)
             "Failed to write to file");
     }
     fclose(fattr);
+
+    /* attr-v3 is read after attr-v2 and would hide it */
+    int unbuffered;
+    char * filename = _big_file_path_of(basename, FILEID_ATTR_V3, &unbuffered);
+    unlink(filename);
+    free(filename);
     return 0;
 ex_write:
     fclose(fattr);
@@ -1678,40 +4774,102 @@ static int attr_cmp(const void * p1, const void * p2) {
     return strcmp(c1->name, c2->name);
 }
 
-static BigAttr *
-attrset_append_attr(BigAttrSet * attrset)
+/* FNV-1a */
+static size_t
+attr_hash(const char * name)
 {
-    while(attrset->listsize - attrset->listused < 1) {
-        attrset->attrlist = (BigAttr *) realloc(attrset->attrlist, attrset->listsize * 2 * sizeof(BigAttr));
-        attrset->listsize *= 2;
+    uint64_t h = 14695981039346656037ULL;
+    for(; *name; name ++) {
+        h ^= (unsigned char) *name;
+        h *= 1099511628211ULL;
     }
-    BigAttr * a = & (attrset->attrlist[attrset->listused++]);
-    memset(a, 0, sizeof(BigAttr));
-    return a;
+    return h;
+}
+
+static void
+attrset_hash_insert(size_t * hash, size_t hashsize, const char * name, size_t ind)
+{
+    size_t slot = attr_hash(name) & (hashsize - 1);
+    while(hash[slot]) slot = (slot + 1) & (hashsize - 1);
+    hash[slot] = ind + 1;
 }
 
+/* rebuilds the hash of attrlist, with room for nattrs attributes */
 static int
-attrset_add_attr(BigAttrSet * attrset, const char * attrname, const char * dtype, int nmemb)
+attrset_rehash(BigAttrSet * attrset, size_t nattrs)
 {
-    size_t size = big_file_dtype_itemsize(dtype) * nmemb + strlen(attrname) + 1;
-    while(attrset->bufsize - attrset->bufused < size) {
-        int i;
-        for(i = 0; i < attrset->listused; i ++) {
-            attrset->attrlist[i].data -= (ptrdiff_t) attrset->attrbuf;
-            attrset->attrlist[i].name -= (ptrdiff_t) attrset->attrbuf;
-        }
-        attrset->attrbuf = (char *) realloc(attrset->attrbuf, attrset->bufsize * 2);
-        attrset->bufsize *= 2;
+    size_t hashsize = 32;
+    while(hashsize < 2 * nattrs) hashsize *= 2;
+    size_t * hash = (size_t *) calloc(hashsize, sizeof(size_t));
+    RAISEIF(!hash, ex_malloc, "No memory");
+    size_t i;
+    for(i = 0; i < attrset->listused; i ++) {
+        attrset_hash_insert(hash, hashsize, attrset->attrlist[i].name, i);
+    }
+    free(attrset->hash);
+    attrset->hash = hash;
+    attrset->hashsize = hashsize;
+    return 0;
+ex_malloc:
+    return -1;
+}
+
+static int
+attrset_sort(BigAttrSet * attrset)
+{
+    if(attrset->sorted) return 0;
+    qsort(attrset->attrlist, attrset->listused, sizeof(BigAttr), attr_cmp);
+    attrset->sorted = 1;
+    return attrset_rehash(attrset, attrset->listused);
+}
+
+/* makes room for nattrs more attributes, taking bytes of names and data */
+static int
+attrset_reserve(BigAttrSet * attrset, size_t nattrs, size_t bytes)
+{
+    if(attrset->bufsize - attrset->bufused < bytes) {
+        size_t bufsize = attrset->bufsize;
+        while(bufsize - attrset->bufused < bytes) bufsize *= 2;
+        char * attrbuf = (char *) realloc(attrset->attrbuf, bufsize);
+        RAISEIF(!attrbuf, ex_malloc, "No memory");
+        size_t i;
         for(i = 0; i < attrset->listused; i ++) {
-            attrset->attrlist[i].data += (ptrdiff_t) attrset->attrbuf;
-            attrset->attrlist[i].name += (ptrdiff_t) attrset->attrbuf;
+            attrset->attrlist[i].data = attrbuf + (attrset->attrlist[i].data - attrset->attrbuf);
+            attrset->attrlist[i].name = attrbuf + (attrset->attrlist[i].name - attrset->attrbuf);
         }
+        attrset->attrbuf = attrbuf;
+        attrset->bufsize = bufsize;
     }
+    if(attrset->listsize - attrset->listused < nattrs) {
+        size_t listsize = attrset->listsize;
+        while(listsize - attrset->listused < nattrs) listsize *= 2;
+        BigAttr * attrlist = (BigAttr *) realloc(attrset->attrlist, listsize * sizeof(BigAttr));
+        RAISEIF(!attrlist, ex_malloc, "No memory");
+        attrset->attrlist = attrlist;
+        attrset->listsize = listsize;
+    }
+    if(attrset->hashsize < 2 * (attrset->listused + nattrs)) {
+        RAISEIF(0 != attrset_rehash(attrset, attrset->listused + nattrs),
+            ex_malloc, NULL);
+    }
+    return 0;
+ex_malloc:
+    return -1;
+}
+
+/* points the attribute at ind to new space for its name and value */
+static int
+attrset_place_attr(BigAttrSet * attrset, size_t ind, const char * attrname, const char * dtype, int nmemb)
+{
+    size_t size = big_file_dtype_itemsize(dtype) * nmemb + strlen(attrname) + 1;
+    RAISEIF(0 != attrset_reserve(attrset, 0, size),
+        ex_reserve,
+        NULL);
+
     char * free = attrset->attrbuf + attrset->bufused;
     attrset->bufused += size;
 
-    BigAttr * n = attrset_append_attr(attrset);
-
+    BigAttr * n = &attrset->attrlist[ind];
     n->nmemb = nmemb;
     memset(n->dtype, 0, 8);
     _dtype_normalize(n->dtype, dtype);
@@ -1720,18 +4878,46 @@ attrset_add_attr(BigAttrSet * attrset, const char * attrname, const char * dtype
     strcpy(free, attrname);
     free += strlen(attrname) + 1;
     n->data = free;
+    return 0;
+ex_reserve:
+    return -1;
+}
 
-    qsort(attrset->attrlist, attrset->listused, sizeof(BigAttr), attr_cmp);
+static int
+attrset_add_attr(BigAttrSet * attrset, const char * attrname, const char * dtype, int nmemb)
+{
+    RAISEIF(0 != attrset_reserve(attrset, 1, 0),
+        ex_reserve,
+        NULL);
+
+    size_t ind = attrset->listused;
+    memset(&attrset->attrlist[ind], 0, sizeof(BigAttr));
+    RAISEIF(0 != attrset_place_attr(attrset, ind, attrname, dtype, nmemb),
+        ex_reserve,
+        NULL);
+    attrset->listused ++;
+
+    /* attributes read from a file arrive in order and keep the list sorted */
+    if(ind > 0 && attr_cmp(&attrset->attrlist[ind - 1], &attrset->attrlist[ind]) > 0)
+        attrset->sorted = 0;
+
+    attrset_hash_insert(attrset->hash, attrset->hashsize, attrname, ind);
     return 0;
+ex_reserve:
+    return -1;
 }
 
 static BigAttr *
 attrset_lookup_attr(BigAttrSet * attrset, const char * attrname)
 {
-    BigAttr lookup = {0};
-    lookup.name = (char*) attrname;
-    BigAttr * found = (BigAttr *) bsearch(&lookup, attrset->attrlist, attrset->listused, sizeof(BigAttr), attr_cmp);
-    return found;
+    size_t slot = attr_hash(attrname) & (attrset->hashsize - 1);
+    while(attrset->hash[slot]) {
+        BigAttr * attr = &attrset->attrlist[attrset->hash[slot] - 1];
+        if(0 == strcmp(attr->name, attrname))
+            return attr;
+        slot = (slot + 1) & (attrset->hashsize - 1);
+    }
+    return NULL;
 }
 
 static int
@@ -1747,22 +4933,21 @@ attrset_remove_attr(BigAttrSet * attrset, const char * attrname)
         (attrset->listused - ind - 1) * sizeof(BigAttr));
     attrset->listused -= 1;
 
-    return 0;
+    /* the attributes after it have moved */
+    return attrset_rehash(attrset, attrset->listused);
 }
 
 static BigAttr *
 attrset_list_attrs(BigAttrSet * attrset, size_t * count)
 {
+    attrset_sort(attrset);
     *count = attrset->listused;
     return attrset->attrlist;
 }
 
 static int
-attrset_set_attr(BigAttrSet * attrset, const char * attrname, const void * data, const char * dtype, int nmemb)
+attrset_check_name(const char * attrname)
 {
-    BigAttr * attr;
-    attrset->dirty = 1;
-
     RAISEIF (
          strchr(attrname, ' ')
       || strchr(attrname, '\t')
@@ -1770,16 +4955,55 @@ attrset_set_attr(BigAttrSet * attrset, const char * attrname, const void * data,
       ex_name,
       "Attribute name cannot contain blanks (space, tab or newline)"
     );
+    return 0;
+ex_name:
+    return -1;
+}
+
+/* 1 if an attribute can have the normalized dtype: strings of any length,
+ * a1 being the string dtype of the python binding, or a valid numerical dtype. */
+static int
+attrset_dtype_isvalid(const char * dtype)
+{
+    if(dtype[1] == 'a' || dtype[1] == 'S') {
+        return atoi(&dtype[2]) > 0;
+    }
+    return dtype_isvalid(dtype);
+}
+
+static int
+attrset_set_attr(BigAttrSet * attrset, const char * attrname, const void * data, const char * dtype, int nmemb)
+{
+    BigAttr * attr;
+    attrset->dirty = 1;
+
+    RAISEIF(0 != attrset_check_name(attrname),
+      ex_name,
+      NULL);
+
+    char normalized[8] = {0};
+    _dtype_normalize(normalized, dtype);
+    RAISEIF(!attrset_dtype_isvalid(normalized),
+      ex_name,
+      "Attribute `%s' has an invalid dtype `%s'", attrname, dtype);
 
-    /* Remove it if it exists*/
-    attr = attrset_lookup_attr(attrset, attrname);
-    if(attr)
-        attrset_remove_attr(attrset, attrname);
-    /* add ensures the dtype has been normalized! */
-    RAISEIF(0 != attrset_add_attr(attrset, attrname, dtype, nmemb),
-            ex_add,
-            "Failed to add attr");
     attr = attrset_lookup_attr(attrset, attrname);
+    if(attr) {
+        /* Replace the value in place; a different shape needs new space */
+        ptrdiff_t ind = attr - attrset->attrlist;
+        if(attr->nmemb != nmemb || 0 != memcmp(attr->dtype, normalized, 8)) {
+            RAISEIF(0 != attrset_place_attr(attrset, ind, attrname, dtype, nmemb),
+                ex_add,
+                "Failed to add attr");
+        }
+        attr = &attrset->attrlist[ind];
+    } else {
+        /* add ensures the dtype has been normalized! */
+        RAISEIF(0 != attrset_add_attr(attrset, attrname, dtype, nmemb),
+                ex_add,
+                "Failed to add attr");
+        attr = &attrset->attrlist[attrset->listused - 1];
+    }
     RAISEIF(attr->nmemb != nmemb,
             ex_mismatch,
             "attr nmemb mismatch");
@@ -1791,6 +5015,216 @@ ex_add:
     return -1;
 }
 
+static int
+attrset_set_attrs(BigAttrSet * attrset, const BigAttr * attrs, size_t nattrs)
+{
+    size_t i;
+    size_t bytes = 0;
+    /* check everything before the first attribute is changed */
+    for(i = 0; i < nattrs; i ++) {
+        char normalized[8];
+        _dtype_normalize(normalized, attrs[i].dtype);
+        RAISEIF(0 != attrset_check_name(attrs[i].name),
+            ex_check,
+            NULL);
+        RAISEIF(!attrset_dtype_isvalid(normalized),
+            ex_check,
+            "Attribute `%s' has an invalid dtype `%s'", attrs[i].name, attrs[i].dtype);
+        bytes += big_file_dtype_itemsize(attrs[i].dtype) * attrs[i].nmemb + strlen(attrs[i].name) + 1;
+    }
+    RAISEIF(0 != attrset_reserve(attrset, nattrs, bytes),
+        ex_check,
+        NULL);
+    for(i = 0; i < nattrs; i ++) {
+        RAISEIF(0 != attrset_set_attr(attrset, attrs[i].name, attrs[i].data, attrs[i].dtype, attrs[i].nmemb),
+            ex_check,
+            NULL);
+    }
+    return 0;
+ex_check:
+    return -1;
+}
+
+/* attr-v3: a header, a directory of nattr entries sorted by name,
+ * then the names and values of the attributes, nattr in total.
+ * The offsets are relative to the names and values; integers are in the byte order of
+ * the writer and each value in the byte order of its dtype. */
+#define ATTR_V3_MAGIC "BIGATR3\n"
+#define ATTR_V3_BYTEORDER 0x01020304u
+
+struct AttrV3Header {
+    char magic[8];
+    uint32_t byteorder;
+    uint32_t nattr;
+    uint64_t bytes;
+};
+
+struct AttrV3Entry {
+    uint64_t name;
+    uint64_t data;
+    int32_t nmemb;
+    char dtype[8];
+    uint32_t reserved;
+};
+
+static int
+attrset_read_attr_set_v3(BigAttrSet * attrset, const char * basename)
+{
+    attrset->dirty = 0;
+
+    /* the writers of this library remove attr-v2 with attr-v3; an attr-v2 as new
+     * as attr-v3 was written since by an older library, and its values are the current ones. */
+    int unbuffered;
+    char * v2name = _big_file_path_of(basename, FILEID_ATTR_V2, &unbuffered);
+    char * v3name = _big_file_path_of(basename, FILEID_ATTR_V3, &unbuffered);
+    struct stat v2, v3;
+    int stale = 0 == stat(v2name, &v2) && 0 == stat(v3name, &v3)
+             && !_timespec_older(&v2.st_mtim, &v3.st_mtim);
+    free(v3name);
+    free(v2name);
+    if(stale) {
+        return 0;
+    }
+
+    FILE * fattr = _big_file_open_a_file(basename, FILEID_ATTR_V3, "r", 0);
+    if(fattr == NULL) {
+        return 0;
+    }
+    char * buffer = NULL;
+    struct AttrV3Header h;
+    RAISEIF(1 != fread(&h, sizeof(h), 1, fattr)
+         || 0 != memcmp(h.magic, ATTR_V3_MAGIC, 8),
+        ex_read,
+        "Attribute file of `%s' is not in the attr-v3 format", basename);
+
+    int swap = h.byteorder != ATTR_V3_BYTEORDER;
+    if(swap) {
+        RAISEIF(__builtin_bswap32(h.byteorder) != ATTR_V3_BYTEORDER,
+            ex_read,
+            "Attribute file of `%s' has a bad byte order mark", basename);
+        h.nattr = __builtin_bswap32(h.nattr);
+        h.bytes = __builtin_bswap64(h.bytes);
+    }
+
+    size_t dirbytes = (size_t) h.nattr * sizeof(struct AttrV3Entry);
+    buffer = (char *) malloc(dirbytes + h.bytes + 1);
+    RAISEIF(!buffer, ex_read, "No memory for %zu attributes of `%s'", (size_t) h.nattr, basename);
+    RAISEIF(dirbytes + h.bytes != fread(buffer, 1, dirbytes + h.bytes, fattr),
+        ex_read,
+        "Attribute file of `%s' is truncated", basename);
+
+    struct AttrV3Entry * dir = (struct AttrV3Entry *) buffer;
+    char * blob = buffer + dirbytes;
+    /* so that a bad name offset ends at the end of the buffer */
+    blob[h.bytes] = 0;
+
+    /* the values are used as they are; only the directory is parsed. */
+    RAISEIF(0 != attrset_reserve(attrset, h.nattr, h.bytes),
+        ex_read,
+        NULL);
+    size_t i;
+    for(i = 0; i < h.nattr; i ++) {
+        struct AttrV3Entry e = dir[i];
+        if(swap) {
+            e.name = __builtin_bswap64(e.name);
+            e.data = __builtin_bswap64(e.data);
+            e.nmemb = __builtin_bswap32(e.nmemb);
+        }
+        e.dtype[7] = 0;
+        RAISEIF(e.name >= h.bytes
+             || e.nmemb < 0
+             || !attrset_dtype_isvalid(e.dtype)
+             || e.data > h.bytes
+             || (uint64_t) big_file_dtype_itemsize(e.dtype) * e.nmemb > h.bytes - e.data,
+            ex_read,
+            "Attribute %zu in the attribute file of `%s' is corrupted", i, basename);
+        RAISEIF(0 != attrset_set_attr(attrset, blob + e.name, blob + e.data, e.dtype, e.nmemb),
+            ex_read,
+            NULL);
+    }
+    free(buffer);
+    fclose(fattr);
+    attrset->dirty = 0;
+    return 0;
+
+ex_read:
+    free(buffer);
+    fclose(fattr);
+    attrset->dirty = 0;
+    return -1;
+}
+
+static int
+attrset_write_attr_set_v3(BigAttrSet * attrset, const char * basename)
+{
+    RAISEIF(0 != attrset_sort(attrset),
+        ex_sort,
+        NULL);
+
+    size_t i;
+    size_t bytes = 0;
+    for(i = 0; i < attrset->listused; i ++) {
+        BigAttr * a = &attrset->attrlist[i];
+        bytes += strlen(a->name) + 1 + (size_t) big_file_dtype_itemsize(a->dtype) * a->nmemb;
+    }
+    size_t dirbytes = attrset->listused * sizeof(struct AttrV3Entry);
+    struct AttrV3Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ATTR_V3_MAGIC, 8);
+    h.byteorder = ATTR_V3_BYTEORDER;
+    h.nattr = attrset->listused;
+    h.bytes = bytes;
+
+    char * buffer = (char *) calloc(sizeof(h) + dirbytes + bytes, 1);
+    RAISEIF(!buffer, ex_malloc, "No memory");
+
+    memcpy(buffer, &h, sizeof(h));
+    struct AttrV3Entry * dir = (struct AttrV3Entry *) (buffer + sizeof(h));
+    char * blob = buffer + sizeof(h) + dirbytes;
+    size_t offset = 0;
+    for(i = 0; i < attrset->listused; i ++) {
+        BigAttr * a = &attrset->attrlist[i];
+        size_t lname = strlen(a->name) + 1;
+        size_t ldata = (size_t) big_file_dtype_itemsize(a->dtype) * a->nmemb;
+        dir[i].name = offset;
+        memcpy(blob + offset, a->name, lname);
+        offset += lname;
+        dir[i].data = offset;
+        memcpy(blob + offset, a->data, ldata);
+        offset += ldata;
+        dir[i].nmemb = a->nmemb;
+        memcpy(dir[i].dtype, a->dtype, 8);
+    }
+
+    FILE * fattr = _big_file_open_a_file(basename, FILEID_ATTR_V3, "w", 1);
+    RAISEIF(fattr == NULL,
+        ex_open,
+        NULL);
+    RAISEIF(1 != fwrite(buffer, sizeof(h) + dirbytes + bytes, 1, fattr),
+        ex_write,
+        "Failed to write to file");
+    RAISEIF(0 != fclose(fattr),
+        ex_open,
+        "Failed to write to file");
+    free(buffer);
+
+    /* older readers only know attr-v2; leave no stale copy for them */
+    int unbuffered;
+    char * filename = _big_file_path_of(basename, FILEID_ATTR_V2, &unbuffered);
+    unlink(filename);
+    free(filename);
+    attrset->dirty = 0;
+    return 0;
+
+ex_write:
+    fclose(fattr);
+ex_open:
+    free(buffer);
+ex_malloc:
+ex_sort:
+    return -1;
+}
+
 static int
 attrset_get_attr(BigAttrSet * attrset, const char * attrname, void * data, const char * dtype, int nmemb)
 {
@@ -1814,6 +5248,8 @@ attrset_create(void)
     attrset->attrlist = (BigAttr *) malloc(sizeof(BigAttr) * 16);
     attrset->listsize = 16;
     attrset->listused = 0;
+    attrset->sorted = 1;
+    attrset_rehash(attrset, attrset->listsize);
 
     return attrset;
 }
@@ -1821,6 +5257,7 @@ attrset_create(void)
 static void
 attrset_free(BigAttrSet * attrset)
 {
+    free(attrset->hash);
     free(attrset->attrbuf);
     free(attrset->attrlist);
     free(attrset);
@@ -1834,6 +5271,7 @@ void big_attrset_set_dirty(BigAttrSet * attrset, int dirty)
 static void *
 _big_attrset_pack(BigAttrSet * attrset, size_t * bytes)
 {
+    attrset_sort(attrset);
     size_t n = 0;
     n += sizeof(BigAttrSet);
     n += attrset->bufused;
@@ -1873,6 +5311,10 @@ _big_attrset_unpack(void * pp)
         attrset->attrlist[i].data += (ptrdiff_t) attrset->attrbuf;
         attrset->attrlist[i].name += (ptrdiff_t) attrset->attrbuf;
     }
+    /* the packed hash pointer belongs to the sender */
+    attrset->hash = NULL;
+    attrset->hashsize = 0;
+    attrset_rehash(attrset, attrset->listsize);
     return attrset;
 }
 
@@ -1889,6 +5331,12 @@ _big_block_pack(BigBlock * block, size_t * bytes)
               + (Nfile + 1) * sizeof(block->foffset[0])
               + (Nfile + 1) * sizeof(block->fchecksum[0])
               + attrsize;
+    size_t ncrc = 0;
+    if(block->crcsize) {
+        ncrc = block->fcrcoffset[Nfile];
+        * bytes += (Nfile + 1) * sizeof(block->fcrcoffset[0])
+                 + ncrc * sizeof(block->fcrc[0]);
+    }
 
     void * buf = (void *) malloc(*bytes);
 
@@ -1911,6 +5359,12 @@ _big_block_pack(BigBlock * block, size_t * bytes)
     memcpy(ptr, attrset, attrsize);
     free(attrset);
     ptr += attrsize;
+    if(block->crcsize) {
+        memcpy(ptr, block->fcrcoffset, (Nfile + 1) * sizeof(block->fcrcoffset[0]));
+        ptr += (Nfile + 1) * sizeof(block->fcrcoffset[0]);
+        memcpy(ptr, block->fcrc, ncrc * sizeof(block->fcrc[0]));
+        ptr += ncrc * sizeof(block->fcrc[0]);
+    }
 
     return buf;
 }
@@ -1940,16 +5394,33 @@ _big_block_unpack(BigBlock * block, void * buf)
         memcpy(block->fchecksum, ptr, (Nfile + 1) * sizeof(block->fchecksum[0]));
     ptr += (Nfile + 1) * sizeof(block->fchecksum[0]);
     block->attrset = _big_attrset_unpack(ptr);
+    ptr += sizeof(BigAttrSet)
+         + block->attrset->bufused
+         + block->attrset->listused * sizeof(BigAttr);
+    if(block->crcsize) {
+        block->fcrcoffset = (size_t *) calloc(Nfile + 1, sizeof(size_t));
+        memcpy(block->fcrcoffset, ptr, (Nfile + 1) * sizeof(block->fcrcoffset[0]));
+        ptr += (Nfile + 1) * sizeof(block->fcrcoffset[0]);
+        size_t ncrc = block->fcrcoffset[Nfile];
+        block->fcrc = (unsigned int *) calloc(ncrc + 1, sizeof(unsigned int));
+        memcpy(block->fcrc, ptr, ncrc * sizeof(block->fcrc[0]));
+        ptr += ncrc * sizeof(block->fcrc[0]);
+    } else {
+        block->fcrcoffset = NULL;
+        block->fcrc = NULL;
+    }
+    /* descriptors are local to a process; never reuse the packed pointer. */
+    block->fdcache = fdcache_create();
 }
 
 
 /* File Path */
 
-FILE *
-_big_file_open_a_file(const char * basename, int fileid, const char * mode, const int raise)
+char *
+_big_file_path_of(const char * basename, int fileid, int * unbuffered)
 {
     char * filename;
-    int unbuffered = 0;
+    *unbuffered = 0;
     if(fileid == FILEID_HEADER) {
         filename = _path_join(basename, EXT_HEADER);
     } else
@@ -1958,12 +5429,29 @@ _big_file_open_a_file(const char * basename, int fileid, const char * mode, cons
     } else
     if(fileid == FILEID_ATTR_V2) {
         filename = _path_join(basename, EXT_ATTR_V2);
+    } else
+    if(fileid == FILEID_CHECKSUM) {
+        filename = _path_join(basename, EXT_CHECKSUM);
+    } else
+    if(fileid == FILEID_HEADER_V2) {
+        filename = _path_join(basename, EXT_HEADER_V2);
+    } else
+    if(fileid == FILEID_ATTR_V3) {
+        filename = _path_join(basename, EXT_ATTR_V3);
     } else {
         char d[128];
         sprintf(d, EXT_DATA, fileid);
         filename = _path_join(basename, d);
-        unbuffered = 1;
+        *unbuffered = 1;
     }
+    return filename;
+}
+
+FILE *
+_big_file_open_a_file(const char * basename, int fileid, const char * mode, const int raise)
+{
+    int unbuffered;
+    char * filename = _big_file_path_of(basename, fileid, &unbuffered);
     FILE * fp = fopen(filename, mode);
 
     if(!raise && fp == NULL) {
@@ -1982,6 +5470,138 @@ ex_fopen:
     free(filename);
     return fp;
 }
+
+/* translate a fopen style mode string to open(2) flags. */
+static int
+_big_file_open_flags(const char * mode)
+{
+    int flags;
+    int plus = strchr(mode, '+') != NULL;
+    switch(mode[0]) {
+        case 'r':
+            flags = plus ? O_RDWR : O_RDONLY;
+            break;
+        case 'w':
+            flags = (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+            break;
+        case 'a':
+            flags = (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_APPEND;
+            break;
+        default:
+            flags = -1;
+    }
+#ifdef O_DIRECT
+    /* 'd' bypasses the page cache */
+    if(flags >= 0 && strchr(mode, 'd')) {
+        flags |= O_DIRECT;
+    }
+#endif
+    return flags;
+}
+
+int
+_big_file_open_a_fd(const char * basename, int fileid, const char * mode, const int raise)
+{
+    int unbuffered;
+    char * filename = _big_file_path_of(basename, fileid, &unbuffered);
+    int flags = _big_file_open_flags(mode);
+    int fd = -1;
+
+    RAISEIF(flags < 0,
+        ex_open,
+        "Unknown mode `%s' to open physical file `%s'",
+        mode, filename);
+
+    fd = open(filename, flags, 0666);
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    if(fd >= 0 && strchr(mode, 'd')) {
+        fcntl(fd, F_NOCACHE, 1);
+    }
+#endif
+
+    if(!raise && fd < 0) {
+        goto ex_open;
+    }
+
+    RAISEIF(fd < 0,
+        ex_open,
+        "Failed to open physical file `%s' with mode `%s' (%s)",
+        filename, mode, strerror(errno));
+
+ex_open:
+    free(filename);
+    return fd;
+}
+
+/* Positional IO. Loops over short reads / writes and interrupts;
+ * returns the number of bytes transferred, which is less than bytes on an error or EOF. */
+ptrdiff_t
+_big_file_pread(int fd, void * buf, size_t bytes, ptrdiff_t offset)
+{
+    size_t done = 0;
+    while(done < bytes) {
+        ssize_t n = pread(fd, (char *) buf + done, bytes - done, offset + done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+        done += n;
+    }
+    return done;
+}
+
+ptrdiff_t
+_big_file_pwrite(int fd, const void * buf, size_t bytes, ptrdiff_t offset)
+{
+    size_t done = 0;
+    while(done < bytes) {
+        ssize_t n = pwrite(fd, (const char *) buf + done, bytes - done, offset + done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+        done += n;
+    }
+    return done;
+}
+
+/* Direct IO; the aligned middle of the range goes through dfd (opened with O_DIRECT),
+ * the unaligned head and tail through the buffered descriptor fd.
+ * buf must be aligned where offset is, i.e. buf - offset is a multiple of DIRECTIO_ALIGNMENT.
+ * If dfd is -1 or the file system refuses direct IO, everything goes through fd. */
+static ptrdiff_t
+_big_file_direct_io(int fd, int dfd, char * buf, size_t bytes, ptrdiff_t offset, int writing)
+{
+    ptrdiff_t begin = (offset + DIRECTIO_ALIGNMENT - 1) / DIRECTIO_ALIGNMENT * DIRECTIO_ALIGNMENT;
+    ptrdiff_t end = (offset + bytes) / DIRECTIO_ALIGNMENT * DIRECTIO_ALIGNMENT;
+    if(dfd < 0 || end <= begin) {
+        begin = end = offset;
+    }
+
+    ptrdiff_t segments[3][2] = {{offset, begin}, {begin, end}, {end, offset + bytes}};
+    ptrdiff_t done = 0;
+    int i;
+    for(i = 0; i < 3; i ++) {
+        size_t n = segments[i][1] - segments[i][0];
+        char * p = buf + (segments[i][0] - offset);
+        ptrdiff_t r;
+        if(n == 0) continue;
+        int dfd1 = (i == 1) ? dfd : fd;
+        if(writing) {
+            r = _big_file_pwrite(dfd1, p, n, segments[i][0]);
+        } else {
+            r = _big_file_pread(dfd1, p, n, segments[i][0]);
+        }
+        if(i == 1 && r != n && errno == EINVAL) {
+            /* direct IO is not supported for this file; use the page cache */
+            if(writing) {
+                r = _big_file_pwrite(fd, p, n, segments[i][0]);
+            } else {
+                r = _big_file_pread(fd, p, n, segments[i][0]);
+            }
+        }
+        done += r;
+        if(r != n) break;
+    }
+    return done;
+}
+
 static
 int _big_file_mkdir(const char * dirname)
 {
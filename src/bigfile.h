@@ -21,6 +21,8 @@ struct BigAttr {
 
 typedef struct BigAttrSet BigAttrSet;
 
+typedef struct BigFDCache BigFDCache;
+
 typedef struct BigBlock {
     /* All members are readonly */
     char dtype[8]; /* numpy style
@@ -37,6 +39,11 @@ typedef struct BigBlock {
     int Nfile;
     BigAttrSet * attrset;
     int dirty;
+    BigFDCache * fdcache; /* open descriptors of the physical files, internal */
+    int directio; /* bypass the page cache, see big_block_set_direct_io */
+    size_t crcsize; /* bytes per chunk checksum of the physical files, 0 if none */
+    size_t * fcrcoffset; /* Nfile + 1, first chunk checksum of each file */
+    unsigned int * fcrc; /* running CRC32C of each chunk (unreduced), internal */
 } BigBlock;
 
 typedef struct BigBlockPtr BigBlockPtr;
@@ -67,6 +74,45 @@ typedef struct BigArrayIter {
 } BigArrayIter;
 
 int big_file_set_buffer_size(size_t bytes);
+
+/** Set the max number of physical files a BigBlock keeps open between calls.
+ * Descriptors are released in big_block_close. 0 disables the cache.
+ * Applies to blocks opened or created afterwards. */
+int big_file_set_fd_cache_size(int nfiles);
+
+/** Keep a CRC32C checksum of every `bytes` of the physical files, in a `checksum` file
+ * next to the header, in addition to the sysv sum of the whole file.
+ * Applies to blocks created afterwards; blocks with a `checksum` file keep it up to date.
+ * 0 (the default) disables the chunk checksums. Like the sysv sum, a checksum is
+ * only right if each byte of the file is written once. */
+int big_file_set_checksum_chunk_size(size_t bytes);
+
+/** Also write a binary copy of the header, `header-v2`, when a block is flushed.
+ * Blocks with many physical files open faster with it: the file sizes and checksums
+ * load with one read instead of a scanf per file. The text header is always written;
+ * a binary header older than the text header is ignored. 0 (the default) disables. */
+int big_file_set_binary_header(int enable);
+
+/** Set the format of the attribute files written when a block is flushed.
+ * 2 (the default) writes the text file `attr-v2`, with values in hex, which every version reads.
+ * 3 writes the binary file `attr-v3`: a directory of the names, dtypes and nmemb,
+ * then the raw values, which are read without parsing. Either writer removes
+ * the file of the other; both are read.
+ * @returns 0 if successful. */
+int big_file_set_attr_version(int version); /* raises */
+
+/** Set the number of threads big_block_read and big_block_write use.
+ * A request spanning several physical files is split along the file boundaries,
+ * one file is never shared by two threads. 1 (the default) is serial. */
+int big_file_set_num_threads(int nthreads);
+
+/** Set the number of chunk buffers in flight in big_block_read and big_block_write.
+ * With 2 or more, a helper thread reads (writes) the next (previous) chunk while the
+ * current chunk is converted; the buffer size is shared by the buffers. 1 disables
+ * the pipeline; the default is 2.
+ * Built with BIGFILE_USE_IO_URING, the chunks in flight are submitted with io_uring
+ * instead, if the kernel supports it; the free buffers are refilled with one system call. */
+int big_file_set_pipeline_depth(int depth);
 char * big_file_get_error_message(void);
 void big_file_set_error_message(char * msg);
 
@@ -84,6 +130,10 @@ int big_file_open(BigFile * bf, const char * basename); /* raises */
 int big_file_create(BigFile * bf, const char * basename); /* raises */
 int big_file_list(BigFile * bf, char *** blocknames, int * Nblocks);
 int big_file_open_block(BigFile * bf, BigBlock * block, const char * blockname); /* raises*/
+/** Open nblocks blocks at once, into blocks[0 .. nblocks - 1].
+ * The headers and attributes are read by up to big_file_set_num_threads threads.
+ * If any block fails to open, none is left open. */
+int big_file_open_blocks(BigFile * bf, BigBlock * blocks, const char * const blocknames[], int nblocks); /* raises */
 int big_file_create_block(BigFile * bf, BigBlock * block, const char * blockname, const char * dtype, int nmemb, int Nfile, const size_t fsize[]); /* raises */
 int big_file_close(BigFile * bf); /* raises */
 
@@ -92,6 +142,17 @@ int big_block_grow(BigBlock * bb, int Nfile_grow, const size_t fsize_grow[]); /*
 int big_block_flush(BigBlock * block); /* raises */
 
 void big_block_set_dirty(BigBlock * block, int value);
+
+/** Read and write the block bypassing the page cache (O_DIRECT), if value is nonzero.
+ * The aligned part of each chunk goes to the disk directly; the unaligned head and tail,
+ * and file systems that do not support direct IO, go through the page cache.
+ * With MPI, set it on every rank before big_block_mpi_write or big_block_mpi_read. */
+void big_block_set_direct_io(BigBlock * block, int value);
+
+/** The CRC32C of the chunk-th chunk of the fileid-th physical file, from the data written to the block.
+ * The chunk covers *bytes bytes of the file from chunk * block->crcsize.
+ * Raises if the block has no chunk checksums or the chunk does not exist. */
+int big_block_get_chunk_checksum(BigBlock * block, int fileid, ptrdiff_t chunk, unsigned int * crc32c, size_t * bytes);
 void big_attrset_set_dirty(BigAttrSet * attrset, int value);
 
 /** Initialise BigBlockPtr to the place in the BigBlock offset elements from the beginning of the block.
@@ -117,6 +178,19 @@ int big_block_eof(BigBlock * bb, BigBlockPtr * ptr);
  */
 int big_block_read(BigBlock * bb, BigBlockPtr * ptr, BigArray * array); /* raises */
 
+/** Map rows of a block into memory as a read-only BigArray, without copying.
+ *
+ * The array is a view onto the pages of the physical file, in the dtype of the block;
+ * release it with big_block_unmap, not free. The rows must lie in a single physical file.
+ *
+ * @param ptr - The offset to start mapping
+ * @param size - number of rows to map
+ * @param array - an empty BigArray struct, that will be initialized by this function.
+ *
+ * */
+int big_block_map(BigBlock * bb, BigBlockPtr * ptr, size_t size, BigArray * array); /* raises */
+int big_block_unmap(BigArray * array); /* raises */
+
 /** Read from a block and create a BigArray
  *  array->buf shall be freed with the C free() function.
  *
@@ -157,6 +231,12 @@ int _big_block_write_mode(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, co
  * @returns 0 if successful. */
 int big_block_set_attr(BigBlock * block, const char * attrname, const void * data, const char * dtype, int nmemb); /* raises */
 
+/** Set many attributes on a BigBlock at once.
+ * Each BigAttr gives the name, dtype, nmemb and data of one attribute, as in big_block_set_attr.
+ * Names and dtypes are checked, and memory reserved, before any attribute is set.
+ * @returns 0 if successful. */
+int big_block_set_attrs(BigBlock * block, const BigAttr * attrs, size_t nattrs); /* raises */
+
 /** Get an attribute on a BigBlock: attributes are plaintext key-value pairs stored in a special file in the Block directory.
  * Attribute value is stored in the memory pointed to by data, so make sure it is big enough!
  * Arguments:
@@ -202,6 +282,16 @@ void big_file_dtype_format(char * buffer, const char * dtype, const void * data,
 /* Parse a string into a memory location according to dtype; returns non-zero on error */
 int big_file_dtype_parse(const char * buffer, const char * dtype, void * data, const char * fmt);
 
+/** Add the bytes of buf to a running SysV checksum, sum, as `sum -s` does before folding.
+ * The running sums of the physical files of a block are in its header;
+ * the sum of a file is the sum of its chunks in any order. */
+void big_file_sysvsum(unsigned int * sum, const void * buf, size_t size);
+/** Fold a running SysV checksum to the 16 bit checksum printed by `sum -s`. */
+unsigned int big_file_sysvsum_fold(unsigned int sum);
+/** Update a CRC32C (Castagnoli) with the bytes of buf; start from crc = 0.
+ * Uses the SSE4.2 crc32 instruction when the cpu has it. */
+unsigned int big_file_crc32c(unsigned int crc, const void * buf, size_t size);
+
 #define dtype_itemsize big_file_dtype_itemsize
 #define dtype_format big_file_dtype_format
 #define dtype_parse big_file_dtype_parse
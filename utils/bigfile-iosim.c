@@ -51,6 +51,9 @@ int nmemb = 1;
 int Nwriter = 0;
 int Nfile = 0;
 int aggregated = 0;
+size_t collective = 0;
+size_t slab = 0;
+int mpiio = 0;
 size_t size = 1024;
 int mode = MODE_CREATE;
 int purge = 0;
@@ -69,6 +72,10 @@ iosim(char * filename)
         /* Use 0 to force no aggregated IO */
         big_file_mpi_set_aggregated_threshold(0);
     }
+    if(slab > 0)
+        big_file_mpi_set_aggregated_slab_size(slab);
+    big_file_mpi_set_collective_buffer_size(collective);
+    big_file_mpi_set_mpiio(mpiio, MPI_INFO_NULL);
     BigFile bf = {0};
     BigBlock bb = {0};
     BigArray array = {0};
@@ -174,6 +181,7 @@ iosim(char * filename)
     info("Ranks %d\n", NTask);
     info("Writers %d\n", Nwriter);
     info("Aggregated %d\n", aggregated);
+    info("CollectiveBuffer %td\n", collective);
     info("LocalBytes %td\n", localsize * elsize * nmemb);
     info("LocalSize %td\n", localsize);
 
@@ -276,7 +284,7 @@ iosim(char * filename)
     free(times);
 }
 
-char * getoptstr = "hf:n:s:w:m:Ap";
+char * getoptstr = "hf:n:s:w:m:ApC:S:M";
 static void 
 usage() 
 {
@@ -285,6 +293,9 @@ usage()
 
     printf("  command : create / update / read / grow \n"
            " -A : Force Aggreated Mode \n"
+           " -M : MPI-IO backend; -n sets cb_nodes\n"
+           " -S N : move the aggregated data in slabs of N bytes\n"
+           " -C N : two-phase collective IO with N bytes of buffer per round; -n sets the aggregators\n"
            " -n N : set number of writer subcommunicators to N; 0 for number of MPI ranks\n"
            " -s N : set number of rows in the block to N (for create)\n"
            " -w N : set width / nmemb of a block to N (for create)\n"
@@ -314,6 +325,21 @@ int main(int argc, char * argv[]) {
             case 'p':
                 purge = 1;
                 break;
+            case 'M':
+                mpiio = 1;
+                break;
+            case 'C':
+                if(1 != sscanf(optarg, "%td", &collective)) {
+                    usage();
+                    goto byebye;
+                }
+                break;
+            case 'S':
+                if(1 != sscanf(optarg, "%td", &slab)) {
+                    usage();
+                    goto byebye;
+                }
+                break;
             case 'w':
                 if(1 != sscanf(optarg, "%d", &nmemb)) {
                     usage();
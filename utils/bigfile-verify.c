@@ -0,0 +1,420 @@
+/*
+ * Verify the checksums of blocks by reading the physical files directly.
+ *
+ * The physical files are cut into segments; threads (and with BIGFILE_VERIFY_MPI, ranks)
+ * take the segments in turn. The sysv sums of the segments of a file add up to the sum
+ * in the header; blocks with a `checksum` file also have each chunk checked.
+ *
+ * Built twice: bigfile-verify, and bigfile-verify-mpi with -DBIGFILE_VERIFY_MPI.
+ * */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef BIGFILE_VERIFY_MPI
+#include "bigfile-mpi.h"
+#define PROGNAME "bigfile-verify-mpi"
+#else
+#include "bigfile.h"
+#define PROGNAME "bigfile-verify"
+#endif
+
+static void usage() {
+    fprintf(stderr, "usage: " PROGNAME " [-v] [-t nthreads] [-B buffersize] filepath [block ...]\n");
+    fprintf(stderr, "-v print every block checked \n");
+    fprintf(stderr, "-t number of threads reading the physical files \n");
+    fprintf(stderr, "-B bytes per read, at least 4096, also the size of a unit of work \n");
+    fprintf(stderr, "All blocks are checked if none is given. Exits with 1 if any check fails.\n");
+    exit(1);
+}
+
+typedef struct {
+    BigBlock bb;
+    char * name;
+    unsigned int * crc; /* computed chunk checksums, indexed like bb.fcrc */
+} Block;
+
+typedef struct {
+    Block * block;
+    int fileid;
+    size_t start; /* in bytes of the physical file */
+    size_t end;
+    unsigned int sysv;
+    int failed;
+} Work;
+
+static Block * blocks;
+static int nblocks;
+static Work * works;
+static ptrdiff_t nworks;
+static ptrdiff_t nextwork;
+static size_t buffersize = 64 * 1024 * 1024;
+static int verbose = 0;
+static int ThisTask = 0;
+static int NTask = 1;
+
+static size_t
+file_bytes(BigBlock * bb, int fileid)
+{
+    return bb->fsize[fileid] * big_file_dtype_itemsize(bb->dtype) * bb->nmemb;
+}
+
+static char *
+file_path(Block * block, int fileid)
+{
+    char * path = malloc(strlen(block->bb.basename) + 32);
+    sprintf(path, "%s/%06X", block->bb.basename, fileid);
+    return path;
+}
+
+/* compares the chunk checksums of a block; returns the number of bad chunks. */
+static int
+check_chunks(Block * block)
+{
+    BigBlock * bb = &block->bb;
+    int failed = 0;
+    int f;
+    for(f = 0; f < bb->Nfile; f ++) {
+        ptrdiff_t chunk;
+        ptrdiff_t nchunks = bb->fcrcoffset[f + 1] - bb->fcrcoffset[f];
+        for(chunk = 0; chunk < nchunks; chunk ++) {
+            unsigned int crc = block->crc[bb->fcrcoffset[f] + chunk];
+            unsigned int expected;
+            size_t bytes;
+            if(0 != big_block_get_chunk_checksum(bb, f, chunk, &expected, &bytes)) {
+                fprintf(stdout, "FAILED %s:%06X chunk %td: %s\n", block->name, f, chunk, big_file_get_error_message());
+                failed ++;
+                continue;
+            }
+            if(expected == crc) continue;
+            fprintf(stdout, "FAILED %s:%06X chunk %td (bytes %td to %td): crc32c %08x expected %08x\n",
+                block->name, f, chunk,
+                chunk * bb->crcsize, chunk * bb->crcsize + bytes,
+                crc, expected);
+            failed ++;
+        }
+    }
+    return failed;
+}
+
+static void
+verify_work(Work * w, char * buf)
+{
+    BigBlock * bb = &w->block->bb;
+    size_t crcsize = bb->crcsize;
+    char * path = file_path(w->block, w->fileid);
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        fprintf(stdout, "FAILED %s:%06X: cannot open %s (%s)\n", w->block->name, w->fileid, path, strerror(errno));
+        w->failed = 1;
+        free(path);
+        return;
+    }
+    posix_fadvise(fd, w->start, w->end - w->start, POSIX_FADV_SEQUENTIAL);
+
+    /* segments start on a chunk; the running crc of the current chunk */
+    unsigned int crc = 0;
+    size_t offset = w->start;
+    while(offset < w->end) {
+        size_t bytes = w->end - offset;
+        if(bytes > buffersize) bytes = buffersize;
+        ssize_t got = pread(fd, buf, bytes, offset);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) {
+            fprintf(stdout, "FAILED %s:%06X: short read at %td (%s)\n", w->block->name, w->fileid, offset,
+                got < 0 ? strerror(errno) : "end of file");
+            w->failed = 1;
+            break;
+        }
+        big_file_sysvsum(&w->sysv, buf, got);
+        if(crcsize > 0) {
+            size_t done = 0;
+            while(done < (size_t) got) {
+                size_t pos = offset + done;
+                size_t len = crcsize - pos % crcsize;
+                if(len > got - done) len = got - done;
+                crc = big_file_crc32c(crc, buf + done, len);
+                done += len;
+                if((pos + len) % crcsize == 0 || pos + len == file_bytes(bb, w->fileid)) {
+                    /* no other work touches this chunk */
+                    w->block->crc[bb->fcrcoffset[w->fileid] + pos / crcsize] = crc;
+                    crc = 0;
+                }
+            }
+        }
+        offset += got;
+    }
+    /* do not keep the snapshot in the page cache */
+    posix_fadvise(fd, w->start, w->end - w->start, POSIX_FADV_DONTNEED);
+    close(fd);
+    free(path);
+}
+
+static void *
+worker(void * arg)
+{
+    char * buf;
+    if(0 != posix_memalign((void **) &buf, 4096, buffersize)) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    while(1) {
+        /* the works of this rank are ThisTask, ThisTask + NTask, ... */
+        ptrdiff_t i = __atomic_fetch_add(&nextwork, 1, __ATOMIC_RELAXED);
+        i = i * NTask + ThisTask;
+        if(i >= nworks) break;
+        verify_work(&works[i], buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* cuts the physical files into works; a work is a whole number of chunks */
+static void
+make_works(void)
+{
+    int i, f;
+    nworks = 0;
+    for(i = 0; i < nblocks; i ++) {
+        BigBlock * bb = &blocks[i].bb;
+        size_t segment = buffersize;
+        if(bb->crcsize > 0) {
+            segment = (segment + bb->crcsize - 1) / bb->crcsize * bb->crcsize;
+        }
+        for(f = 0; f < bb->Nfile; f ++) {
+            size_t bytes = file_bytes(bb, f);
+            size_t start = 0;
+            do {
+                size_t end = start + segment;
+                if(end > bytes) end = bytes;
+                works = realloc(works, (nworks + 1) * sizeof(Work));
+                memset(&works[nworks], 0, sizeof(Work));
+                works[nworks].block = &blocks[i];
+                works[nworks].fileid = f;
+                works[nworks].start = start;
+                works[nworks].end = end;
+                nworks ++;
+                start = end;
+            } while(start < bytes);
+        }
+    }
+}
+
+/* size of the physical files, and whether they exist */
+static int
+check_sizes(void)
+{
+    int i, f;
+    int failed = 0;
+    for(i = 0; i < nblocks; i ++) {
+        BigBlock * bb = &blocks[i].bb;
+        for(f = ThisTask; f < bb->Nfile; f += NTask) {
+            struct stat st;
+            char * path = file_path(&blocks[i], f);
+            if(0 != stat(path, &st)) {
+                fprintf(stdout, "FAILED %s:%06X: missing (%s)\n", blocks[i].name, f, strerror(errno));
+                failed ++;
+            } else
+            if((size_t) st.st_size != file_bytes(bb, f)) {
+                fprintf(stdout, "FAILED %s:%06X: size %td expected %td\n", blocks[i].name, f,
+                    (ptrdiff_t) st.st_size, file_bytes(bb, f));
+                failed ++;
+            }
+            free(path);
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char * argv[]) {
+    BigFile bf = {0};
+    int nthreads = 1;
+    int opt;
+    int i;
+
+#ifdef BIGFILE_VERIFY_MPI
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+#endif
+
+    while(-1 != (opt = getopt(argc, argv, "vt:B:"))) {
+        switch(opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                if(nthreads < 1) nthreads = 1;
+                break;
+            case 'B':
+                if(1 != sscanf(optarg, "%zu", &buffersize) || buffersize < 4096) {
+                    usage();
+                }
+                buffersize = (buffersize + 4095) / 4096 * 4096;
+                break;
+            default:
+                usage();
+        }
+    }
+    if(argc - optind < 1) {
+        usage();
+    }
+    argv += optind - 1;
+    argc -= optind - 1;
+
+#ifdef BIGFILE_VERIFY_MPI
+    if(0 != big_file_mpi_open(&bf, argv[1], MPI_COMM_WORLD)) {
+#else
+    if(0 != big_file_open(&bf, argv[1])) {
+#endif
+        fprintf(stderr, "failed to open: %s : %s\n", argv[1], big_file_get_error_message());
+        exit(1);
+    }
+
+    char ** names;
+    if(argc > 2) {
+        nblocks = argc - 2;
+        names = argv + 2;
+    } else {
+        if(ThisTask == 0)
+            big_file_list(&bf, &names, &nblocks);
+#ifdef BIGFILE_VERIFY_MPI
+        /* directory listings are not ordered; every rank uses the list of the root */
+        MPI_Bcast(&nblocks, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        if(ThisTask != 0)
+            names = malloc(sizeof(char*) * nblocks);
+        for(i = 0; i < nblocks; i ++) {
+            int len = ThisTask == 0 ? strlen(names[i]) + 1 : 0;
+            MPI_Bcast(&len, 1, MPI_INT, 0, MPI_COMM_WORLD);
+            if(ThisTask != 0)
+                names[i] = malloc(len);
+            MPI_Bcast(names[i], len, MPI_CHAR, 0, MPI_COMM_WORLD);
+        }
+#endif
+    }
+
+    blocks = calloc(nblocks, sizeof(Block));
+    int nopen = 0;
+    for(i = 0; i < nblocks; i ++) {
+#ifdef BIGFILE_VERIFY_MPI
+        int rt = big_file_mpi_open_block(&bf, &blocks[nopen].bb, names[i], MPI_COMM_WORLD);
+#else
+        int rt = big_file_open_block(&bf, &blocks[nopen].bb, names[i]);
+#endif
+        if(0 != rt) {
+            if(ThisTask == 0)
+                fprintf(stdout, "FAILED %s: %s\n", names[i], big_file_get_error_message());
+            continue;
+        }
+        blocks[nopen].name = names[i];
+        if(blocks[nopen].bb.crcsize > 0) {
+            blocks[nopen].crc = calloc(blocks[nopen].bb.fcrcoffset[blocks[nopen].bb.Nfile] + 1, sizeof(unsigned int));
+        }
+        nopen ++;
+    }
+    /* collective open fails on all ranks alike; counted once */
+    int failed = ThisTask == 0 ? nblocks - nopen : 0;
+    nblocks = nopen;
+
+    failed += check_sizes();
+    if(verbose && ThisTask == 0) {
+        fprintf(stderr, "checking %d blocks with %d ranks of %d threads\n", nopen, NTask, nthreads);
+    }
+    make_works();
+
+    pthread_t * threads = malloc(sizeof(pthread_t) * nthreads);
+    for(i = 1; i < nthreads; i ++) {
+        pthread_create(&threads[i], NULL, worker, NULL);
+    }
+    worker(NULL);
+    for(i = 1; i < nthreads; i ++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    /* the sysv sum of a file is the sum over its segments */
+    size_t bytes = 0;
+    int nfiles = 0;
+    for(i = 0; i < nblocks; i ++) {
+        nfiles += blocks[i].bb.Nfile;
+    }
+    unsigned int * sums = calloc(nfiles + 1, sizeof(unsigned int));
+    ptrdiff_t w;
+    for(w = 0; w < nworks; w ++) {
+        failed += works[w].failed;
+        if(w % NTask != ThisTask) continue;
+        int b = works[w].block - blocks;
+        int k = works[w].fileid;
+        for(i = 0; i < b; i ++) k += blocks[i].bb.Nfile;
+        sums[k] += works[w].sysv;
+        bytes += works[w].end - works[w].start;
+    }
+#ifdef BIGFILE_VERIFY_MPI
+    MPI_Allreduce(MPI_IN_PLACE, sums, nfiles, MPI_UNSIGNED, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &bytes, 1, MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD);
+#endif
+
+    int k = 0;
+    for(i = 0; i < nblocks; i ++) {
+        BigBlock * bb = &blocks[i].bb;
+        int f;
+        int blockfailed = 0;
+        if(bb->crcsize > 0) {
+#ifdef BIGFILE_VERIFY_MPI
+            /* only the root has the chunk checksums of an opened block; each chunk
+             * is computed by one rank, the others hold zero. */
+            MPI_Reduce(ThisTask == 0 ? MPI_IN_PLACE : blocks[i].crc, blocks[i].crc,
+                    bb->fcrcoffset[bb->Nfile], MPI_UNSIGNED, MPI_BXOR, 0, MPI_COMM_WORLD);
+#endif
+            if(ThisTask == 0) {
+                int nbad = check_chunks(&blocks[i]);
+                failed += nbad;
+                blockfailed = nbad > 0;
+            }
+            free(blocks[i].crc);
+        }
+        for(f = 0; f < bb->Nfile; f ++, k ++) {
+            if(sums[k] == bb->fchecksum[f]) continue;
+            blockfailed = 1;
+            failed ++;
+            if(ThisTask == 0)
+                fprintf(stdout, "FAILED %s:%06X: sysv sum %u expected %u\n",
+                    blocks[i].name, f, sums[k], bb->fchecksum[f]);
+        }
+        if(verbose && ThisTask == 0 && !blockfailed) {
+            fprintf(stdout, "ok %s\n", blocks[i].name);
+        }
+#ifdef BIGFILE_VERIFY_MPI
+        big_block_mpi_close(bb, MPI_COMM_WORLD);
+#else
+        big_block_close(bb);
+#endif
+    }
+#ifdef BIGFILE_VERIFY_MPI
+    MPI_Bcast(&failed, 1, MPI_INT, 0, MPI_COMM_WORLD);
+#endif
+    if(ThisTask == 0) {
+        fprintf(stderr, "%d blocks, %d files, %td bytes checked, %d failures\n", nblocks, nfiles, bytes, failed);
+    }
+    free(sums);
+    free(works);
+    free(blocks);
+#ifdef BIGFILE_VERIFY_MPI
+    big_file_mpi_close(&bf, MPI_COMM_WORLD);
+    MPI_Finalize();
+#else
+    big_file_close(&bf);
+#endif
+    return failed != 0;
+}